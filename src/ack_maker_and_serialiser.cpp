@@ -1,10 +1,21 @@
 #include "application_messages.h"
+#include "ack_maker_and_serialiser.h"
 
 const char* MsgTypeToString(const MsgType msg_type) {
-    switch (msg_type) {
-    case MsgType_HeartBeat: return "HeartBeat";
-    case MsgType_Ack: return "Ack";
-    case MsgType_VariableLength: return "VarLength";
+    return ApplicationMessages::Name(static_cast<uint8_t>(msg_type));
+}
+
+// Runs on a worker thread: nothing but the command may be touched.
+void AckOffloadedFrame(LoopCommand& command) {
+    const WireVersion version = static_cast<WireVersion>(command.wire_version);
+    FrameView frame = { command.frame.data(), command.frame.size() };
+    if (WireVersion_2 == version) {
+        WireV2HeaderPolicy().DecodeHeader(frame);
+    }
+    else {
+        WireV1HeaderPolicy().DecodeHeader(frame);
     }
-    return "Unknown";
-}
\ No newline at end of file
+    char ack[MaxEncodedAckSize];
+    const size_t num_ack_bytes = EncodeAck(version, frame.n, frame.type, command.ack_seq, ack);
+    command.frame.assign(ack, ack + num_ack_bytes);
+}
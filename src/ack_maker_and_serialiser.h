@@ -1,43 +1,354 @@
 #pragma once
+#include <vector>
 #include "application_messages.h"
+#include "wire_format.h"
 #include "logging.h"
 #include "serialiser.h"
 #include "io_benchmark.h"
+#include "frame_handler.h"
+#include "frame_offloader.h"
+#include "topic_index.h"
 
+static const size_t MaxEncodedAckSize = WireV2HeaderPolicy::MaxHeaderSize + MaxVarintSize;
+
+// The Ack, in version, of a frame of num_bytes_in_frame bytes and of type, which is the seq-th message Acked.
+// Written to p, which has room for MaxEncodedAckSize bytes. Returns its size.
+inline size_t EncodeAck(const WireVersion version, const size_t num_bytes_in_frame, const uint8_t type, const uint64_t seq, char* const p) {
+    if (WireVersion_2 == version) {
+        return EncodeMsg(version, CompactAck(seq), p, (MsgType_HeartBeat == type) ? CompactAck::Flag_OfHeartBeat : 0);
+    }
+    return EncodeMsg(version, Ack(Header{ num_bytes_in_frame, static_cast<char>(type) }), p);
+}
+
+// The work of an offloaded frame (see AckMakerAndSerialiser::EnableOffload(...)): replaces command.frame with its Ack.
+void AckOffloadedFrame(LoopCommand& command);
+
+// SerialiserType: Serialiser or WaitableSerialiser. IOBenchmarkType: IOBenchmark or ThreadSafeIOBenchmark.
+// A batch frame handler (see frame_handler.h) that takes frames above the deserialiser's streaming threshold in pieces,
+// and the message handler of ApplicationMessages, which dispatches every frame to the OnMessage(...) of its type.
+//
+// Every message but an Ack or a Hello is Acked, in wire_version: a HeartBeat is Acked like anything else,
+// as that is what tells the sender we are alive, but quietly.
+// With SetCumulativeAcks(...) (wire v2 only), one CompactAck covers every message up to its seq, rather than one each.
+// With EnableOffload(...), messages of the offloaded types are Acked by a worker thread instead (AckOffloadedFrame(...)),
+// and every Ack goes out in the order of the messages all the same.
+// With EnableTopics(...), Subscribe and Unsubscribe change the loop's TopicIndex, and a Publish goes to every loop.
+template<typename SerialiserType, typename IOBenchmarkType>
 struct AckMakerAndSerialiser {
-    WaitableSerialiser& serialiser;
-    ThreadSafeIOBenchmark& io_benchmark;
+    SerialiserType& serialiser;
+    IOBenchmarkType& io_benchmark;
+
+    // Acks are encoded into acks and appended this many at a time.
+    static const size_t NumAcksPerAppend = 64;
+    static const size_t MaxAckSize = MaxEncodedAckSize;
+
+    // The version Acks are sent in. While it is WireVersion_Unknown (a client waiting for the answer to its Hello),
+    // Acks are held back, and sent once SetWireVersion(...) is called.
+    WireVersion wire_version;
+    // What the latest Hello from the peer agrees on (a v1 peer's Ack of our Hello counts as agreeing on v1),
+    // for the session's owner to act on. WireVersion_Unknown if there has been none.
+    WireVersion hello_wire_version;
+    // Messages Acked so far, i.e. the seq of the latest CompactAck.
+    uint64_t num_msgs_acked;
+    // Our messages the peer has Acked in v1, whose Acks are not numbered.
+    uint64_t num_msgs_acked_by_peer;
+
+    // Cumulative Acks: up to max_msgs_per_ack messages (0: one Ack per message) are covered by one CompactAck, sent 
+    // once it covers that many, or at the end of each batch of frames (HandleFrames(...)). With is_ack_delayed,
+    // it is not sent at the end of a batch: the owner sends it with FlushAcks() when it sees fit (e.g. after a delay).
+    size_t max_msgs_per_ack;
+    bool is_ack_delayed;
+    // Messages Acked (num_msgs_acked counts them) but not sent an Ack yet, and whether they are all HeartBeats.
+    size_t num_msgs_unacked;
+    bool are_unacked_msgs_heartbeats;
+
+    char acks[NumAcksPerAppend * MaxAckSize];
+    size_t num_ack_bytes;
+    size_t num_acks;
+    // Headers (length and type) of the messages to Ack once wire_version is known.
+    std::vector<Header> held_acks;
+
+    // Within a HandleFrames call of several frames, messages are logged at Debug, and the batch as one line at Info.
+    bool is_in_batch;
+    size_t num_msgs_in_batch;
+    size_t num_msg_bytes_in_batch;
+
+    // Offloading (server sessions only): frames of the types in offloaded_msg_types (a bit per type code) are handed
+    // to offloader, and the Acks made here wait in offload_order behind those not back yet. 
+    // offloader is nullptr unless EnableOffload(...) has been called since the last Reset().
+    FrameOffloader* offloader;
+    uint64_t offload_session_tag;
+    uint32_t offloaded_msg_types;
+    OffloadOrder offload_order;
 
-    AckMakerAndSerialiser(WaitableSerialiser& serialiser, ThreadSafeIOBenchmark& io_benchmark)
+    // Topics (server sessions only): Subscribe and Unsubscribe of the session (topic_subscriber_fd) go to topic_index,
+    // and a Publish goes to topic_bus, for every loop to pass on to its subscribers.
+    // Both are nullptr unless EnableTopics(...) has been called since the last Reset().
+    TopicIndex* topic_index;
+    TopicBus* topic_bus;
+    int topic_subscriber_fd;
+
+    // The frame being streamed in, which is Acked once its last byte has arrived. Its body is never held.
+    size_t streamed_frame_size;
+    size_t streamed_body_size;
+    uint8_t streamed_frame_type;
+    bool is_streamed_frame_ackable;
+
+    AckMakerAndSerialiser(SerialiserType& serialiser, IOBenchmarkType& io_benchmark)
         : serialiser(serialiser)
         , io_benchmark(io_benchmark)
-    {}
-
-    bool HandleFrame(char const* const frame_ptr, const size_t num_bytes_in_frame) {
-        if (num_bytes_in_frame >= sizeof(Header)) {
-            const Header& header = *((Header const*)frame_ptr);
-            switch (header.type) {
-            case MsgType_Ack:
-            {
-                const FixedSizeMsg<Ack>& ackMsg = *((FixedSizeMsg<Ack> const*)frame_ptr);
-                long int round_trip_duration_ns = 0;
-                if (io_benchmark.NanosecSinceLastPostOutTime(round_trip_duration_ns)) {
-                    log::PrintLn(log::Info, "Got Ack: rtrip=%ldus (%zu bytes)", round_trip_duration_ns / 1000, std::max(sizeof(Header), ackMsg.body.header_of_original_msg.length) - sizeof(header));
-                }
-            }
-            break;
-            default:
-            {
-                log::PrintLn(log::Info, "Got %s (%zu bytes)", MsgTypeToString(MsgType(header.type)), std::max(sizeof(Header), header.length) - sizeof(header));
+        , is_in_batch(false)
+        , num_msgs_in_batch(0)
+        , num_msg_bytes_in_batch(0)
+    {
+        Reset();
+    }
+
+    void Reset() {
+        wire_version = WireVersion_1;
+        hello_wire_version = WireVersion_Unknown;
+        num_msgs_acked = 0;
+        num_msgs_acked_by_peer = 0;
+        max_msgs_per_ack = 0;
+        is_ack_delayed = false;
+        num_msgs_unacked = 0;
+        are_unacked_msgs_heartbeats = true;
+        num_ack_bytes = 0;
+        num_acks = 0;
+        held_acks.clear();
+        offloader = nullptr;
+        offload_session_tag = 0;
+        offloaded_msg_types = 0;
+        offload_order.Reset();
+        topic_index = nullptr;
+        topic_bus = nullptr;
+        topic_subscriber_fd = -1;
+        streamed_frame_size = 0;
+        streamed_body_size = 0;
+        streamed_frame_type = MsgType_None;
+        is_streamed_frame_ackable = false;
+    }
 
-                // Send Ack only if the incoming message is not an Ack, otherwise we end up sending Acks to-and-fro endlessly.
-                serialiser.AppendFrame(FixedSizeMsg<Ack>(header));
+    void SetWireVersion(const WireVersion version) {
+        wire_version = version;
+        if (WireVersion_Unknown == wire_version) return;
+        for (const Header& header : held_acks) {
+            QueueAck(header.length, static_cast<uint8_t>(header.type));
+        }
+        held_acks.clear();
+        FlushAcks();
+    }
+
+    // session_tag: MakeSessionTag(...) of the session, to which the worker's Acks are returned.
+    void EnableOffload(FrameOffloader* const frame_offloader, const uint64_t session_tag, const uint32_t msg_types) {
+        offloader = frame_offloader;
+        offload_session_tag = session_tag;
+        offloaded_msg_types = msg_types;
+    }
+
+    // subscriber_fd: the session's fd, under which its subscriptions are kept.
+    void EnableTopics(TopicIndex* const index, TopicBus* const bus, const int subscriber_fd) {
+        topic_index = index;
+        topic_bus = bus;
+        topic_subscriber_fd = subscriber_fd;
+    }
+
+    void SetCumulativeAcks(const size_t max_msgs_per_ack_, const bool is_ack_delayed_) {
+        max_msgs_per_ack = max_msgs_per_ack_;
+        is_ack_delayed = is_ack_delayed_ && (max_msgs_per_ack > 0);
+    }
+
+    // A cumulative Ack is being held back (see is_ack_delayed).
+    bool HasDelayedAck() const {
+        return num_msgs_unacked > 0;
+    }
+
+    void FlushAcks() {
+        if (num_msgs_unacked > 0) {
+            // There is always room for one more: acks is appended as soon as it holds NumAcksPerAppend.
+            num_ack_bytes += EncodeMsg(wire_version, CompactAck(num_msgs_acked), &acks[num_ack_bytes], are_unacked_msgs_heartbeats ? CompactAck::Flag_OfHeartBeat : 0);
+            ++num_acks;
+            num_msgs_unacked = 0;
+            are_unacked_msgs_heartbeats = true;
+        }
+        if (0 == num_ack_bytes) return;
+        if (offload_order.IsEmpty()) {
+            serialiser.AppendFrame(acks, num_ack_bytes);
+        }
+        else {
+            offload_order.AppendDone(acks, num_ack_bytes);
+        }
+        num_ack_bytes = 0;
+        num_acks = 0;
+    }
+
+    void QueueAck(const size_t num_bytes_in_frame, const uint8_t type) {
+        if (WireVersion_Unknown == wire_version) {
+            held_acks.push_back(Header{ num_bytes_in_frame, static_cast<char>(type) });
+            return;
+        }
+        if ((WireVersion_2 == wire_version) && (max_msgs_per_ack > 0)) {
+            ++num_msgs_acked;
+            ++num_msgs_unacked;
+            are_unacked_msgs_heartbeats = are_unacked_msgs_heartbeats && (MsgType_HeartBeat == type);
+            if (num_msgs_unacked >= max_msgs_per_ack) {
+                FlushAcks();
             }
-            break;
+            return;
+        }
+        num_ack_bytes += EncodeAck(wire_version, num_bytes_in_frame, type, ++num_msgs_acked, &acks[num_ack_bytes]);
+        if (NumAcksPerAppend == ++num_acks) {
+            FlushAcks();
+        }
+    }
+
+    void AckOrOffload(const FrameView& frame) {
+        if (offloader && (frame.type < 32) && (offloaded_msg_types & (1u << frame.type)) && (WireVersion_Unknown != wire_version)) {
+            // The Acks made so far go ahead of the worker's.
+            FlushAcks();
+            offloader->Offload(frame.ptr, frame.n, &AckOffloadedFrame, offload_session_tag, offload_order.Reserve(), static_cast<uint8_t>(wire_version), ++num_msgs_acked);
+            return;
+        }
+        QueueAck(frame.n, frame.type);
+    }
+
+    // Logs the round trip of every message of ours that acked_seq covers and has not been logged yet (see IOBenchmark,
+    // which also records them in its histograms). A single message is logged at Info, several as one line at Info 
+    // (and each at Debug). Returns false if there were none, e.g. because their send times were not recorded.
+    bool LogRoundTrips(const uint64_t acked_seq) {
+        uint64_t seq = 0;
+        uint64_t first_seq = 0;
+        long int round_trip_duration_ns = 0;
+        long int min_round_trip_duration_ns = 0;
+        long int max_round_trip_duration_ns = 0;
+        size_t num_msgs = 0;
+        while (io_benchmark.PopNanosecSinceMsgSent(acked_seq, seq, round_trip_duration_ns)) {
+            log::PrintLn(log::Debug, "Got Ack #%llu: rtrip=%ldus", (unsigned long long)seq, round_trip_duration_ns / 1000);
+            if (0 == num_msgs++) {
+                first_seq = seq;
+                min_round_trip_duration_ns = round_trip_duration_ns;
             }
-            return true;
+            min_round_trip_duration_ns = std::min(min_round_trip_duration_ns, round_trip_duration_ns);
+            max_round_trip_duration_ns = std::max(max_round_trip_duration_ns, round_trip_duration_ns);
+        }
+        if (1 == num_msgs) {
+            log::PrintLn(log::Info, "Got Ack #%llu: rtrip=%ldus", (unsigned long long)seq, round_trip_duration_ns / 1000);
+        }
+        else if (num_msgs > 1) {
+            log::PrintLn(log::Info, "Got Ack #%llu-#%llu (%zu messages): rtrip=%ld-%ldus", (unsigned long long)first_seq, (unsigned long long)seq, num_msgs
+                , min_round_trip_duration_ns / 1000, max_round_trip_duration_ns / 1000);
         }
-        return false;
+        return num_msgs > 0;
+    }
+
+    void OnMessage(const Ack& ack, const FrameView&) {
+        const Header& header = ack.header_of_original_msg;
+        if (MsgType_HeartBeat == header.type) {
+            log::PrintLn(log::Debug, "Got Ack of HeartBeat");
+        }
+        else if (MsgType_Hello == header.type) {
+            // A v1 peer, that took our Hello for any other message.
+            log::PrintLn(log::Info, "Got Ack of Hello: the peer only speaks wire v1");
+            hello_wire_version = WireVersion_1;
+        }
+        else if (!LogRoundTrips(++num_msgs_acked_by_peer)) {
+            log::PrintLn(log::Info, "Got Ack #%llu (%zu bytes)", (unsigned long long)num_msgs_acked_by_peer, std::max(sizeof(Header), header.length) - sizeof(Header));
+        }
+    }
+
+    // Cumulative or not: it covers every message up to ack.seq.
+    void OnMessage(const CompactAck& ack, const FrameView& frame) {
+        if (frame.flags & CompactAck::Flag_OfHeartBeat) {
+            log::PrintLn(log::Debug, "Got Ack #%llu of HeartBeat", (unsigned long long)ack.seq);
+            return;
+        }
+        if (LogRoundTrips(ack.seq)) return;
+        log::PrintLn(log::Info, "Got Ack #%llu", (unsigned long long)ack.seq);
+    }
+
+    void OnMessage(const Hello& hello, const FrameView&) {
+        hello_wire_version = (hello.wire_version >= WireVersion_Newest) ? WireVersion_Newest : WireVersion_1;
+        log::PrintLn(log::Info, "Got Hello: wire v%u offered, v%u agreed", unsigned(hello.wire_version), unsigned(hello_wire_version));
+    }
+
+    void OnMessage(const HeartBeat&, const FrameView& frame) {
+        log::PrintLn(log::Debug, "Got HeartBeat");
+        AckOrOffload(frame);
+    }
+
+    void OnMessage(const VariableLength&, const FrameView& frame) {
+        log::PrintLn(is_in_batch ? log::Debug : log::Info, "Got %s (%zu bytes)", VariableLength::name, frame.num_body_bytes);
+        ++num_msgs_in_batch;
+        num_msg_bytes_in_batch += frame.num_body_bytes;
+        AckOrOffload(frame);
+    }
+
+    void OnMessage(const Subscribe& subscribe, const FrameView& frame) {
+        const bool is_subscribed = topic_index && topic_index->Subscribe(topic_subscriber_fd, subscribe.topic);
+        log::PrintLn(log::Info, "Got %s to '%.*s'%s", Subscribe::name, int(subscribe.topic.size()), subscribe.topic.data(), is_subscribed ? "" : " (no change)");
+        AckOrOffload(frame);
+    }
+
+    void OnMessage(const Unsubscribe& unsubscribe, const FrameView& frame) {
+        const bool is_unsubscribed = topic_index && topic_index->Unsubscribe(topic_subscriber_fd, unsubscribe.topic);
+        log::PrintLn(log::Info, "Got %s from '%.*s'%s", Unsubscribe::name, int(unsubscribe.topic.size()), unsubscribe.topic.data(), is_unsubscribed ? "" : " (no change)");
+        AckOrOffload(frame);
+    }
+
+    // Passed on in v1, which every loop takes for broadcasts, whatever version it came in.
+    void OnMessage(const Publish& publish, const FrameView& frame) {
+        log::PrintLn(is_in_batch ? log::Debug : log::Info, "Got %s to '%.*s' (%zu bytes)", Publish::name, int(publish.topic.size()), publish.topic.data(), publish.payload.size());
+        ++num_msgs_in_batch;
+        num_msg_bytes_in_batch += frame.num_body_bytes;
+        if (topic_bus) {
+            const std::vector<char> v1_frame = MakePublishFrame(WireVersion_1, publish.topic, publish.payload);
+            topic_bus->Publish(&v1_frame[0], v1_frame.size());
+        }
+        AckOrOffload(frame);
+    }
+
+    // Unknown types and truncated bodies are neither read nor Acked.
+    void OnInvalidFrame(const FrameView& frame) {
+        log::PrintLn(log::Info, "Got an invalid %s frame (%zu bytes)", ApplicationMessages::Name(frame.type), frame.n);
     }
-};
 
+    // Acks are appended NumAcksPerAppend at a time (one serialiser lock for a WaitableSerialiser),
+    // and a batch of several messages is logged as one line (each message is still logged at Debug).
+    void HandleFrames(const FrameView* const frames, const size_t num_frames) {
+        is_in_batch = (num_frames > 1);
+        num_msgs_in_batch = 0;
+        num_msg_bytes_in_batch = 0;
+        for (size_t i = 0; i < num_frames; ++i) {
+            ApplicationMessages::Dispatch(*this, frames[i]);
+        }
+        if (!(is_ack_delayed && HasDelayedAck())) {
+            FlushAcks();
+        }
+        if (is_in_batch && (num_msgs_in_batch > 0)) {
+            log::PrintLn(log::Info, "Got %zu messages (%zu bytes) in one batch", num_msgs_in_batch, num_msg_bytes_in_batch);
+        }
+    }
+
+    // Only the header of a streamed frame is looked at. Only a VariableLength can be long enough to be streamed,
+    // so any other type is invalid.
+    void HandleFrameBegin(const FrameView& first_piece, const size_t num_bytes_in_frame) {
+        streamed_frame_size = num_bytes_in_frame;
+        streamed_body_size = num_bytes_in_frame - (first_piece.n - first_piece.num_body_bytes);
+        streamed_frame_type = first_piece.type;
+        is_streamed_frame_ackable = (MsgType_VariableLength == first_piece.type);
+        log::PrintLn(log::Debug, "Streaming %s (%zu bytes)", ApplicationMessages::Name(first_piece.type), num_bytes_in_frame);
+    }
+
+    void HandleFrameChunk(char const* const, const size_t) {}
+
+    void HandleFrameEnd() {
+        if (!is_streamed_frame_ackable) {
+            log::PrintLn(log::Info, "Got an invalid %s frame (%zu bytes), streamed", ApplicationMessages::Name(streamed_frame_type), streamed_frame_size);
+            return;
+        }
+        log::PrintLn(log::Info, "Got %s (%zu bytes), streamed", ApplicationMessages::Name(streamed_frame_type), streamed_body_size);
+        QueueAck(streamed_frame_size, streamed_frame_type);
+        FlushAcks();
+        is_streamed_frame_ackable = false;
+    }
+};
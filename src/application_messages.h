@@ -2,33 +2,83 @@
 #include <time.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <string_view>
+#include "varint.h"
+#include "message_registry.h"
 
 #pragma pack(push, 1)
 enum MsgType {
     MsgType_HeartBeat,
     MsgType_Ack,
     MsgType_VariableLength,
+    MsgType_Hello,
+    MsgType_CompactAck,
+    MsgType_Subscribe,
+    MsgType_Unsubscribe,
+    MsgType_Publish,
 };
 const char* MsgTypeToString(const MsgType);
 
+// The wire v1 frame header (see wire_format.h).
 struct Header {
     size_t length;
     char type;
 };
 
+struct HeartBeat {
+    static const char msg_type = MsgType::MsgType_HeartBeat;
+    static constexpr char const* name = "HeartBeat";
+};
+
+// The wire v1 Ack, which echoes the header of the message it acknowledges.
 struct Ack {
     static const char msg_type = MsgType::MsgType_Ack;
+    static constexpr char const* name = "Ack";
     Header header_of_original_msg;
+    Ack() : header_of_original_msg() {}
     Ack(const Header& header) {
         memcpy(&header_of_original_msg, &header, sizeof(header));
     }
 };
 
+// Any number of bytes of text, e.g. a console line.
+struct VariableLength {
+    static const char msg_type = MsgType::MsgType_VariableLength;
+    static constexpr char const* name = "VarLength";
+    static const size_t min_num_body_bytes = 0;
+};
+
+// The first frame a client sends, in wire v1, to offer the newest wire version it speaks.
+// The server answers with a Hello of its own, carrying the version both ends then switch to (see wire_format.h).
+struct Hello {
+    static const char msg_type = MsgType::MsgType_Hello;
+    static constexpr char const* name = "Hello";
+    uint8_t wire_version;
+    Hello(const uint8_t wire_version = 0) : wire_version(wire_version) {}
+};
+
+// The wire v2 Ack: just the sequence number (a varint) of the message it acknowledges,
+// counting from 1 the messages the peer has sent that are Acked. 
+// It may be cumulative, covering every message up to seq (see AckMakerAndSerialiser::SetCumulativeAcks(...)).
+// Flag_OfHeartBeat in the frame's flags marks the Ack of a HeartBeat (of only HeartBeats, if cumulative).
+struct CompactAck {
+    static const char msg_type = MsgType::MsgType_CompactAck;
+    static constexpr char const* name = "CompactAck";
+    static const size_t min_num_body_bytes = 1;
+    static const uint8_t Flag_OfHeartBeat = 1;
+    uint64_t seq;
+    CompactAck(const uint64_t seq = 0) : seq(seq) {}
+    static bool Decode(char const* const body_ptr, const size_t num_body_bytes, CompactAck& msg) {
+        return ReadVarint(body_ptr, num_body_bytes, msg.seq) > 0;
+    }
+};
+
 template<typename T>
 struct FixedSizeMsg {
     const Header header;
     T body;
-    
+
     template<typename ... BodyArgs>
     FixedSizeMsg(BodyArgs&& ... body_args)
         : header({ sizeof(Header) + sizeof(T), T::msg_type })
@@ -37,3 +87,45 @@ struct FixedSizeMsg {
 };
 #pragma pack(pop)
 
+// Asks the server for whatever is published to topic (the whole body), until Unsubscribe or the session goes.
+struct Subscribe {
+    static const char msg_type = MsgType::MsgType_Subscribe;
+    static constexpr char const* name = "Subscribe";
+    static const size_t min_num_body_bytes = 1;
+    std::string_view topic;
+    static bool Decode(char const* const body_ptr, const size_t num_body_bytes, Subscribe& msg) {
+        msg.topic = std::string_view(body_ptr, num_body_bytes);
+        return true;
+    }
+};
+
+struct Unsubscribe {
+    static const char msg_type = MsgType::MsgType_Unsubscribe;
+    static constexpr char const* name = "Unsubscribe";
+    static const size_t min_num_body_bytes = 1;
+    std::string_view topic;
+    static bool Decode(char const* const body_ptr, const size_t num_body_bytes, Unsubscribe& msg) {
+        msg.topic = std::string_view(body_ptr, num_body_bytes);
+        return true;
+    }
+};
+
+// A payload for every subscriber of topic. Its body is the topic's size (a varint), the topic, then the payload.
+// The server passes the frame on as it is (in each subscriber's wire version) to the subscribers of topic.
+struct Publish {
+    static const char msg_type = MsgType::MsgType_Publish;
+    static constexpr char const* name = "Publish";
+    static const size_t min_num_body_bytes = 2;
+    std::string_view topic;
+    std::string_view payload;
+    static bool Decode(char const* const body_ptr, const size_t num_body_bytes, Publish& msg) {
+        uint64_t num_topic_bytes = 0;
+        const size_t num_varint_bytes = ReadVarint(body_ptr, num_body_bytes, num_topic_bytes);
+        if ((0 == num_varint_bytes) || (0 == num_topic_bytes) || (num_topic_bytes > (num_body_bytes - num_varint_bytes))) return false;
+        msg.topic = std::string_view(body_ptr + num_varint_bytes, num_topic_bytes);
+        msg.payload = std::string_view(body_ptr + num_varint_bytes + num_topic_bytes, num_body_bytes - num_varint_bytes - num_topic_bytes);
+        return true;
+    }
+};
+
+typedef MessageRegistry<HeartBeat, Ack, VariableLength, Hello, CompactAck, Subscribe, Unsubscribe, Publish> ApplicationMessages;
@@ -0,0 +1,557 @@
+#include "bench.h"
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "session.h"
+#include "epoll_controller.h"
+#include "latency_histogram.h"
+#include "socket_utils.h"
+#include "logging.h"
+
+// Once the run is over, how long the bench waits for the Acks of the messages still in flight.
+static const uint64_t BenchDrainTimeoutNs = 2000000000;
+// Between the last connection being made and the first message being due, so that every thread is waiting for it.
+static const uint64_t BenchStartDelayNs = 10000000;
+
+uint64_t BenchNowNs() {
+    timespec now = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t(now.tv_sec) * 1000000000) + now.tv_nsec;
+}
+
+timespec BenchNsToTimespec(const uint64_t ns) {
+    timespec t = { 0 };
+    t.tv_sec = ns / 1000000000;
+    t.tv_nsec = ns % 1000000000;
+    return t;
+}
+
+// Added to by the bench threads, read by the thread that reports.
+struct BenchTotals {
+    std::atomic<uint64_t> num_msgs_sent;
+    std::atomic<uint64_t> num_msg_bytes_sent;
+    std::atomic<uint64_t> num_msgs_acked;
+    std::atomic<uint64_t> num_connections_made;
+    std::atomic<uint64_t> num_connections_lost;
+    // How far behind schedule the bench itself has been at worst, when it got round to sending a message.
+    std::atomic<uint64_t> max_send_lag_ns;
+    // Threads that have made their connections, and when the first message is due (0 until every thread has).
+    std::atomic<size_t> num_threads_ready;
+    std::atomic<uint64_t> start_ns;
+
+    BenchTotals()
+        : num_msgs_sent(0)
+        , num_msg_bytes_sent(0)
+        , num_msgs_acked(0)
+        , num_connections_made(0)
+        , num_connections_lost(0)
+        , max_send_lag_ns(0)
+        , num_threads_ready(0)
+        , start_ns(0)
+    {}
+};
+
+/*
+One connection of the bench, and the frame handler of its deserialiser (see frame_handler.h).
+Its k-th message (from 0) is due at start_ns + k * interval_ns, and its round trip is timed from then: the due time
+is what SetMsgSentTime(...) records, and an Ack pops the due times of the messages it covers (see IOBenchmark),
+whose round trips go into LatencyHistogram::Global() only.
+Whatever else the server sends (HeartBeats, broadcasts) is Acked, as the client would.
+*/
+struct BenchConnection {
+    int fd;
+    IOBenchmark io_benchmark;
+
+    LengthPrefixedStreamDeserialiser<NegotiatedHeaderPolicy> deserialiser;
+    SocketReader<IOBenchmark> socket_reader;
+    Serialiser serialiser;
+    SocketWriter<IOBenchmark> socket_writer;
+
+    // WireVersion_Unknown until the server has answered our Hello.
+    WireVersion wire_version;
+    WireVersion hello_wire_version;
+    uint64_t start_ns;
+    uint64_t num_msgs_due;
+    uint64_t num_msgs_sent;
+    // Our messages the server has Acked, i.e. round trips.
+    uint64_t num_round_trips;
+    // Messages of the server's that we have Acked, i.e. the seq of our latest CompactAck.
+    uint64_t num_msgs_acked;
+    // When the frames being handled were read, which each round trip they complete ends at.
+    timespec read_time;
+    // Already in BenchLoop's list of connections to flush.
+    bool is_to_flush;
+
+    BenchConnection(const int fd)
+        : fd(fd)
+        , socket_reader(fd)
+        , socket_writer(fd)
+        , wire_version(WireVersion_Unknown)
+        , hello_wire_version(WireVersion_Unknown)
+        , start_ns(0)
+        , num_msgs_due(0)
+        , num_msgs_sent(0)
+        , num_round_trips(0)
+        , num_msgs_acked(0)
+        , read_time()
+        , is_to_flush(false)
+    {
+        io_benchmark.DisableSessionHistogram();
+    }
+
+    bool IsConnected() const { return fd >= 0; }
+
+    uint64_t DueNs(const double interval_ns) const {
+        return start_ns + static_cast<uint64_t>(num_msgs_due * interval_ns);
+    }
+
+    void PopRoundTrips(const uint64_t acked_seq) {
+        uint64_t seq = 0;
+        long int round_trip_duration_ns = 0;
+        while (io_benchmark.PopNanosecSinceMsgSent(acked_seq, seq, round_trip_duration_ns, &read_time)) {
+            ++num_round_trips;
+        }
+    }
+
+    void AckFrame(const FrameView& frame) {
+        if (WireVersion_Unknown == wire_version) return;
+        char ack[MaxEncodedAckSize];
+        serialiser.AppendFrame(ack, EncodeAck(wire_version, frame.n, frame.type, ++num_msgs_acked, ack));
+    }
+
+    void OnMessage(const Ack& ack, const FrameView&) {
+        const Header& header = ack.header_of_original_msg;
+        if (MsgType_HeartBeat == header.type) return;
+        if (MsgType_Hello == header.type) {
+            // A v1 server Acks our Hello instead of answering it.
+            hello_wire_version = WireVersion_1;
+            return;
+        }
+        // v1 Acks are not numbered: each is of our oldest message not Acked yet.
+        PopRoundTrips(num_round_trips + 1);
+    }
+
+    void OnMessage(const CompactAck& ack, const FrameView& frame) {
+        if (frame.flags & CompactAck::Flag_OfHeartBeat) return;
+        PopRoundTrips(ack.seq);
+    }
+
+    void OnMessage(const Hello& hello, const FrameView&) {
+        hello_wire_version = (hello.wire_version >= WireVersion_Newest) ? WireVersion_Newest : WireVersion_1;
+    }
+
+    template<typename T>
+    void OnMessage(const T&, const FrameView& frame) {
+        AckFrame(frame);
+    }
+
+    void OnInvalidFrame(const FrameView& frame) {
+        log::PrintLn(log::Debug, "%d|Got an invalid %s frame (%zu bytes)", fd, ApplicationMessages::Name(frame.type), frame.n);
+    }
+
+    void HandleFrames(const FrameView* const frames, const size_t num_frames) {
+        clock_gettime(CLOCK_MONOTONIC, &read_time);
+        for (size_t i = 0; i < num_frames; ++i) {
+            ApplicationMessages::Dispatch(*this, frames[i]);
+        }
+    }
+};
+
+/*
+One bench thread: its share of the connections, and an epoll loop that appends each connection's messages as they fall due,
+writes them, reads the Acks, and in between sleeps on a timerfd armed for the next due time.
+
+Connection i of the thread is connection (first_index + i * num_threads) of the bench, and the bench's connections are
+due one after the other, interval_ns / num_connections apart, so that together they send evenly spaced messages.
+Within the thread, the next message due is therefore always that of the connection after the one that sent last.
+*/
+class BenchLoop {
+    const BenchConfig& config_;
+    BenchTotals& totals_;
+    const size_t first_index_;
+    // Between two messages of one connection.
+    const double interval_ns_;
+    std::vector<std::unique_ptr<BenchConnection>> connections_;
+    size_t num_connected_;
+    EpollController epoll_controller_;
+    int fd_timer_;
+    uint64_t timer_due_ns_;
+    // The connection whose message is due next.
+    size_t next_connection_;
+    // Connections with frames appended since they were last flushed.
+    std::vector<BenchConnection*> connections_to_flush_;
+    // xorshift64 state, for drawing message sizes.
+    uint64_t random_state_;
+    // Every message body is a prefix of this.
+    std::vector<char> body_;
+
+    BenchLoop(const BenchLoop&) = delete;
+    BenchLoop& operator=(const BenchLoop&) = delete;
+
+    static const uint64_t TimerEventData = ~uint64_t(0);
+
+    bool Connect(BenchConnection& connection);
+    size_t NextMsgSize();
+    void AppendDueMsgs(const uint64_t until_ns);
+    void Flush(BenchConnection& connection);
+    void FlushAll();
+    void Read(BenchConnection& connection);
+    void Close(BenchConnection& connection, char const* const reason);
+    uint64_t NumMsgsInFlight() const;
+    bool ArmTimer(const uint64_t due_ns);
+    void Run(const uint64_t start_ns);
+
+public:
+    BenchLoop(const BenchConfig& config, BenchTotals& totals, const size_t first_index);
+    ~BenchLoop();
+
+    // Makes the thread's connections, waits for every other thread to have made theirs, then runs the bench.
+    void ConnectThenRun();
+};
+
+BenchLoop::BenchLoop(const BenchConfig& config, BenchTotals& totals, const size_t first_index)
+    : config_(config)
+    , totals_(totals)
+    , first_index_(first_index)
+    , interval_ns_(1e9 * config.num_connections / config.msgs_per_s)
+    , num_connected_(0)
+    , fd_timer_(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+    , timer_due_ns_(0)
+    , next_connection_(0)
+    , random_state_(0x9e3779b97f4a7c15ull * (first_index + 1))
+    , body_(std::max<size_t>(config.max_msg_size, 1), 'x')
+{
+    if (fd_timer_ < 0) {
+        log::PrintLnCurrentErrno(log::Error, "Failed to create timerfd. Messages are sent on millisecond timeouts instead");
+    }
+    else {
+        epoll_controller_.AddToInterestList(fd_timer_, EPOLLIN, TimerEventData);
+    }
+}
+
+BenchLoop::~BenchLoop() {
+    for (auto& connection : connections_) {
+        if (connection->IsConnected()) {
+            close(connection->fd);
+        }
+    }
+    if (fd_timer_ >= 0) {
+        close(fd_timer_);
+    }
+}
+
+// Connects (blocking), then offers the newest wire version with a Hello and waits for the answer, as the client does.
+bool BenchLoop::Connect(BenchConnection& connection) {
+    AppendMsg(connection.serialiser, WireVersion_1, Hello(WireVersion_Newest));
+    while (!connection.serialiser.HasSerialisedAll()) {
+        connection.serialiser.Serialise(connection.socket_writer, config_.write_threshold);
+        if (PeerHungUp == SummariseSocketIOStatus(config_.write_threshold, connection.socket_writer.last_status, connection.socket_writer.last_errno)) return false;
+    }
+    while (WireVersion_Unknown == connection.hello_wire_version) {
+        if (PeerHungUp == GetDataThenDeserialise(connection.deserialiser, connection.socket_reader, config_.read_threshold, connection)) return false;
+    }
+    connection.wire_version = connection.hello_wire_version;
+    // Whatever came after the answer, now that the deserialiser has switched to the agreed version.
+    connection.deserialiser.Deserialise(connection);
+
+    SetNoBlocking(connection.fd);
+    return 0 == epoll_controller_.AddToInterestList(connection.fd, EPOLLIN, connections_.size() - 1);
+}
+
+void BenchLoop::ConnectThenRun() {
+    for (size_t i = first_index_; i < config_.num_connections; i += config_.num_threads) {
+        int fd = -1;
+        if (!BindOrConnect(config_.hostname, config_.remote_port, false, fd)) {
+            log::PrintLn(log::Error, "Failed to connect to %s:%u", config_.hostname, config_.remote_port);
+            close(fd);
+            fd = -1;
+        }
+        else {
+            DisableNaglesAlgorithm(fd);
+        }
+        connections_.push_back(std::make_unique<BenchConnection>(fd));
+        BenchConnection& connection = *connections_.back();
+        // Staggered, so that the bench's messages are evenly spaced (see above).
+        connection.start_ns = static_cast<uint64_t>(i * (interval_ns_ / config_.num_connections));
+        if (!connection.IsConnected()) continue;
+        if (Connect(connection)) {
+            ++num_connected_;
+            continue;
+        }
+        log::PrintLn(log::Error, "%d|Server hung up before answering Hello", fd);
+        close(fd);
+        connection.fd = -1;
+    }
+    if (!connections_.empty() && connections_.front()->IsConnected()) {
+        log::PrintLn(log::Debug, "Bench thread %zu speaking wire v%u", first_index_, unsigned(connections_.front()->wire_version));
+    }
+    totals_.num_connections_made.fetch_add(num_connected_, std::memory_order_relaxed);
+    totals_.num_threads_ready.fetch_add(1, std::memory_order_release);
+
+    uint64_t start_ns = 0;
+    while (0 == (start_ns = totals_.start_ns.load(std::memory_order_acquire))) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (num_connected_ > 0) {
+        Run(start_ns);
+    }
+}
+
+// Uniform in [min_msg_size, max_msg_size] (bar a modulo bias, negligible for ranges far below 2^64).
+size_t BenchLoop::NextMsgSize() {
+    if (config_.min_msg_size == config_.max_msg_size) return config_.min_msg_size;
+    random_state_ ^= random_state_ << 13;
+    random_state_ ^= random_state_ >> 7;
+    random_state_ ^= random_state_ << 17;
+    return config_.min_msg_size + static_cast<size_t>(random_state_ % (config_.max_msg_size - config_.min_msg_size + 1));
+}
+
+// Appends every message due before until_ns, in the order they are due.
+void BenchLoop::AppendDueMsgs(const uint64_t until_ns) {
+    uint64_t num_msgs = 0;
+    uint64_t num_msg_bytes = 0;
+    uint64_t max_lag_ns = 0;
+    const uint64_t now_ns = BenchNowNs();
+    while (1) {
+        BenchConnection& connection = *connections_[next_connection_];
+        const uint64_t due_ns = connection.DueNs(interval_ns_);
+        if (due_ns >= until_ns) break;
+
+        ++connection.num_msgs_due;
+        next_connection_ = (next_connection_ + 1) % connections_.size();
+        if (!connection.IsConnected()) continue;
+
+        const size_t num_body_bytes = NextMsgSize();
+        char header[WireV2HeaderPolicy::MaxHeaderSize + sizeof(Header)];
+        connection.serialiser.AppendFrame(header, EncodeHeader(connection.wire_version, MsgType_VariableLength, num_body_bytes, header));
+        if (num_body_bytes > 0) {
+            connection.serialiser.AppendFrame(&body_[0], num_body_bytes);
+        }
+        const timespec due_time = BenchNsToTimespec(due_ns);
+        connection.io_benchmark.SetMsgSentTime(&due_time);
+        ++connection.num_msgs_sent;
+        if (!connection.is_to_flush) {
+            connection.is_to_flush = true;
+            connections_to_flush_.push_back(&connection);
+        }
+        ++num_msgs;
+        num_msg_bytes += num_body_bytes;
+        max_lag_ns = std::max(max_lag_ns, (now_ns > due_ns) ? (now_ns - due_ns) : 0);
+    }
+    if (0 == num_msgs) return;
+
+    totals_.num_msgs_sent.fetch_add(num_msgs, std::memory_order_relaxed);
+    totals_.num_msg_bytes_sent.fetch_add(num_msg_bytes, std::memory_order_relaxed);
+    uint64_t max_send_lag_ns = totals_.max_send_lag_ns.load(std::memory_order_relaxed);
+    while ((max_lag_ns > max_send_lag_ns) && !totals_.max_send_lag_ns.compare_exchange_weak(max_send_lag_ns, max_lag_ns, std::memory_order_relaxed)) {}
+}
+
+// Writes as much as the socket takes, and watches for EPOLLOUT while some is left.
+void BenchLoop::Flush(BenchConnection& connection) {
+    while (!connection.serialiser.HasSerialisedAll()) {
+        connection.serialiser.SerialiseV(connection.socket_writer, config_.write_threshold);
+        const SocketIOStatus e = SummariseSocketIOStatus(config_.write_threshold, connection.socket_writer.last_status, connection.socket_writer.last_errno);
+        if (PeerHungUp == e) {
+            Close(connection, "on write");
+            return;
+        }
+        if (WouldBlock == e) break;
+    }
+    const bool has_pending = !connection.serialiser.HasSerialisedAll();
+    const uint32_t events = EPOLLOUT;
+    epoll_controller_.ModifyInterestList(connection.fd, has_pending ? events : 0, has_pending ? 0 : events);
+}
+
+void BenchLoop::FlushAll() {
+    for (BenchConnection* const connection_ptr : connections_to_flush_) {
+        connection_ptr->is_to_flush = false;
+        if (connection_ptr->IsConnected()) {
+            Flush(*connection_ptr);
+        }
+    }
+    connections_to_flush_.clear();
+}
+
+void BenchLoop::Read(BenchConnection& connection) {
+    const uint64_t num_round_trips = connection.num_round_trips;
+    const SocketIOStatus e = GetDataThenDeserialise(connection.deserialiser, connection.socket_reader, config_.read_threshold, connection);
+    totals_.num_msgs_acked.fetch_add(connection.num_round_trips - num_round_trips, std::memory_order_relaxed);
+    if (PeerHungUp == e) {
+        Close(connection, "on read");
+        return;
+    }
+    // Acks of whatever the server sent of its own.
+    if (!connection.serialiser.HasSerialisedAll()) {
+        Flush(connection);
+    }
+}
+
+void BenchLoop::Close(BenchConnection& connection, char const* const reason) {
+    log::PrintLn(log::Warn, "%d|Server hung up (%s), with %llu messages in flight", connection.fd, reason
+        , (unsigned long long)(connection.num_msgs_sent - connection.num_round_trips));
+    epoll_controller_.RemoveFromInterestList(connection.fd);
+    close(connection.fd);
+    connection.fd = -1;
+    --num_connected_;
+    totals_.num_connections_lost.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t BenchLoop::NumMsgsInFlight() const {
+    uint64_t num_msgs_in_flight = 0;
+    for (const auto& connection : connections_) {
+        if (connection->IsConnected()) {
+            num_msgs_in_flight += connection->num_msgs_sent - connection->num_round_trips;
+        }
+    }
+    return num_msgs_in_flight;
+}
+
+// Returns false if the timerfd cannot wake the loop at due_ns.
+bool BenchLoop::ArmTimer(const uint64_t due_ns) {
+    if (fd_timer_ < 0) return false;
+    if (timer_due_ns_ == due_ns) return true;
+
+    itimerspec spec = { 0 };
+    spec.it_value = BenchNsToTimespec(due_ns);
+    if (timerfd_settime(fd_timer_, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+        log::PrintLnCurrentErrno(log::Error, "%d|Failed to arm timerfd", fd_timer_);
+        return false;
+    }
+    timer_due_ns_ = due_ns;
+    return true;
+}
+
+void BenchLoop::Run(const uint64_t start_ns) {
+    for (auto& connection : connections_) {
+        connection->start_ns += start_ns;
+    }
+    const uint64_t end_ns = start_ns + (config_.duration_s * 1000000000);
+    uint64_t drain_end_ns = 0;
+    static const int MaxEvents = 256;
+    epoll_event events[MaxEvents];
+
+    while (num_connected_ > 0) {
+        const uint64_t now_ns = BenchNowNs();
+        uint64_t wake_ns = 0;
+        if (now_ns < end_ns) {
+            AppendDueMsgs(std::min(now_ns + 1, end_ns));
+            FlushAll();
+            wake_ns = std::min(connections_[next_connection_]->DueNs(interval_ns_), end_ns);
+        }
+        else {
+            if (0 == drain_end_ns) {
+                drain_end_ns = now_ns + BenchDrainTimeoutNs;
+            }
+            if ((now_ns >= drain_end_ns) || (0 == NumMsgsInFlight())) break;
+            wake_ns = drain_end_ns;
+        }
+
+        int timeout = 0;
+        const uint64_t then_ns = BenchNowNs();
+        if (wake_ns > then_ns) {
+            timeout = ArmTimer(wake_ns) ? -1 : static_cast<int>((wake_ns - then_ns + 999999) / 1000000);
+        }
+        const int num_events = epoll_controller_.WaitForEvents(events, MaxEvents, timeout);
+        for (int i = 0; i < num_events; ++i) {
+            if (TimerEventData == events[i].data.u64) {
+                uint64_t num_expirations = 0;
+                if ((read(fd_timer_, &num_expirations, sizeof(num_expirations)) < 0) && (EAGAIN != errno)) {
+                    log::PrintLnCurrentErrno(log::Error, "%d|Failed to read timerfd", fd_timer_);
+                }
+                timer_due_ns_ = 0;
+                continue;
+            }
+            BenchConnection& connection = *connections_[events[i].data.u64];
+            if (connection.IsConnected() && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                Read(connection);
+            }
+            if (connection.IsConnected() && (events[i].events & EPOLLOUT)) {
+                Flush(connection);
+            }
+        }
+    }
+}
+
+// One line: the messages sent and Acked per second since the last report, and the round trip percentiles so far.
+void ReportBenchInterval(const BenchTotals& totals, const double elapsed_s, const double interval_s, uint64_t& last_num_msgs_sent, uint64_t& last_num_msg_bytes_sent, uint64_t& last_num_msgs_acked) {
+    const uint64_t num_msgs_sent = totals.num_msgs_sent.load(std::memory_order_relaxed);
+    const uint64_t num_msg_bytes_sent = totals.num_msg_bytes_sent.load(std::memory_order_relaxed);
+    const uint64_t num_msgs_acked = totals.num_msgs_acked.load(std::memory_order_relaxed);
+    const LatencyHistogram& round_trips = LatencyHistogram::Global();
+    log::PrintLn(log::Info, "%6.1fs: sent %.0f msgs/s (%.2f MB/s), acked %.0f msgs/s, %llu in flight. So far p50=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus"
+        , elapsed_s
+        , (num_msgs_sent - last_num_msgs_sent) / interval_s
+        , (num_msg_bytes_sent - last_num_msg_bytes_sent) / interval_s / 1e6
+        , (num_msgs_acked - last_num_msgs_acked) / interval_s
+        , (unsigned long long)(num_msgs_sent - num_msgs_acked)
+        , round_trips.ValueAtFraction(0.5) / 1000.0, round_trips.ValueAtFraction(0.99) / 1000.0
+        , round_trips.ValueAtFraction(0.999) / 1000.0, round_trips.Max() / 1000.0);
+    last_num_msgs_sent = num_msgs_sent;
+    last_num_msg_bytes_sent = num_msg_bytes_sent;
+    last_num_msgs_acked = num_msgs_acked;
+}
+
+int RunBench(const BenchConfig& config) {
+    log::PrintLn(log::Info, "Running bench against %s:%u: %zu connection(s) on %zu thread(s), %zu msgs/s of %zu-%zu bytes, for %zus"
+        , config.hostname, config.remote_port, config.num_connections, config.num_threads
+        , config.msgs_per_s, config.min_msg_size, config.max_msg_size, config.duration_s);
+    LatencyHistogram::Global().Reset();
+    BenchTotals totals;
+
+    std::vector<std::unique_ptr<BenchLoop>> loops;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < config.num_threads; ++i) {
+        loops.push_back(std::make_unique<BenchLoop>(config, totals, i));
+    }
+    for (auto& loop : loops) {
+        threads.emplace_back(&BenchLoop::ConnectThenRun, loop.get());
+    }
+    while (totals.num_threads_ready.load(std::memory_order_acquire) < config.num_threads) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    const uint64_t num_connections_made = totals.num_connections_made.load(std::memory_order_relaxed);
+    const uint64_t start_ns = BenchNowNs() + BenchStartDelayNs;
+    totals.start_ns.store(start_ns, std::memory_order_release);
+    log::PrintLn(log::Info, "%llu of %zu connection(s) made", (unsigned long long)num_connections_made, config.num_connections);
+    if (0 == num_connections_made) {
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        log::PrintLn(log::Error, "No connection could be made to %s:%u", config.hostname, config.remote_port);
+        return -1;
+    }
+
+    uint64_t last_num_msgs_sent = 0;
+    uint64_t last_num_msg_bytes_sent = 0;
+    uint64_t last_num_msgs_acked = 0;
+    for (size_t i = 1; (i * config.report_interval_s) <= config.duration_s; ++i) {
+        const timespec report_time = BenchNsToTimespec(start_ns + (i * config.report_interval_s * 1000000000));
+        while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &report_time, NULL)) {}
+        ReportBenchInterval(totals, double(i * config.report_interval_s), double(config.report_interval_s), last_num_msgs_sent, last_num_msg_bytes_sent, last_num_msgs_acked);
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    const uint64_t num_msgs_sent = totals.num_msgs_sent.load(std::memory_order_relaxed);
+    const uint64_t num_msgs_acked = totals.num_msgs_acked.load(std::memory_order_relaxed);
+    log::PrintLn(log::Info, "Bench done: %llu msgs sent in %zus (%.0f msgs/s, %.2f MB/s), %llu acked, %llu never acked, %llu connection(s) lost"
+        , (unsigned long long)num_msgs_sent, config.duration_s
+        , double(num_msgs_sent) / config.duration_s
+        , double(totals.num_msg_bytes_sent.load(std::memory_order_relaxed)) / config.duration_s / 1e6
+        , (unsigned long long)num_msgs_acked, (unsigned long long)(num_msgs_sent - num_msgs_acked)
+        , (unsigned long long)totals.num_connections_lost.load(std::memory_order_relaxed));
+    // Round trips are timed from when messages were due, so a bench that falls behind shows in them too: this tells it apart.
+    log::PrintLn(log::Info, "The bench sent at most %.1fus behind schedule", totals.max_send_lag_ns.load(std::memory_order_relaxed) / 1000.0);
+    LatencyHistogram::Global().Report(log::Info, "Round trips from due time");
+    return 0;
+}
@@ -0,0 +1,7 @@
+#pragma once
+#include "config.h"
+
+// ncc bench (see BenchConfig): connects, sends on schedule for config.duration_s while logging throughput and round trips
+// every config.report_interval_s, waits a little for the Acks of the last messages, then logs the whole run.
+// Returns -1 if no connection could be made, 0 otherwise.
+int RunBench(const BenchConfig&);
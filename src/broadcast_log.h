@@ -0,0 +1,320 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <deque>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include "serialiser.h"
+#include "wire_format.h"
+
+/*
+One loop's broadcast frames, stored once however many sessions they go to.
+
+The log is an append-only byte sequence: a frame appended at position p occupies [p, p + size), and positions are never reused.
+Each session reads it through its own cursor (the position of the next broadcast byte it has to send),
+which starts at End() when the session joins, so a session only gets the broadcasts made while it is connected.
+
+Every frame counts the sessions that still have to send it. It drops to 0 once every cursor has passed it,
+and the frame is then freed (cursors only move forward, so frames are always freed from the front).
+So the memory held is what the slowest session has yet to send, and End() - cursor tells how far a session lags.
+
+Single owner: only the loop thread may call into it.
+*/
+class BroadcastLog {
+    struct Frame {
+        uint64_t begin;
+        size_t num_readers;
+        std::vector<char> bytes;
+
+        uint64_t End() const { return begin + bytes.size(); }
+    };
+
+    std::deque<Frame> frames_;
+    uint64_t begin_;
+    uint64_t end_;
+
+    BroadcastLog(const BroadcastLog&) = delete;
+    BroadcastLog& operator=(const BroadcastLog&) = delete;
+
+    // Index of the frame that holds the byte at position, or frames_.size() if there is none.
+    size_t FrameIndexAt(const uint64_t position) const {
+        if ((position < begin_) || (position >= end_)) return frames_.size();
+        const auto it = std::upper_bound(frames_.begin(), frames_.end(), position
+            , [](const uint64_t p, const Frame& frame) { return p < frame.begin; });
+        return (it - frames_.begin()) - 1;
+    }
+
+    void FreeUnreadFrames() {
+        while ((!frames_.empty()) && (0 == frames_.front().num_readers)) {
+            frames_.pop_front();
+        }
+        begin_ = frames_.empty() ? end_ : frames_.front().begin;
+    }
+
+public:
+    BroadcastLog()
+        : begin_(0)
+        , end_(0)
+    {}
+
+    uint64_t Begin() const { return begin_; }
+    uint64_t End() const { return end_; }
+    size_t NumFrames() const { return frames_.size(); }
+    size_t NumBytesHeld() const { return end_ - begin_; }
+    size_t Lag(const uint64_t cursor) const { return end_ - cursor; }
+
+    // num_readers: the number of sessions that will send it, i.e. those that have joined and not left.
+    void Append(std::vector<char>&& frame, const size_t num_readers) {
+        if (frame.empty()) return;
+        const uint64_t begin = end_;
+        end_ += frame.size();
+        if (0 == num_readers) {
+            FreeUnreadFrames();
+            return;
+        }
+        frames_.push_back(Frame{ begin, num_readers, std::move(frame) });
+    }
+
+    // Returns the cursor of a session that has just connected.
+    uint64_t Join() const {
+        return end_;
+    }
+
+    // For a session that disconnects: it no longer holds back the frames it has not sent.
+    void Leave(const uint64_t cursor) {
+        for (size_t i = FrameIndexAt(cursor); i < frames_.size(); ++i) {
+            --frames_[i].num_readers;
+        }
+        FreeUnreadFrames();
+    }
+
+    // Where the frame the cursor is in ends, i.e. cursor itself if it is between frames.
+    uint64_t FrameBoundaryAtOrAfter(const uint64_t cursor) const {
+        const size_t i = FrameIndexAt(cursor);
+        if (i == frames_.size()) return cursor;
+        return (frames_[i].begin == cursor) ? cursor : frames_[i].End();
+    }
+
+    // Fills iov with the bytes from position from up to position to (at most max_iov iovecs and max_bytes bytes).
+    size_t Gather(const uint64_t from, const uint64_t to, iovec* const iov, const size_t max_iov, const size_t max_bytes, size_t& num_bytes_gathered) const {
+        size_t n = 0;
+        num_bytes_gathered = 0;
+        uint64_t position = from;
+        for (size_t i = FrameIndexAt(from); (i < frames_.size()) && (position < to) && (n < max_iov) && (num_bytes_gathered < max_bytes); ++i) {
+            const Frame& frame = frames_[i];
+            const size_t offset = position - frame.begin;
+            const size_t num_bytes = std::min<uint64_t>(std::min<uint64_t>(frame.End(), to) - position, max_bytes - num_bytes_gathered);
+            iov[n].iov_base = const_cast<char*>(&frame.bytes[offset]);
+            iov[n].iov_len = num_bytes;
+            num_bytes_gathered += num_bytes;
+            position += num_bytes;
+            ++n;
+        }
+        return n;
+    }
+
+    // Moves cursor n bytes forward, releasing the frames it moves past.
+    void Advance(uint64_t& cursor, const size_t n) {
+        if (0 == n) return;
+        const uint64_t new_cursor = cursor + n;
+        bool is_frame_released = false;
+        for (size_t i = FrameIndexAt(cursor); (i < frames_.size()) && (frames_[i].End() <= new_cursor); ++i) {
+            --frames_[i].num_readers;
+            is_frame_released = true;
+        }
+        cursor = new_cursor;
+        if (is_frame_released) {
+            FreeUnreadFrames();
+        }
+    }
+};
+
+/*
+Drops every broadcast a session has yet to send, by moving its cursor to the end of the log.
+The rest of a part-sent frame is not dropped (the peer is midway through receiving it): it is copied to the front of 
+the session's serialiser instead. Returns the number of bytes dropped.
+*/
+inline size_t SkipBroadcasts(Serialiser& serialiser, BroadcastLog& broadcast_log, uint64_t& cursor) {
+    const uint64_t boundary = broadcast_log.FrameBoundaryAtOrAfter(cursor);
+    if (boundary != cursor) {
+        iovec rest_of_frame;
+        size_t num_bytes = 0;
+        if (broadcast_log.Gather(cursor, boundary, &rest_of_frame, 1, boundary - cursor, num_bytes)) {
+            serialiser.PrependBytes(static_cast<const char*>(rest_of_frame.iov_base), num_bytes);
+        }
+    }
+    const size_t num_bytes_dropped = broadcast_log.End() - boundary;
+    broadcast_log.Advance(cursor, broadcast_log.End() - cursor);
+    return num_bytes_dropped;
+}
+
+/*
+Copies every broadcast a session has yet to send into the session's serialiser, and moves its cursor to the end of the log,
+e.g. for a session that moves to another log. The rest of a part-sent frame goes to the front of the serialiser 
+(as in SkipBroadcasts) and whole frames to the back. Returns the number of bytes copied.
+*/
+inline size_t TakeBroadcasts(Serialiser& serialiser, BroadcastLog& broadcast_log, uint64_t& cursor) {
+    const uint64_t boundary = broadcast_log.FrameBoundaryAtOrAfter(cursor);
+    iovec iov[IOV_MAX];
+    size_t num_bytes = 0;
+    if (boundary != cursor) {
+        if (broadcast_log.Gather(cursor, boundary, iov, 1, boundary - cursor, num_bytes)) {
+            serialiser.PrependBytes(static_cast<const char*>(iov[0].iov_base), num_bytes);
+        }
+    }
+    for (uint64_t position = boundary; position < broadcast_log.End(); position += num_bytes) {
+        const size_t iovcnt = broadcast_log.Gather(position, broadcast_log.End(), iov, IOV_MAX, SIZE_MAX, num_bytes);
+        for (size_t i = 0; i < iovcnt; ++i) {
+            serialiser.AppendFrame(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+        }
+    }
+    const size_t num_bytes_taken = broadcast_log.End() - cursor;
+    broadcast_log.Advance(cursor, num_bytes_taken);
+    return num_bytes_taken;
+}
+
+/*
+A loop's broadcasts, in one BroadcastLog per wire version: each session reads the log of the version it sends in 
+(see wire_format.h), so that a broadcast is encoded once per version rather than once per session.
+Broadcasts come in as v1 frames (as the console input loop makes them), and are only re-encoded for a version
+that has sessions.
+
+Single owner: only the loop thread may call into it.
+*/
+class BroadcastLogs {
+    BroadcastLog logs_[WireVersion_Newest];
+    size_t num_readers_[WireVersion_Newest];
+
+    BroadcastLogs(const BroadcastLogs&) = delete;
+    BroadcastLogs& operator=(const BroadcastLogs&) = delete;
+
+public:
+    BroadcastLogs()
+        : num_readers_()
+    {}
+
+    BroadcastLog& Of(const WireVersion version) { return logs_[version - 1]; }
+    const BroadcastLog& Of(const WireVersion version) const { return logs_[version - 1]; }
+
+    size_t NumBytesHeld() const {
+        size_t num_bytes = 0;
+        for (const BroadcastLog& log : logs_) {
+            num_bytes += log.NumBytesHeld();
+        }
+        return num_bytes;
+    }
+
+    // Returns the cursor, in the log of version, of a session that has just connected or moved to version.
+    uint64_t Join(const WireVersion version) {
+        ++num_readers_[version - 1];
+        return Of(version).Join();
+    }
+
+    void Leave(const WireVersion version, const uint64_t cursor) {
+        --num_readers_[version - 1];
+        Of(version).Leave(cursor);
+    }
+
+    void Append(std::vector<char>&& v1_frame) {
+        if (v1_frame.empty()) return;
+        if (num_readers_[WireVersion_2 - 1] > 0) {
+            Of(WireVersion_2).Append(ReencodeV1Frame(&v1_frame[0], v1_frame.size(), WireVersion_2), num_readers_[WireVersion_2 - 1]);
+        }
+        Of(WireVersion_1).Append(std::move(v1_frame), num_readers_[WireVersion_1 - 1]);
+    }
+};
+
+// A keyed broadcast (see ConflatingQueue), shared by the sessions of each wire version. It comes in as a v1 frame, and
+// is only re-encoded for another version the first time a session of that version asks for it.
+class SharedFrames {
+    std::shared_ptr<const std::vector<char>> frames_[WireVersion_Newest];
+public:
+    SharedFrames(std::vector<char>&& v1_frame) {
+        frames_[WireVersion_1 - 1] = std::make_shared<const std::vector<char>>(std::move(v1_frame));
+    }
+
+    const std::shared_ptr<const std::vector<char>>& In(const WireVersion version) {
+        std::shared_ptr<const std::vector<char>>& frame = frames_[version - 1];
+        if (!frame) {
+            const std::vector<char>& v1_frame = *frames_[WireVersion_1 - 1];
+            frame = std::make_shared<const std::vector<char>>(ReencodeV1Frame(&v1_frame[0], v1_frame.size(), version));
+        }
+        return frame;
+    }
+};
+
+/*
+What GatherWithBroadcasts(...) gathered from each part, for ConsumeWithBroadcasts(...) to hand the bytes sent back to.
+*/
+struct BroadcastGather {
+    size_t num_bytes_part_sent_frame;
+    size_t num_bytes_own;
+    size_t num_bytes;
+};
+
+/*
+Gathers a session's own frames (from its serialiser) and the broadcasts it has not sent yet (from cursor on) into iov,
+up to max_iov iovecs and max_bytes_to_gather bytes, without consuming any of them. Returns the number of iovecs filled.
+
+The two streams may only be interleaved at frame boundaries. A short write can leave at most one frame part-sent,
+the one it stopped in, so the gather order is: the rest of a part-sent broadcast frame, then the serialiser's bytes,
+then the other broadcasts. Each part is only gathered once everything before it has been.
+
+The iovecs point into the serialiser's segments and the log's frames, which stay put until they are consumed.
+*/
+inline size_t GatherWithBroadcasts(const Serialiser& serialiser, const BroadcastLog& broadcast_log, const uint64_t cursor, iovec* const iov, const size_t max_iov, const size_t max_bytes_to_gather, BroadcastGather& gather) {
+    size_t iovcnt = 0;
+    gather = BroadcastGather{ 0, 0, 0 };
+
+    const uint64_t boundary = broadcast_log.FrameBoundaryAtOrAfter(cursor);
+    iovcnt += broadcast_log.Gather(cursor, boundary, &iov[iovcnt], max_iov - iovcnt, max_bytes_to_gather, gather.num_bytes_part_sent_frame);
+    gather.num_bytes += gather.num_bytes_part_sent_frame;
+
+    if (gather.num_bytes_part_sent_frame == (boundary - cursor)) {
+        iovcnt += serialiser.GatherPending(&iov[iovcnt], max_iov - iovcnt, max_bytes_to_gather - gather.num_bytes, gather.num_bytes_own);
+        gather.num_bytes += gather.num_bytes_own;
+
+        if (gather.num_bytes_own == serialiser.NumBytesPending()) {
+            size_t num_bytes_broadcast = 0;
+            iovcnt += broadcast_log.Gather(boundary, broadcast_log.End(), &iov[iovcnt], max_iov - iovcnt, max_bytes_to_gather - gather.num_bytes, num_bytes_broadcast);
+            gather.num_bytes += num_bytes_broadcast;
+        }
+    }
+    return iovcnt;
+}
+
+// Hands the first num_bytes_sent bytes of what was gathered back to whichever part they came from, in gather order.
+inline void ConsumeWithBroadcasts(Serialiser& serialiser, BroadcastLog& broadcast_log, uint64_t& cursor, const BroadcastGather& gather, const size_t num_bytes_sent) {
+    size_t num_bytes_left = num_bytes_sent;
+    const size_t num_bytes_to_frame_end = std::min(num_bytes_left, gather.num_bytes_part_sent_frame);
+    broadcast_log.Advance(cursor, num_bytes_to_frame_end);
+    num_bytes_left -= num_bytes_to_frame_end;
+
+    const size_t num_bytes_own_sent = std::min(num_bytes_left, gather.num_bytes_own);
+    serialiser.Consume(num_bytes_own_sent);
+    num_bytes_left -= num_bytes_own_sent;
+
+    broadcast_log.Advance(cursor, num_bytes_left);
+}
+
+/*
+Serialises a session's own frames and the broadcasts it has not sent yet (see GatherWithBroadcasts) 
+with a single WriteStreamV call, up to max_bytes_to_serialise.
+
+StreamWriter: Functor signature: WriteStreamV(const iovec* const iov, const int iovcnt, size_t& num_bytes_serialised);
+*/
+template<typename StreamWriter>
+size_t SerialiseWithBroadcasts(Serialiser& serialiser, BroadcastLog& broadcast_log, uint64_t& cursor, StreamWriter& stream_writer, const size_t max_bytes_to_serialise) {
+    iovec iov[IOV_MAX];
+    BroadcastGather gather;
+    const size_t iovcnt = GatherWithBroadcasts(serialiser, broadcast_log, cursor, iov, IOV_MAX, max_bytes_to_serialise, gather);
+    if (0 == iovcnt) return 0;
+
+    size_t num_bytes_serialised = 0;
+    stream_writer.WriteStreamV(iov, static_cast<int>(iovcnt), num_bytes_serialised);
+    ConsumeWithBroadcasts(serialiser, broadcast_log, cursor, gather, num_bytes_serialised);
+    return num_bytes_serialised;
+}
@@ -1,13 +1,36 @@
 #include "config.h"
 #include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include "logging.h"
+#include "application_messages.h"
 
 EpollServerConfig::EpollServerConfig()
     : listening_port(0)
     , read_threshold(1024)
     , write_threshold(1024)
     , listening_backlog(1024)
+    , num_loop_threads(1)
+    , is_edge_triggered(false)
+    , read_budget(64 * 1024)
+    , write_budget(64 * 1024)
+    , backend(ServerBackend_Epoll)
+    , max_accepts_per_tick(256)
+    , heartbeat_interval_ms(5000)
+    , idle_timeout_ms(60000)
+    , write_timeout_ms(30000)
+    , high_watermark(0)
+    , low_watermark(0)
+    , slow_consumer_limit(0)
+    , slow_consumer_policy(SlowConsumer_None)
+    , max_frame_size(1024 * 1024 * 1024)
+    , stream_frame_threshold(1024 * 1024)
+    , num_worker_threads(0)
+    , offloaded_msg_types(1u << MsgType_VariableLength)
+    , max_msgs_per_ack(0)
+    , ack_delay_ms(0)
+    , is_console_input_keyed(false)
+    , is_console_input_published(false)
 {}
 
 bool StringToPort(char const* const s, unsigned short& port) {
@@ -21,9 +44,190 @@ bool StringToPort(char const* const s, unsigned short& port) {
     return true;
 }
 
+bool IsOption(char const* const arg) {
+    return 0 == strncmp(arg, "--", 2);
+}
+
+int NumPositionalArgs(int argc, char* argv[]) {
+    int n = 0;
+    for (int i = 0; i < argc; ++i) {
+        if (!IsOption(argv[i])) {
+            ++n;
+        }
+    }
+    return n;
+}
+
+// Finds "--name=value" amongst the arguments and returns a pointer to value, or nullptr if absent.
+char const* FindOptionValue(int argc, char* argv[], char const* const name) {
+    const size_t name_length = strlen(name);
+    for (int i = 1; i < argc; ++i) {
+        char const* const arg = argv[i];
+        if (IsOption(arg) && (0 == strncmp(arg + 2, name, name_length)) && ('=' == arg[2 + name_length])) {
+            return arg + 2 + name_length + 1;
+        }
+    }
+    return nullptr;
+}
+
+bool ReadSizeOption(int argc, char* argv[], char const* const name, size_t& value) {
+    char const* const s = FindOptionValue(argc, argv, name);
+    if (!s) return true;
+
+    char* end = 0;
+    const size_t temp_value = std::strtoull(s, &end, 10);
+    if (s == end) {
+        log::PrintLn(log::Error, "bad --%s", name);
+        return false;
+    }
+    value = temp_value;
+    return true;
+}
+
+bool ReadBoolOption(int argc, char* argv[], char const* const name, bool& value) {
+    size_t temp_value = value ? 1 : 0;
+    if (!ReadSizeOption(argc, argv, name, temp_value)) return false;
+    value = (0 != temp_value);
+    return true;
+}
+
+char const* NthPositionalArg(int argc, char* argv[], const int n) {
+    int i_positional = 0;
+    for (int i = 0; i < argc; ++i) {
+        if (IsOption(argv[i])) continue;
+        if (n == i_positional) return argv[i];
+        ++i_positional;
+    }
+    return nullptr;
+}
+
+// Message type names (see ApplicationMessages), comma separated, to a bit per type code.
+bool ReadMsgTypes(char const* const names, uint32_t& msg_types) {
+    uint32_t temp_msg_types = 0;
+    char const* name = names;
+    while (*name) {
+        const size_t name_length = strcspn(name, ",");
+        bool is_found = false;
+        for (size_t type = 0; (type < ApplicationMessages::NumTypes) && (type < 32); ++type) {
+            char const* const type_name = ApplicationMessages::Name(static_cast<uint8_t>(type));
+            if ((strlen(type_name) == name_length) && (0 == strncmp(type_name, name, name_length))) {
+                temp_msg_types |= (1u << type);
+                is_found = true;
+            }
+        }
+        if (!is_found) return false;
+        name += name_length;
+        if (',' == *name) {
+            ++name;
+        }
+    }
+    msg_types = temp_msg_types;
+    return true;
+}
+
 bool EpollServerConfig::ReadFromCommandLine(int argc, char* argv[]) {
-    if (argc < 2) return false;
-    return StringToPort(argv[1], listening_port);
+    if (NumPositionalArgs(argc, argv) < 2) return false;
+    if (!StringToPort(NthPositionalArg(argc, argv, 1), listening_port)) return false;
+    
+    if (!ReadSizeOption(argc, argv, "threads", num_loop_threads)) return false;
+    if (num_loop_threads < 1) {
+        log::PrintLn(log::Error, "--threads must be at least 1");
+        return false;
+    }
+
+    if (!ReadBoolOption(argc, argv, "edge-triggered", is_edge_triggered)) return false;
+    if (!ReadSizeOption(argc, argv, "read-budget", read_budget)) return false;
+    if (!ReadSizeOption(argc, argv, "write-budget", write_budget)) return false;
+
+    if (!ReadSizeOption(argc, argv, "max-accepts-per-tick", max_accepts_per_tick)) return false;
+    if (max_accepts_per_tick < 1) {
+        log::PrintLn(log::Error, "--max-accepts-per-tick must be at least 1");
+        return false;
+    }
+
+    if (!ReadSizeOption(argc, argv, "heartbeat-ms", heartbeat_interval_ms)) return false;
+    if (!ReadSizeOption(argc, argv, "idle-timeout-ms", idle_timeout_ms)) return false;
+    if (!ReadSizeOption(argc, argv, "write-timeout-ms", write_timeout_ms)) return false;
+
+    if (!ReadSizeOption(argc, argv, "high-watermark", high_watermark)) return false;
+    // Without a low watermark of its own, reading resumes once a quarter of the high watermark is left.
+    low_watermark = high_watermark / 4;
+    if (!ReadSizeOption(argc, argv, "low-watermark", low_watermark)) return false;
+    if (high_watermark && (low_watermark >= high_watermark)) {
+        log::PrintLn(log::Error, "--low-watermark must be below --high-watermark");
+        return false;
+    }
+
+    if (!ReadSizeOption(argc, argv, "slow-consumer-limit", slow_consumer_limit)) return false;
+    char const* const slow_consumer_policy_name = FindOptionValue(argc, argv, "slow-consumer");
+    if (slow_consumer_policy_name) {
+        if (0 == strcmp(slow_consumer_policy_name, "none")) {
+            slow_consumer_policy = SlowConsumer_None;
+        }
+        else if (0 == strcmp(slow_consumer_policy_name, "disconnect")) {
+            slow_consumer_policy = SlowConsumer_Disconnect;
+        }
+        else if (0 == strcmp(slow_consumer_policy_name, "drop-broadcasts")) {
+            slow_consumer_policy = SlowConsumer_DropBroadcasts;
+        }
+        else {
+            log::PrintLn(log::Error, "bad --slow-consumer, expected none, disconnect or drop-broadcasts");
+            return false;
+        }
+    }
+    if ((SlowConsumer_None != slow_consumer_policy) && (!slow_consumer_limit)) {
+        log::PrintLn(log::Error, "--slow-consumer=%s needs a --slow-consumer-limit", slow_consumer_policy_name);
+        return false;
+    }
+
+    if (!ReadSizeOption(argc, argv, "max-frame-size", max_frame_size)) return false;
+    if (!ReadSizeOption(argc, argv, "stream-frame-threshold", stream_frame_threshold)) return false;
+
+    if (!ReadSizeOption(argc, argv, "workers", num_worker_threads)) return false;
+    char const* const offloaded_msg_type_names = FindOptionValue(argc, argv, "offload");
+    if (offloaded_msg_type_names && !ReadMsgTypes(offloaded_msg_type_names, offloaded_msg_types)) {
+        log::PrintLn(log::Error, "bad --offload, expected a comma separated list of message type names, e.g. VarLength,HeartBeat");
+        return false;
+    }
+
+    if (!ReadSizeOption(argc, argv, "cumulative-acks", max_msgs_per_ack)) return false;
+    if (!ReadSizeOption(argc, argv, "ack-delay-ms", ack_delay_ms)) return false;
+
+    if (!ReadBoolOption(argc, argv, "conflate-console-input", is_console_input_keyed)) return false;
+    if (!ReadBoolOption(argc, argv, "publish-console-input", is_console_input_published)) return false;
+
+    char const* const backend_name = FindOptionValue(argc, argv, "backend");
+    if (backend_name) {
+        if (0 == strcmp(backend_name, "epoll")) {
+            backend = ServerBackend_Epoll;
+        }
+        else if (0 == strcmp(backend_name, "io_uring")) {
+            backend = ServerBackend_IoUring;
+        }
+        else {
+            log::PrintLn(log::Error, "bad --backend, expected epoll or io_uring");
+            return false;
+        }
+    }
+    if (ServerBackend_IoUring == backend) {
+        // The io_uring loop does not drive a timer wheel: asking it for session timers is an error, and the defaults are off.
+        char const* const timer_options[] = { "heartbeat-ms", "idle-timeout-ms", "write-timeout-ms", "ack-delay-ms" };
+        for (char const* const name : timer_options) {
+            char const* const value = FindOptionValue(argc, argv, name);
+            if (value && (0 != strcmp(value, "0"))) {
+                log::PrintLn(log::Error, "--%s is not supported by the io_uring backend", name);
+                return false;
+            }
+        }
+        heartbeat_interval_ms = 0;
+        idle_timeout_ms = 0;
+        write_timeout_ms = 0;
+        ack_delay_ms = 0;
+    }
+
+    read_budget = std::max(read_budget, read_threshold);
+    write_budget = std::max(write_budget, write_threshold);
+    return true;
 }
 
 ClientConfig::ClientConfig() 
@@ -35,8 +239,75 @@ ClientConfig::ClientConfig()
 }
 
 bool ClientConfig::ReadFromCommandLine(int argc, char* argv[]) {
-    if (argc < 3) return false;
-    strncpy(hostname, argv[1], sizeof(hostname) - 1);
-    return StringToPort(argv[2], remote_port);
+    if (NumPositionalArgs(argc, argv) < 3) return false;
+    strncpy(hostname, NthPositionalArg(argc, argv, 1), sizeof(hostname) - 1);
+    return StringToPort(NthPositionalArg(argc, argv, 2), remote_port);
 }
 
+BenchConfig::BenchConfig()
+    : remote_port(0)
+    , num_connections(16)
+    , num_threads(1)
+    , msgs_per_s(10000)
+    , min_msg_size(64)
+    , max_msg_size(64)
+    , duration_s(10)
+    , report_interval_s(1)
+    , read_threshold(64 * 1024)
+    , write_threshold(64 * 1024)
+{
+    memset(hostname, 0, sizeof(hostname));
+}
+
+// "--size=BYTES" or "--size=MIN-MAX".
+bool ReadSizeRangeOption(int argc, char* argv[], char const* const name, size_t& min_value, size_t& max_value) {
+    char const* const s = FindOptionValue(argc, argv, name);
+    if (!s) return true;
+
+    char* end = 0;
+    const size_t temp_min_value = std::strtoull(s, &end, 10);
+    size_t temp_max_value = temp_min_value;
+    if ((s != end) && ('-' == *end)) {
+        char const* const max_s = end + 1;
+        temp_max_value = std::strtoull(max_s, &end, 10);
+        if (max_s == end) {
+            end = const_cast<char*>(s);
+        }
+    }
+    if ((s == end) || (0 != *end) || (temp_max_value < temp_min_value)) {
+        log::PrintLn(log::Error, "bad --%s, expected BYTES or MIN-MAX", name);
+        return false;
+    }
+    min_value = temp_min_value;
+    max_value = temp_max_value;
+    return true;
+}
+
+bool BenchConfig::ReadFromCommandLine(int argc, char* argv[]) {
+    if (NumPositionalArgs(argc, argv) < 4) return false;
+    strncpy(hostname, NthPositionalArg(argc, argv, 2), sizeof(hostname) - 1);
+    if (!StringToPort(NthPositionalArg(argc, argv, 3), remote_port)) return false;
+
+    if (!ReadSizeOption(argc, argv, "connections", num_connections)) return false;
+    if (!ReadSizeOption(argc, argv, "threads", num_threads)) return false;
+    if ((num_connections < 1) || (num_threads < 1)) {
+        log::PrintLn(log::Error, "--connections and --threads must be at least 1");
+        return false;
+    }
+    num_threads = std::min(num_threads, num_connections);
+
+    if (!ReadSizeOption(argc, argv, "rate", msgs_per_s)) return false;
+    if (msgs_per_s < 1) {
+        log::PrintLn(log::Error, "--rate must be at least 1");
+        return false;
+    }
+
+    if (!ReadSizeRangeOption(argc, argv, "size", min_msg_size, max_msg_size)) return false;
+    if (!ReadSizeOption(argc, argv, "duration-s", duration_s)) return false;
+    if (!ReadSizeOption(argc, argv, "report-interval-s", report_interval_s)) return false;
+    if ((duration_s < 1) || (report_interval_s < 1)) {
+        log::PrintLn(log::Error, "--duration-s and --report-interval-s must be at least 1");
+        return false;
+    }
+    return true;
+}
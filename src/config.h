@@ -1,20 +1,121 @@
 #pragma once
 #include <unistd.h>
+#include <stdint.h>
 
 // Purpose of read_threshold and write_threshold:
 // Since we are using epoll and servicing ready fds in a round-robin fashion in a single thread, 
 // we must ensure that no single fd hogs the i/o at the expense of other ready fds. 
 // Therefore, when we service each of the ready fds, we constrain the number of bytes per read/write using read_threshold and write_threshold.
+// (The epoll server gathers a session's pending frames into a single writev bounded by write_budget instead, 
+// so there write_threshold only sizes the client's writes.)
+//
+// num_loop_threads:
+// Number of independent epoll loops (reactors), each on its own thread, with its own SO_REUSEPORT listening socket, 
+// EpollController and Sessions. The kernel spreads incoming connections across the listening sockets, and an accepted 
+// connection is serviced by the loop that accepted it for its whole life.
+//
+// backend:
+// Epoll: readiness-based loop (EpollServer). IoUring: completion-based loop (IoUringServer). Both share Sessions and frame handling.
+//
+// read_budget, write_budget:
+// Ready sessions are serviced from a deficit-round-robin run queue. Each turn, a session may read up to read_budget bytes 
+// and write up to write_budget bytes (reads of at least read_threshold, sized to what the socket holds, writes gathered with writev), then goes to the back of the queue 
+// if its socket still has more. The loop keeps servicing the queue between non-blocking epoll_wait calls until it is empty.
+//
+// is_edge_triggered:
+// Register sessions once with EPOLLIN | EPOLLOUT | EPOLLET instead of toggling EPOLLOUT with epoll_ctl after every send.
+// Each readiness edge is then drained (across as many turns as it takes) until the socket would block.
+//
+// max_accepts_per_tick:
+// A readable listening socket is drained with accept4 until it would block or this many connections have been accepted, 
+// so that a connection storm empties the backlog in a few loop iterations without starving established sessions.
+//
+// heartbeat_interval_ms, idle_timeout_ms, write_timeout_ms (0 disables each):
+// A session that has sent nothing for heartbeat_interval_ms is sent a HeartBeat (which peers Ack), 
+// and one that has sent nothing for idle_timeout_ms is closed as idle or dead.
+// A session whose pending bytes have not moved for write_timeout_ms is closed as stuck.
+// All of these run off one timer wheel per loop, ticked by a single timerfd. The io_uring backend has none of them:
+// they are off with it, and asking for them is an error.
+//
+// high_watermark, low_watermark (0 disables):
+// Once a session has high_watermark bytes waiting to be sent (its own frames plus the broadcasts it has yet to send), 
+// the server stops reading from it, so that a peer that does not read its Acks cannot make us queue more of them. 
+// Reading resumes once it is down to low_watermark (a quarter of high_watermark unless given). Off by default.
+//
+// slow_consumer_limit, slow_consumer_policy (a limit of 0 disables):
+// What to do with a session that has more than slow_consumer_limit bytes waiting to be sent when a broadcast arrives: 
+// disconnect it, or drop the broadcasts it has not started sending yet. Each action is counted in the loop's report.
+// Off by default: a policy other than none has to be asked for, with a limit.
+//
+// max_frame_size, stream_frame_threshold (0 disables each):
+// A session that sends a frame longer than max_frame_size is disconnected as soon as the frame's length field arrives, 
+// before any of it is buffered. A frame of at least stream_frame_threshold bytes is handled in pieces as it arrives 
+// rather than buffered whole, so its size does not decide how much memory its session holds.
+//
+// num_worker_threads, offloaded_msg_types (0 threads disables):
+// Frames of the offloaded types (a bit per type code, VarLength by default) are handled by a pool of worker threads 
+// shared by all loops, instead of on the loop that read them, so that an expensive handler does not hold up every other 
+// session of the loop. Responses come back to the loop, and each session's responses still go out in the order of its frames.
+//
+// max_msgs_per_ack, ack_delay_ms (0 disables each):
+// Sessions that speak wire v2 are sent one cumulative Ack per max_msgs_per_ack messages (or per read, if fewer), 
+// rather than one Ack per message. With ack_delay_ms (epoll only), the Ack of a read's leftover messages is held back 
+// for up to ack_delay_ms, so that the messages of the next reads share it.
+//
+// is_console_input_keyed:
+// Broadcast each console line as a keyed frame (keyed by its first word), which a session that has not yet sent 
+// the previous line with the same key gets instead of it, rather than as well as it.
+//
+// is_console_input_published:
+// Publish each console line to the topic named by its first word (the rest of the line is the payload), so that only 
+// the sessions subscribed to that topic get it, rather than broadcasting it to all. Takes precedence over is_console_input_keyed.
+enum ServerBackend {
+    ServerBackend_Epoll,
+    ServerBackend_IoUring,
+};
+
+enum SlowConsumerPolicy {
+    SlowConsumer_None,
+    SlowConsumer_Disconnect,
+    SlowConsumer_DropBroadcasts,
+};
+
 struct EpollServerConfig {
     unsigned short listening_port;
     size_t read_threshold;
     size_t write_threshold;
     int listening_backlog;
+    size_t num_loop_threads;
+    bool is_edge_triggered;
+    size_t read_budget;
+    size_t write_budget;
+    ServerBackend backend;
+    size_t max_accepts_per_tick;
+    size_t heartbeat_interval_ms;
+    size_t idle_timeout_ms;
+    size_t write_timeout_ms;
+    size_t high_watermark;
+    size_t low_watermark;
+    size_t slow_consumer_limit;
+    SlowConsumerPolicy slow_consumer_policy;
+    size_t max_frame_size;
+    size_t stream_frame_threshold;
+    size_t num_worker_threads;
+    uint32_t offloaded_msg_types;
+    size_t max_msgs_per_ack;
+    size_t ack_delay_ms;
+    bool is_console_input_keyed;
+    bool is_console_input_published;
     
     EpollServerConfig();
     bool ReadFromCommandLine(int argc, char* argv[]);
 };
 
+// Number of command line arguments (including the program name) that are not "--name=value" options.
+int NumPositionalArgs(int argc, char* argv[]);
+// The n-th of them (0 being the program name), or nullptr if there are not that many.
+char const* NthPositionalArg(int argc, char* argv[], const int n);
+
 struct ClientConfig {
     char hostname[1024];
     unsigned short remote_port;
@@ -24,3 +125,28 @@ struct ClientConfig {
     ClientConfig();
     bool ReadFromCommandLine(int argc, char* argv[]);
 };
+
+// ncc bench: an open-loop load generator.
+// num_connections connections share msgs_per_s between them, and each sends on a fixed schedule: its k-th message is 
+// due k intervals after its start, whether or not the earlier ones have been Acked. A round trip is timed from when 
+// the message was due rather than from when it went out, so that a stall (of the server, or of the bench itself) 
+// counts against every message it held up, not just the one it delayed (no coordinated omission).
+// Messages are VarLength, with bodies of a size drawn uniformly from [min_msg_size, max_msg_size].
+// num_threads: the connections are split between this many threads, each with its own epoll loop.
+// Throughput and round trip percentiles are logged every report_interval_s, and for the whole run after duration_s.
+struct BenchConfig {
+    char hostname[1024];
+    unsigned short remote_port;
+    size_t num_connections;
+    size_t num_threads;
+    size_t msgs_per_s;
+    size_t min_msg_size;
+    size_t max_msg_size;
+    size_t duration_s;
+    size_t report_interval_s;
+    size_t read_threshold;
+    size_t write_threshold;
+
+    BenchConfig();
+    bool ReadFromCommandLine(int argc, char* argv[]);
+};
@@ -0,0 +1,84 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include "serialiser.h"
+
+/*
+Outbound frames that only matter as the latest value of their key (e.g. market data): a frame pushed while an earlier
+frame with the same key is still queued replaces that frame in place, keeping its place in the queue.
+So however fast updates arrive, a lagging session holds (and eventually sends) at most one frame per key.
+
+Frames stay here until the session's serialiser has sent everything else, and are then moved into it by reference
+a write budget at a time (MoveTo(...)). Only what is still here can be conflated.
+
+Frames are shared (not copied) between the sessions they are pushed to. Single owner: only the loop thread may call into it.
+*/
+class ConflatingQueue {
+    typedef std::shared_ptr<const std::vector<char>> Frame;
+
+    // Keys in the order their (current) frame was first queued. Keys before head_ have been moved out.
+    std::vector<uint64_t> keys_;
+    size_t head_;
+    std::unordered_map<uint64_t, Frame> latest_;
+    size_t num_bytes_;
+
+    ConflatingQueue(const ConflatingQueue&) = delete;
+    ConflatingQueue& operator=(const ConflatingQueue&) = delete;
+
+public:
+    ConflatingQueue()
+        : head_(0)
+        , num_bytes_(0)
+    {}
+
+    bool Empty() const { return latest_.empty(); }
+    size_t Size() const { return latest_.size(); }
+    size_t NumBytes() const { return num_bytes_; }
+
+    void Reset() {
+        keys_.clear();
+        head_ = 0;
+        latest_.clear();
+        num_bytes_ = 0;
+    }
+
+    // Returns true if frame replaced a queued frame with the same key.
+    bool Push(const uint64_t key, const Frame& frame) {
+        const auto inserted = latest_.emplace(key, frame);
+        if (!inserted.second) {
+            num_bytes_ -= inserted.first->second->size();
+            inserted.first->second = frame;
+            num_bytes_ += frame->size();
+            return true;
+        }
+        keys_.push_back(key);
+        num_bytes_ += frame->size();
+        return false;
+    }
+
+    // Appends queued frames, oldest key first, to serialiser until at least max_bytes have been moved (or none are left).
+    // Returns the number of bytes moved.
+    size_t MoveTo(Serialiser& serialiser, const size_t max_bytes) {
+        size_t num_bytes_moved = 0;
+        while ((head_ < keys_.size()) && (num_bytes_moved < max_bytes)) {
+            const auto it = latest_.find(keys_[head_++]);
+            const Frame& frame = it->second;
+            serialiser.AppendFrameRef(&(*frame)[0], frame->size(), frame);
+            num_bytes_moved += frame->size();
+            latest_.erase(it);
+        }
+        num_bytes_ -= num_bytes_moved;
+        if (head_ == keys_.size()) {
+            keys_.clear();
+            head_ = 0;
+        }
+        else if (head_ > (keys_.size() - head_)) {
+            keys_.erase(keys_.begin(), keys_.begin() + head_);
+            head_ = 0;
+        }
+        return num_bytes_moved;
+    }
+};
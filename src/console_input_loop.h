@@ -1,26 +1,58 @@
 #pragma once
-#include <iostream>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string>
+#include <vector>
 #include "session.h"
 
+/*
+Hands every non-empty line of stdin to frame_handler, as a VarLength frame (in wire v1), until stdin ends, 
+frame_handler.HandleFrame(...) returns false, or stop_fd (e.g. an eventfd, -1 for none) becomes readable, 
+so that the owner can stop the loop and join its thread rather than leave it blocked on stdin.
+*/
 template<typename FrameHandler>
-void RunConsoleInputLoop(FrameHandler& frame_handler) {
+void RunConsoleInputLoop(FrameHandler& frame_handler, const int stop_fd = -1) {
     Header header = { 0, MsgType_VariableLength };
-    char const* const pHeader = (char const*)(&header);
-    std::string line(pHeader, pHeader + sizeof(header));
+    std::string input;
     std::vector<char> v;
+    char chunk[4096];
+    pollfd fds[2] = { { STDIN_FILENO, POLLIN, 0 }, { stop_fd, POLLIN, 0 } };
+    const nfds_t num_fds = (stop_fd >= 0) ? 2 : 1;
     while (1) {
-        std::getline(std::cin, line);
-        const size_t num_char_in_line = line.size();
-        if (num_char_in_line < 1) continue;
-
-        header.length = sizeof(header) + num_char_in_line;
-        if (header.length > v.size()) {
-            v.resize(header.length);
+        if (poll(fds, num_fds, -1) < 0) {
+            if (EINTR == errno) continue;
+            log::PrintLnCurrentErrno(log::Error, "Failed to poll console input");
+            return;
         }
-        memcpy(&v[0], (char const*)(&header), sizeof(header));
-        memcpy(&v[sizeof(header)], line.c_str(), num_char_in_line);
-        if (!frame_handler.HandleFrame(&v[0], header.length)) {
+        if ((num_fds > 1) && fds[1].revents) return;
+        if (!fds[0].revents) continue;
+
+        const ssize_t num_bytes_read = read(STDIN_FILENO, chunk, sizeof(chunk));
+        if (num_bytes_read < 0) {
+            if (EINTR == errno) continue;
+            log::PrintLnCurrentErrno(log::Error, "Failed to read console input");
             return;
         }
+        if (0 == num_bytes_read) return;
+        input.append(chunk, static_cast<size_t>(num_bytes_read));
+
+        size_t line_begin = 0;
+        for (size_t line_end = input.find('\n'); std::string::npos != line_end; line_end = input.find('\n', line_begin)) {
+            const size_t num_char_in_line = line_end - line_begin;
+            if (num_char_in_line > 0) {
+                header.length = sizeof(header) + num_char_in_line;
+                if (header.length > v.size()) {
+                    v.resize(header.length);
+                }
+                memcpy(&v[0], (char const*)(&header), sizeof(header));
+                memcpy(&v[sizeof(header)], input.data() + line_begin, num_char_in_line);
+                if (!frame_handler.HandleFrame(&v[0], header.length)) {
+                    return;
+                }
+            }
+            line_begin = line_end + 1;
+        }
+        input.erase(0, line_begin);
     }
 }
@@ -5,6 +5,8 @@
 
 EpollController::EpollController()
     : fd_epoll_instance_(epoll_create1(0))
+    , num_watched_fds_(0)
+    , num_syscalls_(0)
 {}
 
 EpollController::~EpollController() {
@@ -14,52 +16,52 @@ EpollController::~EpollController() {
     }
 }
 
+EpollController::Interest* EpollController::FindInterest(const int fd) {
+    if ((fd < 0) || (static_cast<size_t>(fd) >= fd_to_interest_.size())) return nullptr;
+    Interest& interest = fd_to_interest_[fd];
+    return interest.is_watched ? &interest : nullptr;
+}
+
 // 0 on success, or 1 on error
 int EpollController::AddToInterestList(const int fd_of_interest, const uint32_t events_of_interest) {
-    std::lock_guard<std::mutex> lock(mutex_);
+    return AddToInterestList(fd_of_interest, events_of_interest, static_cast<uint32_t>(fd_of_interest));
+}
+
+int EpollController::AddToInterestList(const int fd_of_interest, const uint32_t events_of_interest, const uint64_t data) {
     epoll_event event = { 0 };
     event.events = events_of_interest;
-    event.data.fd = fd_of_interest;
+    event.data.u64 = data;
+    ++num_syscalls_;
     const int e = epoll_ctl(fd_epoll_instance_, EPOLL_CTL_ADD, fd_of_interest, &event);
     if (0 == e) {
         char events_string[512] = { 0 };
         EpollEventsToString(events_of_interest, events_string, sizeof(events_string));
         log::PrintLn(log::Debug, "%d|+|%s", fd_of_interest, events_string);
-        watched_fds_to_events_[fd_of_interest] = events_of_interest;
+        if (static_cast<size_t>(fd_of_interest) >= fd_to_interest_.size()) {
+            fd_to_interest_.resize(fd_of_interest + 1, Interest{ 0, 0, false });
+        }
+        fd_to_interest_[fd_of_interest] = Interest{ data, events_of_interest, true };
+        ++num_watched_fds_;
     }
     return e;
 }
 
-bool EpollController::GetEventsOfInterests(const int fd, uint32_t& events_of_interest) const {
-    auto it = watched_fds_to_events_.find(fd);
-    if (watched_fds_to_events_.end() == it) return false;
-    events_of_interest = it->second;
-    return true;
-}
-
-bool EpollController::UpdateEventsOfInterests(const int fd, const uint32_t events_of_interest) {
-    auto it = watched_fds_to_events_.find(fd);
-    if (watched_fds_to_events_.end() == it) return false;
-    it->second = events_of_interest;
-    return true;
-}
-
 bool EpollController::ModifyInterestList(const int fd_of_interest, const uint32_t events_of_interest_to_add, const uint32_t events_of_interest_to_remove, int * const epoll_ctl_status_ptr) {
-    std::lock_guard<std::mutex> lock(mutex_);
-    uint32_t existing_registered_events = 0;
-    if (!GetEventsOfInterests(fd_of_interest, existing_registered_events)) {
+    Interest* const interest_ptr = FindInterest(fd_of_interest);
+    if (!interest_ptr) {
         return false;
     }
+    const uint32_t existing_registered_events = interest_ptr->events;
     const bool is_already_in_desired_state = 
         ((0 == events_of_interest_to_add) || (existing_registered_events & events_of_interest_to_add))
         && ((0 == events_of_interest_to_remove) || (!(existing_registered_events & events_of_interest_to_remove)));
 
-    log::PrintLn(log::Debug, "%d|?|existing=%08x add=%08x del=%08x nochg=%d", fd_of_interest, existing_registered_events, events_of_interest_to_add, events_of_interest_to_remove, is_already_in_desired_state);
     if (is_already_in_desired_state) return true;
 
     epoll_event event = { 0 };
     event.events = (existing_registered_events | events_of_interest_to_add) & (~events_of_interest_to_remove);
-    event.data.fd = fd_of_interest;
+    event.data.u64 = interest_ptr->data;
+    ++num_syscalls_;
     const int e = epoll_ctl(fd_epoll_instance_, EPOLL_CTL_MOD, fd_of_interest, &event);
     if (epoll_ctl_status_ptr) {
         *epoll_ctl_status_ptr = e;
@@ -68,18 +70,22 @@ bool EpollController::ModifyInterestList(const int fd_of_interest, const uint32_
         char events_string[512] = { 0 };
         EpollEventsToString(event.events, events_string, sizeof(events_string));
         log::PrintLn(log::Debug, "%d|+|%s", fd_of_interest, events_string);
-        UpdateEventsOfInterests(fd_of_interest, event.events);
+        interest_ptr->events = event.events;
     }
     return e;
 }
 
 int EpollController::RemoveFromInterestList(const int fd_to_remove) {
-    std::lock_guard<std::mutex> lock(mutex_);
     // ATTENTION: EPOLL_CTL_DEL has no effect on closed fds.
     // Therefore, ensure that EPOLL_CTL_DEL is done on the fd before closing it.
+    ++num_syscalls_;
     const int e = epoll_ctl(fd_epoll_instance_, EPOLL_CTL_DEL, fd_to_remove, NULL);
     if (0 == e) {
-        watched_fds_to_events_.erase(fd_to_remove);
+        Interest* const interest_ptr = FindInterest(fd_to_remove);
+        if (interest_ptr) {
+            *interest_ptr = Interest{ 0, 0, false };
+            --num_watched_fds_;
+        }
         log::PrintLn(log::Debug, "%d|-", fd_to_remove);
     }
     return e;
@@ -88,8 +94,9 @@ int EpollController::RemoveFromInterestList(const int fd_to_remove) {
 // Returns last bad errno instead of last bad epoll_ctl return value
 int EpollController::ClearInterestList() {
     int last_bad_errno = 0;
-    for (const auto& [watched_fd, events]: watched_fds_to_events_) {
-        const int e = RemoveFromInterestList(watched_fd);
+    for (size_t fd = 0; fd < fd_to_interest_.size(); ++fd) {
+        if (!fd_to_interest_[fd].is_watched) continue;
+        const int e = RemoveFromInterestList(static_cast<int>(fd));
         if (e < 0) {
             last_bad_errno = e;
         }
@@ -98,10 +105,18 @@ int EpollController::ClearInterestList() {
 }
 
 int EpollController::WaitForEvents(epoll_event* const ready_events, const int max_events, const int timeout) {
+    ++num_syscalls_;
     return epoll_wait(fd_epoll_instance_, ready_events, max_events, timeout);
 }
 
 size_t EpollController::NumWatchedFds() const {
-    return watched_fds_to_events_.size();
+    return num_watched_fds_;
 }
 
+void EpollController::ReserveForNewFds(const size_t num_new_fds) {
+    fd_to_interest_.reserve(fd_to_interest_.size() + num_new_fds);
+}
+
+size_t EpollController::NumSyscalls() const {
+    return num_syscalls_;
+}
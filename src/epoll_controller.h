@@ -1,27 +1,45 @@
 #pragma once
 #include <unistd.h>
-#include <map>
-#include <mutex>
+#include <stdint.h>
+#include <vector>
 
+/*
+Owns an epoll instance and remembers the events each fd is registered for, so that redundant epoll_ctl calls can be skipped.
+The registered events (and the epoll_event data they are reported with) live in a dense table indexed by fd, 
+so looking them up is a single load.
+Single owner: only the loop thread that owns the controller may call into it, so nothing is locked.
+*/
 struct epoll_event;
 class EpollController {
-    mutable std::mutex mutex_;
+    struct Interest {
+        uint64_t data;
+        uint32_t events;
+        bool is_watched;
+    };
+
     int fd_epoll_instance_;
-    std::map<int, uint32_t> watched_fds_to_events_;
+    std::vector<Interest> fd_to_interest_;
+    size_t num_watched_fds_;
+    size_t num_syscalls_;
     
-    bool GetEventsOfInterests(const int fd, uint32_t& events_of_interest) const;
-    bool UpdateEventsOfInterests(const int fd, const uint32_t events_of_interest);
+    Interest* FindInterest(const int fd);
     int ClearInterestList();
 public:
     EpollController();
     ~EpollController();
 
-    // 0 on success, or �1 on error
+    // 0 on success, or -1 on error
+    // data: what epoll_event.data.u64 reports the fd's events with, e.g. a session tag. The fd itself if not given.
     int AddToInterestList(const int fd_of_interest, const uint32_t events_of_interest);
+    int AddToInterestList(const int fd_of_interest, const uint32_t events_of_interest, const uint64_t data);
     bool ModifyInterestList(const int fd_of_interest, const uint32_t events_of_interest_to_add, const uint32_t events_of_interest_to_remove, int* const epoll_ctl_status_ptr = 0);
     int RemoveFromInterestList(const int fd_to_remove);
 
     // Returns last bad errno instead of last bad epoll_ctl return value
     int WaitForEvents(epoll_event* const ready_events, const int max_events, const int timeout);
     size_t NumWatchedFds() const;
+    // Grows the fd table up front for num_new_fds more fds above the highest one seen, so that a batch of accepts does not reallocate it repeatedly.
+    void ReserveForNewFds(const size_t num_new_fds);
+    // Number of epoll_ctl and epoll_wait calls made so far.
+    size_t NumSyscalls() const;
 };
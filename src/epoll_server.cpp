@@ -11,7 +11,11 @@
 #include <time.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/timerfd.h>
 #include <thread>
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -22,15 +26,28 @@
 #include "session.h"
 #include "serialiser.h"
 #include "socket_utils.h"
-#include "console_input_loop.h"
+#include "server_loops.h"
 
 const int MaxNumEvents = 1024;
+// Resolution of heartbeats, idle timeouts and write deadlines.
+const size_t TimerTickMs = 50;
 
-EpollServer::EpollServer(const int fd_listening, const EpollServerConfig& config)
+EpollServer::EpollServer(const int fd_listening, const EpollServerConfig& config, WorkerPool* const worker_pool, TopicBus& topic_bus)
     : fd_listening_(fd_listening)
     , config_(config)
     , sessions_(config_)
-{}
+    , stats_("epoll")
+    , offloader_(worker_pool, command_queue_)
+    , topic_bus_(topic_bus)
+    , fd_timer_(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC))
+    , is_timer_ticking_(false)
+{
+    if (fd_timer_ < 0) {
+        log::PrintLnCurrentErrno(log::Error, "Failed to create timerfd. Heartbeats and timeouts are disabled");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &timer_start_time_);
+    topic_bus_.Join(command_queue_);
+}
 
 EpollServer::~EpollServer() {
     CloseListeningAndSessionSockets();
@@ -43,13 +60,19 @@ void EpollServer::Run() {
 
 void EpollServer::Loop() {
     epoll_controller_.AddToInterestList(fd_listening_, EPOLLIN);
+    epoll_controller_.AddToInterestList(command_queue_.WakeupFd(), EPOLLIN);
+    if (fd_timer_ >= 0) {
+        epoll_controller_.AddToInterestList(fd_timer_, EPOLLIN);
+    }
 
     epoll_event ready_events[MaxNumEvents] = { 0 };
 
-    log::PrintLn(log::Info, "Entering epoll loop: monitoring %zu fds", epoll_controller_.NumWatchedFds());
+    log::PrintLn(log::Info, "Entering epoll loop (%s): monitoring %zu fds", config_.is_edge_triggered ? "edge-triggered" : "level-triggered", epoll_controller_.NumWatchedFds());
     while (epoll_controller_.NumWatchedFds() > 0) {
-        log::PrintLn(log::Debug, "wait ...");
-        const int num_ready = epoll_controller_.WaitForEvents(ready_events, sizeof(ready_events) / sizeof(ready_events[0]), -1);
+        // Sessions left in the run queue still have bytes to read or write, so only poll for new events while there are any.
+        const int timeout = run_queue_.Empty() ? -1 : 0;
+        log::PrintLn(log::Debug, "wait (%zu in run queue) ...", run_queue_.Size());
+        const int num_ready = epoll_controller_.WaitForEvents(ready_events, sizeof(ready_events) / sizeof(ready_events[0]), timeout);
         if (-1 == num_ready) {
             if (EINTR == errno) {
                 log::PrintLn(log::Info, "epoll_wait interrupted by signal. Continuing to wait ...");
@@ -60,123 +83,300 @@ void EpollServer::Loop() {
                 break;
             }
         }
+        const size_t num_epoll_syscalls_before = epoll_controller_.NumSyscalls();
         ProcessReadyEvents(ready_events, num_ready);
+        ServiceRunQueue();
+        // The epoll_wait above, plus any epoll_ctl made while servicing.
+        stats_.OnSyscalls(1 + epoll_controller_.NumSyscalls() - num_epoll_syscalls_before);
     }
     log::PrintLn(log::Info, "Exit epoll loop");
+    stats_.Report();
 }
 
+// Records what each ready fd is ready for and queues its session for service. 
+// The actual reading and writing happens in ServiceRunQueue.
 size_t EpollServer::ProcessReadyEvents(epoll_event* const ready_events, const size_t num_ready) {
-    size_t num_fd_deserving_another_turn = 0;
+    size_t num_sessions_queued = 0;
 
     for (size_t i = 0; i < num_ready; ++i) {
         auto& ready_event = ready_events[i];
-        const int fd_ready = ready_event.data.fd;
+        const int fd_ready = SessionTagToFd(ready_event.data.u64);
         if (-1 == fd_ready) {
             continue;
         }
 
-        Session* session_ptr = nullptr;
-        if (fd_listening_ != fd_ready) {
-            sessions_.Add(fd_ready, session_ptr);
-            assert(session_ptr);
-            if (!session_ptr) continue;
-        }
-
         char events_string[512] = { 0 };
         EpollEventsToString(ready_event.events, events_string, sizeof(events_string));
         log::PrintLn(log::Debug, "%d|E|%s", fd_ready, events_string);
 
-        bool is_fd_deserve_another_turn = false;
         if (fd_listening_ == fd_ready) {
             OnListenerEvent();
+            continue;
         }
-        else {
-            if (ready_event.events & EPOLLIN) {
-                const SocketIOStatus e = OnReadyToRead(*session_ptr);
-                log::PrintLn(log::Debug, "%d|I|status=%d errno=%d e=%d", fd_ready, session_ptr->socket_reader.last_status, session_ptr->socket_reader.last_errno, e);
-                if (PeerHungUp == e) {
-                    OnHangUp(fd_ready); 
-                }
-                else if (WentThrough == e) {
-                    // Because the current read attempt didn't block, the next attempt might succeed too.
-                    // Deserves another read attempt if this current passed read attempt was not due to trying to read 0 bytes.
-                    if (session_ptr->socket_reader.last_status > 0) {
-                        is_fd_deserve_another_turn = true;
-                    }
-                }
-            }
-            if (ready_event.events & EPOLLOUT) {
-                const SocketIOStatus e = OnReadyToWrite(*session_ptr);
-                log::PrintLn(log::Debug, "%d|O|status=%d errno=%d e=%d", fd_ready, session_ptr->socket_writer.last_status, session_ptr->socket_writer.last_errno, e);
-                if (PeerHungUp == e) {
-                    OnHangUp(fd_ready);    
-                }
-                else if (WentThrough == e) {
-                    // Because the current write attempt didn't block, the next attempt might succeed too.
-                    // Deserves another write attempt if there is still data to send.
-                    if (!session_ptr->serialiser.HasSerialisedAll()) {
-                        is_fd_deserve_another_turn = true;
-                    }
-                }
-            }
-            if (ready_event.events & (EPOLLRDHUP | EPOLLHUP)) {
-                OnHangUp(fd_ready);
-            }
-            if (!(ready_event.events & (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP))) {
-                OnUnknownEvent(ready_event);
+        if (command_queue_.WakeupFd() == fd_ready) {
+            OnWakeup();
+            continue;
+        }
+        if (fd_timer_ == fd_ready) {
+            OnTimerEvent();
+            continue;
+        }
+
+        // Events for a connection that has already been closed (e.g. by a timer earlier in this batch) are stale.
+        Session* const session_ptr = sessions_.FindByTag(ready_event.data.u64);
+        if (!session_ptr) {
+            log::PrintLn(log::Debug, "%d|Stale event for closed session", fd_ready);
+            continue;
+        }
+
+        // A peer that shuts down its side may have sent frames just before, which are read (and Acked) first: 
+        // the session is closed once a read returns 0 (see ServiceSession). Only a hang-up with nothing to read closes it here.
+        if ((ready_event.events & (EPOLLHUP | EPOLLERR)) && !(ready_event.events & EPOLLIN)) {
+            OnHangUp(*session_ptr);
+            continue;
+        }
+        if ((ready_event.events & EPOLLRDHUP) && !session_ptr->is_peer_shut_down) {
+            session_ptr->is_peer_shut_down = true;
+            if (!config_.is_edge_triggered) {
+                // Level-triggered, it would be reported by every epoll_wait until the read that returns 0, which a session 
+                // whose reads are paused does not get to. EPOLLIN reports the end of the stream as readable anyway.
+                epoll_controller_.ModifyInterestList(fd_ready, 0, EPOLLRDHUP);
             }
         }
-        if (is_fd_deserve_another_turn) {
-            ++num_fd_deserving_another_turn;
+        if (ready_event.events & (EPOLLIN | EPOLLRDHUP)) {
+            session_ptr->is_readable = true;
+        }
+        if (ready_event.events & EPOLLOUT) {
+            session_ptr->is_writable = true;
         }
-        else {
-            ready_event.data.fd = -1;
+        if (!(ready_event.events & (EPOLLIN | EPOLLOUT | EPOLLRDHUP))) {
+            OnUnknownEvent(ready_event);
+            continue;
+        }
+        if (!session_ptr->is_in_run_queue) {
+            run_queue_.PushBack(session_ptr);
+            ++num_sessions_queued;
         }
     }
     
-    return num_fd_deserving_another_turn;
+    return num_sessions_queued;
 }
 
-void EpollServer::OnListenerEvent() {
-    sockaddr_in client_address = { 0 };
-    socklen_t client_address_size = sizeof(client_address);
-    const int fd_accepted = accept(fd_listening_, (sockaddr*)&client_address, &client_address_size);
+// One deficit-round-robin round: every session queued at the start of the round gets exactly one turn, 
+// and goes to the back of the queue if it still has work left after its turn.
+void EpollServer::ServiceRunQueue() {
+    for (size_t num_turns_left = run_queue_.Size(); num_turns_left > 0; --num_turns_left) {
+        Session* const session_ptr = run_queue_.PopFront();
+        if (!session_ptr) break;
+        if (ServiceSession(*session_ptr)) {
+            run_queue_.PushBack(session_ptr);
+        }
+    }
+}
 
-    if (-1 == fd_accepted) {
-        log::PrintLnCurrentErrno(log::Error, "Failed accept");
+// Returns true if the session deserves another turn.
+bool EpollServer::ServiceSession(Session& session) {
+    const int fd = session.fd;
+    const size_t num_io_calls_before = session.socket_reader.num_calls + session.socket_writer.num_calls;
+
+    const SocketIOStatus e_read = OnReadyToRead(session);
+    log::PrintLn(log::Debug, "%d|I|status=%d errno=%d e=%d", fd, session.socket_reader.last_status, session.socket_reader.last_errno, e_read);
+    if (PeerHungUp == e_read) {
+        // The peer may only have shut down its side, and still read the Acks of its last frames: send what the socket takes.
+        session.is_writable = true;
+        OnReadyToWrite(session);
+        stats_.OnSyscalls(session.socket_reader.num_calls + session.socket_writer.num_calls - num_io_calls_before);
+        OnHangUp(session);
+        return false;
     }
-    else {
-        sessions_.Add(fd_accepted);
-        
+
+    // Write after reading, so that all the Acks made from this turn's reads go out together.
+    const SocketIOStatus e_write = OnReadyToWrite(session);
+    stats_.OnSyscalls(session.socket_reader.num_calls + session.socket_writer.num_calls - num_io_calls_before);
+    log::PrintLn(log::Debug, "%d|O|status=%d errno=%d e=%d", fd, session.socket_writer.last_status, session.socket_writer.last_errno, e_write);
+    if (PeerHungUp == e_write) {
+        OnHangUp(session);
+        return false;
+    }
+
+    UpdateReadPause(session);
+    return (session.is_readable && !session.is_read_paused) || (session.is_writable && !HasSentAll(session, BroadcastLogOf(broadcast_logs_, session)));
+}
+
+void EpollServer::OnListenerEvent() {
+    // Drain the backlog in one go, so that a connection storm is not taken one connection per loop iteration.
+    // accept4 makes the new socket non-blocking (and close-on-exec) in the same syscall.
+    // Capped at max_accepts_per_tick, so that sessions already in the run queue still get their turn. 
+    // The listener is level-triggered, so whatever is left in the backlog is reported by the next epoll_wait.
+    epoll_controller_.ReserveForNewFds(config_.max_accepts_per_tick);
+
+    size_t num_accepted = 0;
+    size_t num_accept_calls = 0;
+    while (num_accepted < config_.max_accepts_per_tick) {
+        sockaddr_in client_address = { 0 };
+        socklen_t client_address_size = sizeof(client_address);
+        ++num_accept_calls;
+        const int fd_accepted = accept4(fd_listening_, (sockaddr*)&client_address, &client_address_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if (-1 == fd_accepted) {
+            if ((EAGAIN != errno) && (EWOULDBLOCK != errno) && (EINTR != errno)) {
+                log::PrintLnCurrentErrno(log::Error, "Failed accept");
+            }
+            break;
+        }
+        ++num_accepted;
+
+        Session* session_ptr = nullptr;
+        sessions_.Add(fd_accepted, session_ptr);
+        session_ptr->broadcast_cursor = broadcast_logs_.Join(session_ptr->ack_maker_and_serialiser.wire_version);
+        if (offloader_.IsEnabled()) {
+            session_ptr->ack_maker_and_serialiser.EnableOffload(&offloader_, MakeSessionTag(fd_accepted, session_ptr->generation), config_.offloaded_msg_types);
+        }
+        session_ptr->ack_maker_and_serialiser.EnableTopics(&topic_index_, &topic_bus_, fd_accepted);
+        // Without a timer, a delayed Ack would never go out.
+        session_ptr->ack_maker_and_serialiser.SetCumulativeAcks(config_.max_msgs_per_ack, config_.ack_delay_ms && (fd_timer_ >= 0));
+        if (config_.heartbeat_interval_ms || config_.idle_timeout_ms) {
+            ScheduleTimer(session_ptr->liveness_timer, config_.heartbeat_interval_ms ? config_.heartbeat_interval_ms : config_.idle_timeout_ms);
+        }
+        // After scheduling, which brings the wheel up to date if it was standing still.
+        session_ptr->last_read_tick = timer_wheel_.CurrentTick();
+
         char client_address_as_string[64] = { 0 };
         inet_ntop(AF_INET, &client_address.sin_addr, client_address_as_string, sizeof(client_address_as_string));
-        log::PrintLn(log::Info, "%d|Accepted|%s:%d", fd_accepted, client_address_as_string, ntohs(client_address.sin_port));
+        log::PrintLn(log::Debug, "%d|Accepted|%s:%d", fd_accepted, client_address_as_string, ntohs(client_address.sin_port));
+
+        // In edge-triggered mode, EPOLLOUT is registered up front so that it never needs to be toggled.
+        const uint32_t events_of_interest = config_.is_edge_triggered
+            ? (EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLHUP | EPOLLET)
+            : (EPOLLIN | EPOLLRDHUP | EPOLLHUP);
+        epoll_controller_.AddToInterestList(fd_accepted, events_of_interest, MakeSessionTag(fd_accepted, session_ptr->generation));
+    }
 
-        SetNoBlocking(fd_accepted);
+    stats_.OnSyscalls(num_accept_calls);
+    stats_.OnAccepts(num_accepted, num_accepted == config_.max_accepts_per_tick);
+}
 
-        static const uint32_t events_of_interest = EPOLLIN | EPOLLRDHUP | EPOLLHUP;
-        epoll_controller_.AddToInterestList(fd_accepted, events_of_interest);
+/*
+How much the next read asks for: at least read_threshold, or what the partial frame held still needs, whichever is more.
+Once a read has come back full, the socket likely holds more, so FIONREAD is asked how much and the read is sized to take 
+all of it (plus read_threshold, so that a read that drains the socket still comes back short), and a bulk transfer 
+is read in one syscall per turn instead of one per read_threshold. Trickle traffic, whose reads come back short, 
+never pays for the extra ioctl. Either way the turn's read_deficit caps it.
+*/
+size_t EpollServer::ReadSize(Session& session) {
+    size_t num_bytes_to_read = std::max(session.read_threshold, session.deserialiser.NumBytesToCompleteFrame());
+    if (session.was_last_read_full) {
+        const int num_bytes_readable = NumBytesReadable(session.fd);
+        stats_.OnSyscalls(1);
+        if (num_bytes_readable > 0) {
+            num_bytes_to_read = std::max(num_bytes_to_read, static_cast<size_t>(num_bytes_readable) + session.read_threshold);
+        }
     }
+    return std::min(num_bytes_to_read, session.read_deficit);
+}
+
+/*
+Once the socket has been drained with only part of a frame read, there is no point in being woken up before the rest 
+of it can have arrived, so SO_RCVLOWAT is raised to what the frame still needs (at most read_budget, so that a frame 
+that is streamed is still taken a read_budget at a time). It is put back to 1 once no frame is under way.
+The kernel still reports a hang up however few bytes are waiting. setsockopt is only called when the value changes.
+*/
+void EpollServer::UpdateReceiveLowWatermark(Session& session) {
+    size_t low_watermark = 1;
+    if (!session.is_readable) {
+        const size_t num_bytes_to_complete_frame = session.deserialiser.NumBytesToCompleteFrame();
+        if (num_bytes_to_complete_frame > 0) {
+            low_watermark = std::min(num_bytes_to_complete_frame, config_.read_budget);
+        }
+    }
+    if (low_watermark == session.receive_low_watermark) return;
+
+    stats_.OnSyscalls(1);
+    if (SetReceiveLowWatermark(session.fd, static_cast<int>(low_watermark)) < 0) {
+        log::PrintLnCurrentErrno(log::Error, "%d|Failed to set SO_RCVLOWAT", session.fd);
+        return;
+    }
+    session.receive_low_watermark = low_watermark;
 }
 
 SocketIOStatus EpollServer::OnReadyToRead(Session& session) {
-    const SocketIOStatus e = GetDataThenDeserialise
-        ( session.deserialiser
-        , session.socket_reader
-        , session.read_threshold
-        , session.ack_maker_and_serialiser);
+    if ((!session.is_readable) || session.is_read_paused) return WentThrough;
+
+    // Read (in ReadSize sized steps) until the socket is drained (a short read or EAGAIN) or the turn's quantum is spent.
+    // Whatever is left over is read in the session's next turn, after every other queued session has had its turn.
+    session.read_deficit += config_.read_budget;
+    SocketIOStatus e = WentThrough;
+    while (session.is_readable && (!session.is_read_paused) && (session.read_deficit >= session.read_threshold)) {
+        const size_t num_bytes_to_read = ReadSize(session);
+        size_t num_frames = 0;
+        e = GetDataThenDeserialise
+            ( session.deserialiser
+            , session.socket_reader
+            , num_bytes_to_read
+            , session.ack_maker_and_serialiser
+            , &num_frames);
+        stats_.OnFrames(num_frames);
+        // The deserialiser stops right after a Hello that changes the wire version, and takes the rest once it has been answered.
+        while (WireVersion_Unknown != session.ack_maker_and_serialiser.hello_wire_version) {
+            AnswerHello(session, broadcast_logs_);
+            stats_.OnFrames(session.deserialiser.Deserialise(session.ack_maker_and_serialiser));
+        }
+        if (session.deserialiser.HasRejectedFrame()) {
+            log::PrintLn(log::Error, "%d|Got a %zu byte frame, above the maximum frame size of %zu bytes. Disconnecting", session.fd, session.deserialiser.RejectedFrameSize(), config_.max_frame_size);
+            stats_.OnFrameRejected();
+            return PeerHungUp;
+        }
+        const size_t num_bytes_read = (session.socket_reader.last_status > 0) ? session.socket_reader.last_status : 0;
+        session.read_deficit -= num_bytes_read;
+        if (num_bytes_read > 0) {
+            session.last_read_tick = timer_wheel_.CurrentTick();
+        }
+        session.was_last_read_full = (num_bytes_read == num_bytes_to_read);
+        if ((WentThrough != e) || ((!session.was_last_read_full) && (!session.is_peer_shut_down))) {
+            session.is_readable = false;
+        }
+        UpdateReadPause(session);
+    }
+    UpdateReceiveLowWatermark(session);
+    if (session.ack_maker_and_serialiser.HasDelayedAck() && (!session.ack_delay_timer.is_armed)) {
+        ScheduleTimer(session.ack_delay_timer, config_.ack_delay_ms);
+    }
 
-    SendPendingMessagesThenSetupRetryAsNeeded(session, epoll_controller_);
+    // A session with nothing left to read does not get to bank its unused quantum.
+    if ((!session.is_readable) || session.is_read_paused) {
+        session.read_deficit = 0;
+    }
     return e;
 }
 
 SocketIOStatus EpollServer::OnReadyToWrite(Session& session) {
-    const SocketIOStatus e = SendPendingMessagesThenSetupRetryAsNeeded(session, epoll_controller_);
+    if (!session.is_writable) return WentThrough;
+
+    session.write_deficit += config_.write_budget;
+    size_t num_bytes_written = 0;
+    const SocketIOStatus e = SendPendingMessagesThenSetupRetryAsNeeded(session, BroadcastLogOf(broadcast_logs_, session), epoll_controller_, config_, session.write_deficit, &num_bytes_written);
+    session.write_deficit -= std::min(num_bytes_written, session.write_deficit);
+    if (WouldBlock == e) {
+        session.is_writable = false;
+    }
+    UpdateWriteDeadline(session, num_bytes_written);
+
+    // A session with nothing left to write does not get to bank its unused quantum.
+    if ((!session.is_writable) || HasSentAll(session, BroadcastLogOf(broadcast_logs_, session))) {
+        session.write_deficit = 0;
+    }
     return e;
 }
 
-void EpollServer::OnHangUp(const int fd) {
+void EpollServer::OnHangUp(Session& session) {
+    const int fd = session.fd;
     log::PrintLn(log::Debug, "%d|Peer hung up", fd);
+    run_queue_.Remove(&session);
+    timer_wheel_.Cancel(session.liveness_timer);
+    timer_wheel_.Cancel(session.write_deadline_timer);
+    timer_wheel_.Cancel(session.ack_delay_timer);
+    topic_index_.UnsubscribeAll(fd);
+    broadcast_logs_.Leave(session.ack_maker_and_serialiser.wire_version, session.broadcast_cursor);
     epoll_controller_.RemoveFromInterestList(fd);
     const int e = close(fd);
     if (e < 0) {
@@ -199,6 +399,15 @@ void EpollServer::CloseListeningAndSessionSockets() {
     }
     fd_listening_ = -1;
 
+    // The wakeup fd itself is closed with command_queue_.
+    epoll_controller_.RemoveFromInterestList(command_queue_.WakeupFd());
+
+    if (fd_timer_ >= 0) {
+        epoll_controller_.RemoveFromInterestList(fd_timer_);
+        close(fd_timer_);
+    }
+    fd_timer_ = -1;
+
     const size_t num_sessions = sessions_.Size();
     log::PrintLn(log::Info, "Closing all %zu accepted fds ...", num_sessions);
     const size_t n_closed = CloseSessionSockets();
@@ -237,58 +446,339 @@ size_t EpollServer::CloseSessionSockets() {
 }
 
 void EpollServer::AppendAndSerialiseFrameToAllSessions(char const* const frame_ptr, const size_t n) {
-    struct AppendFrame {
-        char const* const frame_ptr;
-        const size_t n;
-        EpollController& epoll_controller;
-        AppendFrame(EpollController& epoll_controller, char const* const frame_ptr, const size_t n)
-            : frame_ptr(frame_ptr)
-            , n(n)
-            , epoll_controller(epoll_controller)
+    command_queue_.PostBroadcast(frame_ptr, n);
+}
+
+void EpollServer::AppendAndSerialiseFrameToAllSessions(char const* const frame_ptr, const size_t n, const uint64_t conflation_key) {
+    command_queue_.PostConflatedBroadcast(frame_ptr, n, conflation_key);
+}
+
+void EpollServer::OnWakeup() {
+    command_queue_.ReadWakeup();
+    command_queue_.Drain(*this);
+}
+
+void EpollServer::HandleLoopCommand(LoopCommand& command) {
+    switch (command.type) {
+    case LoopCommand_Broadcast:
+        AppendFrameToAllSessions(std::move(command.frame));
+        break;
+    case LoopCommand_ConflatedBroadcast:
+        ConflateFrameToAllSessions(std::move(command.frame), command.conflation_key);
+        break;
+    case LoopCommand_OffloadedFrame:
+        OnOffloadedFrame(command);
+        break;
+    case LoopCommand_Publish:
+        PublishFrameToSubscribers(std::move(command.frame));
+        break;
+    }
+}
+
+uint64_t EpollServer::NowTick() const {
+    timespec now = { 0 };
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const int64_t elapsed_ms = (now.tv_sec - timer_start_time_.tv_sec) * 1000 + (now.tv_nsec - timer_start_time_.tv_nsec) / 1000000;
+    return (elapsed_ms > 0) ? (elapsed_ms / TimerTickMs) : 0;
+}
+
+void EpollServer::ScheduleTimer(TimerNode& timer, const size_t delay_ms) {
+    if (fd_timer_ < 0) return;
+    if (!is_timer_ticking_) {
+        // The wheel stood still while nothing was armed, so catch it up before measuring the delay from it.
+        timer_wheel_.Advance(NowTick(), *this);
+        SetTimerTicking(true);
+    }
+    timer_wheel_.Schedule(timer, (delay_ms + TimerTickMs - 1) / TimerTickMs);
+}
+
+// A periodic timerfd, rather than one armed for the next expiry, because the wheel does not know its next expiry cheaply.
+// It only ticks while some timer is armed.
+void EpollServer::SetTimerTicking(const bool should_tick) {
+    if (should_tick == is_timer_ticking_) return;
+    itimerspec spec = { 0 };
+    if (should_tick) {
+        spec.it_interval.tv_sec = TimerTickMs / 1000;
+        spec.it_interval.tv_nsec = (TimerTickMs % 1000) * 1000000;
+        spec.it_value = spec.it_interval;
+    }
+    stats_.OnSyscalls(1);
+    if (timerfd_settime(fd_timer_, 0, &spec, NULL) < 0) {
+        log::PrintLnCurrentErrno(log::Error, "%d|Failed to %s timerfd", fd_timer_, should_tick ? "arm" : "disarm");
+        return;
+    }
+    is_timer_ticking_ = should_tick;
+}
+
+void EpollServer::OnTimerEvent() {
+    uint64_t num_expirations = 0;
+    stats_.OnSyscalls(1);
+    if ((read(fd_timer_, &num_expirations, sizeof(num_expirations)) < 0) && (EAGAIN != errno)) {
+        log::PrintLnCurrentErrno(log::Error, "%d|Failed to read timerfd", fd_timer_);
+    }
+
+    timer_wheel_.Advance(NowTick(), *this);
+    if (timer_wheel_.Empty()) {
+        SetTimerTicking(false);
+    }
+}
+
+void EpollServer::HandleTimer(TimerNode& timer) {
+    Session& session = *(Session*)timer.context;
+    switch (timer.kind) {
+    case SessionTimer_Liveness:
+        OnLivenessTimer(session);
+        break;
+    case SessionTimer_WriteDeadline:
+        OnWriteDeadline(session);
+        break;
+    case SessionTimer_AckDelay:
+        OnAckDelay(session);
+        break;
+    }
+}
+
+// Fires every heartbeat interval (or, without heartbeats, when the idle timeout is due).
+// Sends a HeartBeat if the peer has been quiet for an interval, and closes the session if it has been quiet for the idle timeout.
+// Anything the peer sends counts, including its Acks of our HeartBeats.
+void EpollServer::OnLivenessTimer(Session& session) {
+    const uint64_t num_quiet_ticks = timer_wheel_.CurrentTick() - session.last_read_tick;
+    const size_t quiet_ms = num_quiet_ticks * TimerTickMs;
+    // A session whose reads are paused may well be talking to us: it is up to the write deadline to catch it if it is stuck.
+    if (config_.idle_timeout_ms && (quiet_ms >= config_.idle_timeout_ms) && (!session.is_read_paused)) {
+        log::PrintLn(log::Info, "%d|Closing idle session: nothing received for %zu ms", session.fd, quiet_ms);
+        OnHangUp(session);
+        return;
+    }
+
+    if (config_.heartbeat_interval_ms && (quiet_ms >= config_.heartbeat_interval_ms)) {
+        AppendMsg(session.serialiser, session.ack_maker_and_serialiser.wire_version, HeartBeat());
+        if (session.is_writable) {
+            run_queue_.PushBack(&session);
+        }
+    }
+
+    size_t delay_ms = config_.heartbeat_interval_ms ? config_.heartbeat_interval_ms : config_.idle_timeout_ms;
+    if (config_.idle_timeout_ms) {
+        delay_ms = std::min(delay_ms, config_.idle_timeout_ms - quiet_ms);
+    }
+    ScheduleTimer(session.liveness_timer, delay_ms);
+}
+
+void EpollServer::OnWriteDeadline(Session& session) {
+    log::PrintLn(log::Info, "%d|Closing stuck session: %zu pending bytes (%zu held) and %zu broadcast bytes have not moved for %zu ms"
+        , session.fd, session.serialiser.NumBytesPending(), session.serialiser.NumBytesHeld(), BroadcastLogOf(broadcast_logs_, session).Lag(session.broadcast_cursor), config_.write_timeout_ms);
+    OnHangUp(session);
+}
+
+// Sends the cumulative Ack held back since the read that armed the timer, covering whatever has been read since as well.
+void EpollServer::OnAckDelay(Session& session) {
+    if (!session.ack_maker_and_serialiser.HasDelayedAck()) return;
+    session.ack_maker_and_serialiser.FlushAcks();
+    if (session.is_writable) {
+        run_queue_.PushBack(&session);
+    }
+}
+
+// The deadline runs while there are pending bytes, and restarts whenever some of them go out.
+void EpollServer::UpdateWriteDeadline(Session& session, const size_t num_bytes_written) {
+    if (!config_.write_timeout_ms) return;
+    if (HasSentAll(session, BroadcastLogOf(broadcast_logs_, session))) {
+        timer_wheel_.Cancel(session.write_deadline_timer);
+    }
+    else if ((num_bytes_written > 0) || (!session.write_deadline_timer.is_armed)) {
+        ScheduleTimer(session.write_deadline_timer, config_.write_timeout_ms);
+    }
+}
+
+// Stops reading from a session at its high watermark, and resumes once it is down to its low watermark.
+void EpollServer::UpdateReadPause(Session& session) {
+    if (!config_.high_watermark) return;
+    const size_t num_bytes_to_send = NumBytesToSend(session, BroadcastLogOf(broadcast_logs_, session));
+    if ((!session.is_read_paused) && (num_bytes_to_send >= config_.high_watermark)) {
+        log::PrintLn(log::Debug, "%d|Pausing reads: %zu bytes to send", session.fd, num_bytes_to_send);
+        session.is_read_paused = true;
+        stats_.OnReadPaused();
+        if (!config_.is_edge_triggered) {
+            // Otherwise level-triggered EPOLLIN keeps reporting the bytes we are deliberately leaving unread.
+            epoll_controller_.ModifyInterestList(session.fd, 0, EPOLLIN);
+        }
+    }
+    else if (session.is_read_paused && (num_bytes_to_send <= config_.low_watermark)) {
+        log::PrintLn(log::Debug, "%d|Resuming reads: %zu bytes to send", session.fd, num_bytes_to_send);
+        session.is_read_paused = false;
+        if (!config_.is_edge_triggered) {
+            epoll_controller_.ModifyInterestList(session.fd, EPOLLIN, 0);
+        }
+        // Whatever arrived while paused may not be reported again (an edge already consumed), so just try reading.
+        session.is_readable = true;
+    }
+}
+
+// Returns false if the session has been disconnected.
+bool EpollServer::ApplySlowConsumerPolicy(Session& session) {
+    if (!config_.slow_consumer_limit) return true;
+    const size_t num_bytes_to_send = NumBytesToSend(session, BroadcastLogOf(broadcast_logs_, session));
+    if (num_bytes_to_send <= config_.slow_consumer_limit) return true;
+
+    switch (config_.slow_consumer_policy) {
+    case SlowConsumer_None:
+        break;
+    case SlowConsumer_Disconnect:
+        log::PrintLn(log::Info, "%d|Disconnecting slow consumer: %zu bytes to send", session.fd, num_bytes_to_send);
+        stats_.OnSlowConsumerDisconnected();
+        OnHangUp(session);
+        return false;
+    case SlowConsumer_DropBroadcasts: {
+        const size_t num_bytes_dropped = SkipBroadcasts(session.serialiser, BroadcastLogOf(broadcast_logs_, session), session.broadcast_cursor);
+        log::PrintLn(log::Debug, "%d|Dropped %zu broadcast bytes for slow consumer", session.fd, num_bytes_dropped);
+        stats_.OnBroadcastsDropped(num_bytes_dropped);
+        break;
+    }
+    }
+    return true;
+}
+
+// Appends the frame to the broadcast log, for every session to send from its own cursor, 
+// and queues the sessions that can be written to, so that the run queue sends it.
+void EpollServer::AppendFrameToAllSessions(std::vector<char>&& frame) {
+    struct QueueWritableSession {
+        EpollServer& server;
+        size_t max_lag;
+        QueueWritableSession(EpollServer& server)
+            : server(server)
+            , max_lag(0)
         {}
         
         bool HandleFdAndSessionPtr(const int /*fd*/, Session* const session_ptr) {
             if ((!session_ptr) || (-1 == session_ptr->fd)) return true;
-            session_ptr->serialiser.AppendFrame(frame_ptr, n);
-            SendPendingMessagesThenSetupRetryAsNeeded(*session_ptr, epoll_controller);
+            if (!server.ApplySlowConsumerPolicy(*session_ptr)) return true;
+            max_lag = std::max(max_lag, BroadcastLogOf(server.broadcast_logs_, *session_ptr).Lag(session_ptr->broadcast_cursor));
+            server.UpdateReadPause(*session_ptr);
+            if (session_ptr->is_writable) {
+                server.run_queue_.PushBack(session_ptr);
+            }
             return true;
         }
     };
     
-    AppendFrame append_frame(epoll_controller_, frame_ptr, n);
-    sessions_.ForEachDo(append_frame);
+    broadcast_logs_.Append(std::move(frame));
+    QueueWritableSession queue_writable_session(*this);
+    sessions_.ForEachDo(queue_writable_session);
+    stats_.OnBroadcast(broadcast_logs_.NumBytesHeld(), queue_writable_session.max_lag);
 }
 
-struct AppendConsoleInputToServerSerialiser {
-    EpollServer& server;
-    AppendConsoleInputToServerSerialiser(EpollServer& server) : server(server) {}
-    bool HandleFrame(char const* const frame_ptr, const size_t n) {
-        server.AppendAndSerialiseFrameToAllSessions(frame_ptr, n);
-        return true;
-    }
-};
+// Queues the frame on every session's conflating queue (shared, not copied), and queues the sessions that can be written to.
+void EpollServer::ConflateFrameToAllSessions(std::vector<char>&& frame, const uint64_t conflation_key) {
+    struct ConflateFrame {
+        EpollServer& server;
+        SharedFrames& frames;
+        const uint64_t conflation_key;
+        size_t num_queued;
+        size_t num_replaced;
+        ConflateFrame(EpollServer& server, SharedFrames& frames, const uint64_t conflation_key)
+            : server(server)
+            , frames(frames)
+            , conflation_key(conflation_key)
+            , num_queued(0)
+            , num_replaced(0)
+        {}
 
-void RunEpollServer(const EpollServerConfig& config) {
-    log::PrintLn(log::Info, "Running server, listening on port %u", config.listening_port);
-    int fd_listening = -1;
-    if (!CreateAndListenOnNonBlockingSocket(config.listening_port, config.listening_backlog, fd_listening)) {
+        bool HandleFdAndSessionPtr(const int /*fd*/, Session* const session_ptr) {
+            if ((!session_ptr) || (-1 == session_ptr->fd)) return true;
+            ++num_queued;
+            if (session_ptr->conflating_queue.Push(conflation_key, frames.In(session_ptr->ack_maker_and_serialiser.wire_version))) {
+                ++num_replaced;
+            }
+            if (!server.ApplySlowConsumerPolicy(*session_ptr)) return true;
+            server.UpdateReadPause(*session_ptr);
+            if (session_ptr->is_writable) {
+                server.run_queue_.PushBack(session_ptr);
+            }
+            return true;
+        }
+    };
+
+    if (frame.empty()) return;
+    SharedFrames shared_frames(std::move(frame));
+    ConflateFrame conflate_frame(*this, shared_frames, conflation_key);
+    sessions_.ForEachDo(conflate_frame);
+    stats_.OnConflatableFrames(conflate_frame.num_queued, conflate_frame.num_replaced);
+}
+
+// Appends the frame to the sessions subscribed to its topic, and queues those that can be written to.
+// No other session is looked at. Each subscriber gets its own copy, in its wire version.
+void EpollServer::PublishFrameToSubscribers(std::vector<char>&& frame) {
+    const std::vector<int>* const subscriber_fds = topic_index_.SubscribersOf(TopicOfV1PublishFrame(frame));
+    if (!subscriber_fds) {
+        stats_.OnPublish(0, topic_index_.NumTopics());
         return;
     }
+    const size_t num_subscribers = subscriber_fds->size();
+    SharedFrames shared_frames(std::move(frame));
+    // Backwards, because disconnecting a slow consumer moves the last subscriber into its place.
+    for (size_t i = subscriber_fds->size(); i-- > 0;) {
+        if (i >= subscriber_fds->size()) continue;
+        Session* const session_ptr = sessions_.Find((*subscriber_fds)[i]);
+        if ((!session_ptr) || (-1 == session_ptr->fd)) continue;
+        if (!ApplySlowConsumerPolicy(*session_ptr)) continue;
+        const std::vector<char>& session_frame = *shared_frames.In(session_ptr->ack_maker_and_serialiser.wire_version);
+        session_ptr->serialiser.AppendFrame(&session_frame[0], session_frame.size());
+        UpdateReadPause(*session_ptr);
+        if (session_ptr->is_writable) {
+            run_queue_.PushBack(session_ptr);
+        }
+    }
+    stats_.OnPublish(num_subscribers, topic_index_.NumTopics());
+}
 
-    EpollServer server(fd_listening, config);
-
-    AppendConsoleInputToServerSerialiser append_console_input_to_server_serialiser(server);
-    std::thread gui_thread(RunConsoleInputLoop<AppendConsoleInputToServerSerialiser>, std::ref(append_console_input_to_server_serialiser));
+// The response to a frame handled by a worker. It goes out once every earlier response of its session has.
+void EpollServer::OnOffloadedFrame(LoopCommand& command) {
+    stats_.OnOffloadedFrame();
+    Session* const session_ptr = sessions_.FindByTag(command.session_tag);
+    if (!session_ptr) {
+        offloader_.OnStaleResponse(command);
+        return;
+    }
+    if (0 == offloader_.OnResponse(command, session_ptr->ack_maker_and_serialiser.offload_order, session_ptr->serialiser)) return;
+    UpdateReadPause(*session_ptr);
+    if (session_ptr->is_writable) {
+        run_queue_.PushBack(session_ptr);
+    }
+}
 
-    server.Run();
+void RunEpollServer(const EpollServerConfig& config) {
+    RunServerLoops<EpollServer>(config);
 }
 
-SocketIOStatus SendPendingMessagesThenSetupRetryAsNeeded(Session& session, EpollController& epoll_controller) {
-    session.serialiser.Serialise(session.socket_writer, session.write_threshold);
-    
-    const SocketIOStatus e = SummariseSocketIOStatus(session.write_threshold, session.socket_writer.last_status, session.socket_writer.last_errno);
+SocketIOStatus SendPendingMessagesThenSetupRetryAsNeeded(Session& session, BroadcastLog& broadcast_log, EpollController& epoll_controller, const EpollServerConfig& config, const size_t max_bytes_to_write, size_t* const num_bytes_written_ptr) {
+    // ATTENTION: When there is nothing to send, socket_writer holds the status of some earlier write, 
+    // which must not be mistaken for the outcome of this call.
+    SocketIOStatus e = WentThrough;
+    size_t num_bytes_written = 0;
+    // Each writev gathers everything pending (up to IOV_MAX segments) within the remaining budget. 
+    // It only takes more than one when the socket accepted all it was offered and there is still more queued.
+    while ((!HasSentAll(session, broadcast_log)) && (num_bytes_written < max_bytes_to_write)) {
+        const size_t num_bytes_to_write = max_bytes_to_write - num_bytes_written;
+        // Keyed broadcasts stay conflatable until there is nothing else of the session's own to send.
+        if (session.serialiser.HasSerialisedAll()) {
+            session.conflating_queue.MoveTo(session.serialiser, num_bytes_to_write);
+        }
+        const size_t num_bytes_written_this_time = SerialiseWithBroadcasts(session.serialiser, broadcast_log, session.broadcast_cursor, session.socket_writer, num_bytes_to_write);
+        e = SummariseSocketIOStatus(num_bytes_to_write, session.socket_writer.last_status, session.socket_writer.last_errno);
+        num_bytes_written += num_bytes_written_this_time;
+        if ((WentThrough != e) || (0 == num_bytes_written_this_time)) break;
+    }
+    if (num_bytes_written_ptr) {
+        *num_bytes_written_ptr = num_bytes_written;
+    }
+
+    if (config.is_edge_triggered) {
+        // EPOLLOUT is permanently registered: the next EPOLLOUT edge arrives once the socket becomes writable again.
+        return e;
+    }
 
-    if (session.serialiser.HasSerialisedAll()) {
+    if (HasSentAll(session, broadcast_log)) {
         // Nothing more to send, no need to watch for EPOLLOUT event anymore.
         epoll_controller.ModifyInterestList(session.fd, 0, EPOLLOUT);
     }
@@ -1,9 +1,19 @@
 #pragma once
 #include <unistd.h>
+#include <time.h>
+#include <vector>
 #include "config.h"
 #include "session.h"
 #include "epoll_controller.h"
 #include "socket_utils.h"
+#include "run_queue.h"
+#include "loop_stats.h"
+#include "loop_command_queue.h"
+#include "timer_wheel.h"
+#include "broadcast_log.h"
+#include "frame_offloader.h"
+#include "worker_pool.h"
+#include "topic_index.h"
 
 struct epoll_event;
 
@@ -12,36 +22,84 @@ class EpollServer {
     int fd_listening_;
     const EpollServerConfig config_;
     Sessions sessions_;
+    RunQueue<Session> run_queue_;
+    LoopStats stats_;
+    // Everything other threads want done by this loop, e.g. broadcasts from the console thread.
+    LoopCommandQueue command_queue_;
+    // Hands frames of the offloaded types to the worker pool, whose responses come back through command_queue_.
+    FrameOffloader offloader_;
+    // Broadcast frames, stored once per wire version and sent to each session through its broadcast_cursor.
+    BroadcastLogs broadcast_logs_;
+    // Which of this loop's sessions are subscribed to which topics, and the way publishes reach every loop.
+    TopicIndex topic_index_;
+    TopicBus& topic_bus_;
+
+    // Session timers, ticked by fd_timer_ every TimerTickMs while any are armed.
+    TimerWheel timer_wheel_;
+    int fd_timer_;
+    bool is_timer_ticking_;
+    timespec timer_start_time_;
     
     void Loop();
     size_t ProcessReadyEvents(epoll_event* const ready_events, const size_t num_ready);
+    void ServiceRunQueue();
+    bool ServiceSession(Session&);
     void OnListenerEvent();
+    void OnWakeup();
+    uint64_t NowTick() const;
+    void ScheduleTimer(TimerNode&, const size_t delay_ms);
+    void SetTimerTicking(const bool should_tick);
+    void OnTimerEvent();
+    void OnLivenessTimer(Session&);
+    void OnWriteDeadline(Session&);
+    void OnAckDelay(Session&);
+    void UpdateWriteDeadline(Session&, const size_t num_bytes_written);
+    void UpdateReadPause(Session&);
+    size_t ReadSize(Session&);
+    void UpdateReceiveLowWatermark(Session&);
+    bool ApplySlowConsumerPolicy(Session&);
+    void AppendFrameToAllSessions(std::vector<char>&& frame);
+    void ConflateFrameToAllSessions(std::vector<char>&& frame, const uint64_t conflation_key);
+    void PublishFrameToSubscribers(std::vector<char>&& frame);
+    void OnOffloadedFrame(LoopCommand&);
     SocketIOStatus OnReadyToRead(Session&);
     SocketIOStatus OnReadyToWrite(Session&);
-    void OnHangUp(const int fd);
+    void OnHangUp(Session&);
     void OnUnknownEvent(const epoll_event&);
     
     void CloseListeningAndSessionSockets();
     size_t CloseSessionSockets();
 
 public:
-    EpollServer(const int fd_listening, const EpollServerConfig&);
+    // worker_pool: shared by all loops, or nullptr to handle every frame on the loop.
+    // topic_bus: shared by all loops, which join it here.
+    EpollServer(const int fd_listening, const EpollServerConfig&, WorkerPool* const worker_pool, TopicBus& topic_bus);
     ~EpollServer();
+    // Thread-safe: hands the frame to the loop thread, which appends it to every session and sends it.
     void AppendAndSerialiseFrameToAllSessions(char const* const frame_ptr, const size_t n);
+    // Thread-safe: as above, except that a session that still has an unsent frame with the same conflation_key 
+    // gets this frame in its place, instead of both.
+    void AppendAndSerialiseFrameToAllSessions(char const* const frame_ptr, const size_t n, const uint64_t conflation_key);
+    void HandleLoopCommand(LoopCommand&);
+    void HandleTimer(TimerNode&);
     
     void Run();
 };
 
 /*
-Attempt to stream out as much data stored in the serialiser as possible (within write_threshold limits).
+Attempt to stream out as much data stored in the serialiser, and as many of the broadcasts the session has yet to send, 
+as possible, gathering them into as few writev calls as it takes, until the socket would block or max_bytes_to_write 
+have been written.
 
-If after that attempt, the serialiser still has data remaining, register interest in EPOLLOUT so that 
+If after that attempt, the session still has data remaining, register interest in EPOLLOUT so that 
 we can wait for that event and send again.
 
-If after the send attempt, the serialiser doesn't have any more pending data, then unregister interest in 
+If after the send attempt, the session doesn't have any more pending data, then unregister interest in 
 EPOLLOUT, otherwise we will most likely be unnecessarily flooded with EPOLLOUT events even when we don'
 t have data to write.
+
+In edge-triggered mode, EPOLLOUT is registered once for the lifetime of the session and the interest list is left alone.
 */ 
-SocketIOStatus SendPendingMessagesThenSetupRetryAsNeeded(Session& session, EpollController& epoll_controller);
+SocketIOStatus SendPendingMessagesThenSetupRetryAsNeeded(Session& session, BroadcastLog& broadcast_log, EpollController& epoll_controller, const EpollServerConfig& config, const size_t max_bytes_to_write, size_t* const num_bytes_written_ptr = 0);
 
 void RunEpollServer(const EpollServerConfig&);
\ No newline at end of file
@@ -0,0 +1,60 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <type_traits>
+#include <utility>
+
+// One complete frame, pointing into the deserialiser's buffer. Only valid during the HandleFrames call it is passed to.
+// ptr and n span the whole frame. The rest is its header decoded (whatever the wire format, see wire_format.h):
+// body and num_body_bytes span what follows the header, and a frame too short to have a type gets an unknown type.
+struct FrameView {
+    char const* ptr;
+    size_t n;
+    char const* body;
+    size_t num_body_bytes;
+    uint8_t type;
+    uint8_t flags;
+};
+
+/*
+Frame handlers come in two kinds:
+- per frame: bool HandleFrame(char const* const frame_ptr, const size_t num_bytes_in_frame);
+- batch:     void HandleFrames(const FrameView* const frames, const size_t num_frames);
+  which gets every complete frame from one AppendStream at once, so that it can amortise locking, logging
+  and serialiser appends across them.
+HasHandleFrames<T> tells which kind T is, and PerFrameHandlerAdapter makes a per-frame handler usable as a batch one.
+
+Either kind may also take frames in pieces, straight from the read buffer, so that a frame of any size is handled
+without ever being held whole:
+    void HandleFrameBegin(const FrameView& first_piece, const size_t num_bytes_in_frame);
+    void HandleFrameChunk(char const* const chunk_ptr, const size_t num_bytes);
+    void HandleFrameEnd();
+Begin gets the first bytes of the frame (its whole header included), then Chunk gets the rest in order, then End.
+HasHandleFramePieces<T> tells whether T has them. A handler that does not is handed every frame whole.
+*/
+template<typename T, typename = void>
+struct HasHandleFrames : std::false_type {};
+
+template<typename T>
+struct HasHandleFrames<T, std::void_t<decltype(std::declval<T&>().HandleFrames(std::declval<const FrameView*>(), size_t(0)))>> : std::true_type {};
+
+template<typename T, typename = void>
+struct HasHandleFramePieces : std::false_type {};
+
+template<typename T>
+struct HasHandleFramePieces<T, std::void_t<
+      decltype(std::declval<T&>().HandleFrameBegin(std::declval<const FrameView&>(), size_t(0)))
+    , decltype(std::declval<T&>().HandleFrameChunk(std::declval<char const*>(), size_t(0)))
+    , decltype(std::declval<T&>().HandleFrameEnd())>> : std::true_type {};
+
+template<typename FrameHandler>
+struct PerFrameHandlerAdapter {
+    FrameHandler& frame_handler;
+    PerFrameHandlerAdapter(FrameHandler& frame_handler) : frame_handler(frame_handler) {}
+
+    void HandleFrames(const FrameView* const frames, const size_t num_frames) {
+        for (size_t i = 0; i < num_frames; ++i) {
+            frame_handler.HandleFrame(frames[i].ptr, frames[i].n);
+        }
+    }
+};
@@ -0,0 +1,160 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+#include "loop_command_queue.h"
+#include "worker_pool.h"
+
+/*
+The order in which a session's responses are to be sent, while some of them are being made off the loop.
+
+Each frame handed to a worker takes a slot (Reserve()), which is filled when its response comes back (Complete(...)).
+Whatever else the session sends in response to its peer meanwhile (e.g. Acks made on the loop) is put in a slot of its own
+(AppendDone(...)) instead of straight into the serialiser, so nothing overtakes an earlier response.
+Slots are handed to the serialiser from the front, as soon as they are filled.
+
+Single owner: only the loop thread may call into it.
+*/
+class OffloadOrder {
+    struct Slot {
+        bool is_done;
+        std::vector<char> bytes;
+    };
+
+    std::deque<Slot> slots_;
+    // seq of slots_.front(). Never goes back, so that a response to a connection since closed is recognised as such.
+    uint64_t front_seq_;
+
+public:
+    OffloadOrder()
+        : front_seq_(0)
+    {}
+
+    // Nothing is waiting for a worker, i.e. responses can go straight into the serialiser.
+    bool IsEmpty() const { return slots_.empty(); }
+    size_t NumSlots() const { return slots_.size(); }
+
+    void Reset() {
+        front_seq_ += slots_.size();
+        slots_.clear();
+    }
+
+    // Returns the seq of a slot for a response to be made off the loop.
+    uint64_t Reserve() {
+        slots_.push_back(Slot{ false, std::vector<char>() });
+        return front_seq_ + slots_.size() - 1;
+    }
+
+    void AppendDone(char const* const ptr, const size_t n) {
+        if (slots_.empty() || (!slots_.back().is_done)) {
+            slots_.push_back(Slot{ true, std::vector<char>() });
+        }
+        std::vector<char>& bytes = slots_.back().bytes;
+        bytes.insert(bytes.end(), ptr, ptr + n);
+    }
+
+    // Swaps bytes into the slot of seq. Returns false if there is no such slot, e.g. it was Reset since.
+    bool Complete(const uint64_t seq, std::vector<char>& bytes) {
+        if ((seq < front_seq_) || (seq >= (front_seq_ + slots_.size()))) return false;
+        Slot& slot = slots_[seq - front_seq_];
+        slot.bytes.swap(bytes);
+        slot.is_done = true;
+        return true;
+    }
+
+    // Appends the filled slots at the front to serialiser, and hands their buffers to buffer_recycler.
+    // SerialiserType: Serialiser or WaitableSerialiser. BufferRecycler: Functor signature: void Recycle(std::vector<char>&);
+    template<typename SerialiserType, typename BufferRecycler>
+    size_t DeliverTo(SerialiserType& serialiser, BufferRecycler& buffer_recycler) {
+        size_t num_slots_delivered = 0;
+        while ((!slots_.empty()) && slots_.front().is_done) {
+            std::vector<char>& bytes = slots_.front().bytes;
+            if (!bytes.empty()) {
+                serialiser.AppendFrame(&bytes[0], bytes.size());
+            }
+            buffer_recycler.Recycle(bytes);
+            slots_.pop_front();
+            ++front_seq_;
+            ++num_slots_delivered;
+        }
+        return num_slots_delivered;
+    }
+};
+
+/*
+One loop's way of handing frames to the WorkerPool (shared by all loops), and of taking the responses back,
+which come in as LoopCommand_OffloadedFrame commands on the loop's LoopCommandQueue.
+Frames are copied into buffers that are reused from one job to the next, so a steady stream of offloaded frames
+allocates nothing but the LoopCommand. Without a pool (no worker threads), IsEnabled() is false and nothing is offloaded.
+
+Single owner: only the loop thread may call into it.
+*/
+class FrameOffloader {
+    WorkerPool* const worker_pool_;
+    LoopCommandQueue& reply_queue_;
+    std::vector<std::vector<char>> spare_buffers_;
+    size_t num_in_flight_;
+
+    FrameOffloader(const FrameOffloader&) = delete;
+    FrameOffloader& operator=(const FrameOffloader&) = delete;
+
+public:
+    static const size_t MaxNumSpareBuffers = 1024;
+    // Larger buffers are freed rather than kept, so that one large frame does not stay held for good.
+    static const size_t MaxSpareBufferCapacity = 64 * 1024;
+
+    FrameOffloader(WorkerPool* const worker_pool, LoopCommandQueue& reply_queue)
+        : worker_pool_(worker_pool)
+        , reply_queue_(reply_queue)
+        , num_in_flight_(0)
+    {}
+
+    bool IsEnabled() const { return nullptr != worker_pool_; }
+    size_t NumInFlight() const { return num_in_flight_; }
+
+    // Hands a copy of frame_ptr[0, n) to a worker, which calls work(...) on it (see LoopCommand).
+    void Offload(char const* const frame_ptr, const size_t n, void (*work)(LoopCommand&), const uint64_t session_tag, const uint64_t seq, const uint8_t wire_version, const uint64_t ack_seq) {
+        LoopCommand* const job = new LoopCommand();
+        job->type = LoopCommand_OffloadedFrame;
+        if (!spare_buffers_.empty()) {
+            job->frame.swap(spare_buffers_.back());
+            spare_buffers_.pop_back();
+        }
+        job->frame.assign(frame_ptr, frame_ptr + n);
+        job->work = work;
+        job->reply_queue = &reply_queue_;
+        job->session_tag = session_tag;
+        job->seq = seq;
+        job->wire_version = wire_version;
+        job->ack_seq = ack_seq;
+        ++num_in_flight_;
+        worker_pool_->Submit(job);
+    }
+
+    // For a LoopCommand_OffloadedFrame of a session that is still connected: fills the response's slot in order, 
+    // and appends whatever can now go out to serialiser. Returns the number of slots appended.
+    template<typename SerialiserType>
+    size_t OnResponse(LoopCommand& command, OffloadOrder& order, SerialiserType& serialiser) {
+        --num_in_flight_;
+        size_t num_slots_delivered = 0;
+        if (order.Complete(command.seq, command.frame)) {
+            num_slots_delivered = order.DeliverTo(serialiser, *this);
+        }
+        Recycle(command.frame);
+        return num_slots_delivered;
+    }
+
+    // For a LoopCommand_OffloadedFrame of a session that has been closed since.
+    void OnStaleResponse(LoopCommand& command) {
+        --num_in_flight_;
+        Recycle(command.frame);
+    }
+
+    void Recycle(std::vector<char>& buffer) {
+        if ((spare_buffers_.size() >= MaxNumSpareBuffers) || (buffer.capacity() > MaxSpareBufferCapacity)) return;
+        buffer.clear();
+        spare_buffers_.push_back(std::vector<char>());
+        spare_buffers_.back().swap(buffer);
+    }
+};
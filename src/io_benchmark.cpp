@@ -6,7 +6,7 @@ void SetTime(timespec& dest, timespec const * const src_ptr) {
         memcpy(&dest, src_ptr, sizeof(*src_ptr));
     }
     else {
-        clock_gettime(CLOCK_REALTIME, &dest);
+        clock_gettime(CLOCK_MONOTONIC, &dest);
     }
 }
 
@@ -25,16 +25,23 @@ bool NanosecElapsed(long int& nanosec_elapsed, const timespec& t0, timespec cons
     }
     else {
         timespec now = { 0 };
-        clock_gettime(CLOCK_REALTIME, &now);
+        clock_gettime(CLOCK_MONOTONIC, &now);
         return NanosecElapsed(nanosec_elapsed, t0, now);
     }
 }
 
-IOBenchmark::IOBenchmark() {
+IOBenchmark::IOBenchmark()
+    : is_session_histogram_enabled_(true)
+{
     Reset();
 }
 
 void IOBenchmark::Reset() {
+    msg_sent_times_.clear();
+    first_unacked_msg_seq_ = 1;
+    if (round_trips_) {
+        round_trips_->Reset();
+    }
     memset(&last_pre_in_time_, 0, sizeof(last_pre_in_time_));
     memset(&last_post_in_time_, 0, sizeof(last_post_in_time_));
     memset(&last_pre_out_time_, 0, sizeof(last_pre_out_time_));
@@ -73,6 +80,57 @@ bool IOBenchmark::NanosecSinceLastPostOutTime(long int& nanosec_elapsed, timespe
     return NanosecElapsed(nanosec_elapsed, last_post_out_time_, t1_ptr);
 }
 
+void IOBenchmark::SetMsgSentTime(timespec const* const t) {
+    timespec sent_time = { 0 };
+    if (t) {
+        sent_time = *t;
+    }
+    else {
+        clock_gettime(CLOCK_MONOTONIC, &sent_time);
+    }
+    msg_sent_times_.push_back(sent_time);
+    if (is_session_histogram_enabled_ && !round_trips_) {
+        round_trips_.reset(new LatencyHistogram());
+    }
+}
+
+bool IOBenchmark::PopNanosecSinceMsgSent(const uint64_t acked_seq, uint64_t& seq, long int& nanosec_elapsed, timespec const* const t1_ptr) {
+    if (msg_sent_times_.empty() || (first_unacked_msg_seq_ > acked_seq)) return false;
+    timespec now = { 0 };
+    if (t1_ptr) {
+        now = *t1_ptr;
+    }
+    else {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+    seq = first_unacked_msg_seq_++;
+    const bool is_valid = NanosecElapsed(nanosec_elapsed, msg_sent_times_.front(), now);
+    msg_sent_times_.pop_front();
+    if (!is_valid) {
+        nanosec_elapsed = 0;
+    }
+    LatencyHistogram::Global().Record(nanosec_elapsed);
+    if (round_trips_ && (0 == (round_trips_->Record(nanosec_elapsed) % NumRoundTripsBetweenReports))) {
+        ReportRoundTrips(log::Info, "Session");
+    }
+    return true;
+}
+
+uint64_t IOBenchmark::NumMsgsSent() const {
+    return first_unacked_msg_seq_ - 1 + msg_sent_times_.size();
+}
+
+void IOBenchmark::DisableSessionHistogram() {
+    is_session_histogram_enabled_ = false;
+    round_trips_.reset();
+}
+
+void IOBenchmark::ReportRoundTrips(const log::Level level, char const* const name) const {
+    if (round_trips_) {
+        round_trips_->Report(level, name);
+    }
+}
+
 void ThreadSafeIOBenchmark::SetLastPreInTime(timespec const* const t) {
     std::lock_guard<std::mutex> lock(mutex_);
     io_benchmark_.SetLastPreInTime(t);
@@ -113,6 +171,26 @@ bool ThreadSafeIOBenchmark::NanosecSinceLastPostOutTime(long int& nanosec_elapse
     return io_benchmark_.NanosecSinceLastPostOutTime(nanosec_elapsed, t1_ptr);
 }
 
+void ThreadSafeIOBenchmark::SetMsgSentTime(timespec const* const t) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    io_benchmark_.SetMsgSentTime(t);
+}
+
+bool ThreadSafeIOBenchmark::PopNanosecSinceMsgSent(const uint64_t acked_seq, uint64_t& seq, long int& nanosec_elapsed, timespec const* const t1_ptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return io_benchmark_.PopNanosecSinceMsgSent(acked_seq, seq, nanosec_elapsed, t1_ptr);
+}
+
+uint64_t ThreadSafeIOBenchmark::NumMsgsSent() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return io_benchmark_.NumMsgsSent();
+}
+
+void ThreadSafeIOBenchmark::ReportRoundTrips(const log::Level level, char const* const name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    io_benchmark_.ReportRoundTrips(level, name);
+}
+
 void ThreadSafeIOBenchmark::Reset() {
     std::lock_guard<std::mutex> lock(mutex_);
     return io_benchmark_.Reset();
@@ -1,14 +1,30 @@
 #pragma once
 #include <time.h>
+#include <stdint.h>
+#include <deque>
+#include <memory>
 #include <mutex>
+#include "latency_histogram.h"
 
+// All times are CLOCK_MONOTONIC.
 class IOBenchmark {
     timespec last_pre_in_time_;
     timespec last_post_in_time_;
 
     timespec last_pre_out_time_;
     timespec last_post_out_time_;
+
+    // Send times of the messages the peer has yet to Ack, the first of which is first_unacked_msg_seq_.
+    std::deque<timespec> msg_sent_times_;
+    uint64_t first_unacked_msg_seq_;
+    // The session's round trips, also recorded in LatencyHistogram::Global(). Made by the first SetMsgSentTime(...),
+    // so that sessions that never track a message (e.g. most server sessions) do not carry one.
+    std::unique_ptr<LatencyHistogram> round_trips_;
+    bool is_session_histogram_enabled_;
 public:
+    // The session's histogram is logged every this many round trips.
+    static const uint64_t NumRoundTripsBetweenReports = 1 << 16;
+
     IOBenchmark();
     void SetLastPreInTime(timespec const* const t = 0);
     void SetLastPostInTime(timespec const* const t = 0);
@@ -20,6 +36,19 @@ public:
     bool NanosecSinceLastPreOutTime(long int&, timespec const* const t1_ptr = 0);
     bool NanosecSinceLastPostOutTime(long int&, timespec const* const t1_ptr = 0);
 
+    // Round trips of each message: call SetMsgSentTime() for every message sent that the peer Acks, and once an Ack 
+    // (cumulative or not) covers messages up to acked_seq (numbered from 1, in the order sent, as CompactAck::seq), 
+    // call PopNanosecSinceMsgSent(...) until it returns false, to get each covered message's seq and round trip time,
+    // which is also recorded in the session's histogram and the global one.
+    void SetMsgSentTime(timespec const* const t = 0);
+    bool PopNanosecSinceMsgSent(const uint64_t acked_seq, uint64_t& seq, long int&, timespec const* const t1_ptr = 0);
+    uint64_t NumMsgsSent() const;
+    // Round trips then only go into LatencyHistogram::Global(), e.g. for an owner of many sessions that reports them 
+    // all together (ncc bench), so that each session neither holds a histogram nor logs one.
+    void DisableSessionHistogram();
+    // Logs the session's round trip percentiles, if it has any.
+    void ReportRoundTrips(const log::Level, char const* const name) const;
+
     void Reset();
 };
 
@@ -37,5 +66,10 @@ public:
     bool NanosecSinceLastPreOutTime(long int&, timespec const * const t1_ptr = 0);
     bool NanosecSinceLastPostOutTime(long int&, timespec const * const t1_ptr = 0);
 
+    void SetMsgSentTime(timespec const* const t = 0);
+    bool PopNanosecSinceMsgSent(const uint64_t acked_seq, uint64_t& seq, long int&, timespec const* const t1_ptr = 0);
+    uint64_t NumMsgsSent();
+    void ReportRoundTrips(const log::Level, char const* const name);
+
     void Reset();
 };
\ No newline at end of file
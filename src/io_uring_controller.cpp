@@ -0,0 +1,244 @@
+#include "io_uring_controller.h"
+#include "logging.h"
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <algorithm>
+
+IoUringController::IoUringController(const unsigned num_entries)
+    : fd_ring_(-1)
+    , sq_ring_ptr_(MAP_FAILED)
+    , sq_ring_size_(0)
+    , cq_ring_ptr_(MAP_FAILED)
+    , cq_ring_size_(0)
+    , sqes_((io_uring_sqe*)MAP_FAILED)
+    , sqes_size_(0)
+    , sq_head_(nullptr)
+    , sq_tail_(nullptr)
+    , sq_array_(nullptr)
+    , sq_mask_(0)
+    , sq_entries_(0)
+    , sq_local_tail_(0)
+    , num_unsubmitted_(0)
+    , cq_head_(nullptr)
+    , cq_tail_(nullptr)
+    , cq_mask_(0)
+    , cqes_(nullptr)
+    , buf_ring_((io_uring_buf_ring*)MAP_FAILED)
+    , buf_ring_size_(0)
+    , buffer_size_(0)
+    , num_buffers_(0)
+    , buf_group_(0)
+    , is_disabled_(false)
+    , num_syscalls_(0)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // Only the loop thread submits, which lets the kernel skip some of its own locking.
+    // The ring starts disabled, because the single issuer is whichever thread enables it, not the one constructing it.
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_R_DISABLED;
+    fd_ring_ = syscall(__NR_io_uring_setup, num_entries, &params);
+    is_disabled_ = (fd_ring_ >= 0);
+    if ((fd_ring_ < 0) && (EINVAL == errno)) {
+        // Kernels older than 6.0 do not know IORING_SETUP_SINGLE_ISSUER.
+        memset(&params, 0, sizeof(params));
+        fd_ring_ = syscall(__NR_io_uring_setup, num_entries, &params);
+    }
+    if (fd_ring_ < 0) {
+        log::PrintLnCurrentErrno(log::Error, "Failed io_uring_setup");
+        return;
+    }
+
+    if (!MapRings(params)) {
+        UnmapRings();
+        close(fd_ring_);
+        fd_ring_ = -1;
+    }
+}
+
+IoUringController::~IoUringController() {
+    UnmapRings();
+    if (fd_ring_ >= 0) {
+        close(fd_ring_);
+    }
+}
+
+bool IoUringController::MapRings(const io_uring_params& params) {
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool is_single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (is_single_mmap) {
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    }
+
+    sq_ring_ptr_ = mmap(0, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_ring_, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == sq_ring_ptr_) {
+        log::PrintLnCurrentErrno(log::Error, "%d|Failed to mmap io_uring SQ ring", fd_ring_);
+        return false;
+    }
+    if (is_single_mmap) {
+        cq_ring_ptr_ = sq_ring_ptr_;
+    }
+    else {
+        cq_ring_ptr_ = mmap(0, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_ring_, IORING_OFF_CQ_RING);
+        if (MAP_FAILED == cq_ring_ptr_) {
+            log::PrintLnCurrentErrno(log::Error, "%d|Failed to mmap io_uring CQ ring", fd_ring_);
+            return false;
+        }
+    }
+
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = (io_uring_sqe*)mmap(0, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_ring_, IORING_OFF_SQES);
+    if (MAP_FAILED == (void*)sqes_) {
+        log::PrintLnCurrentErrno(log::Error, "%d|Failed to mmap io_uring SQEs", fd_ring_);
+        return false;
+    }
+
+    char* const sq_ptr = (char*)sq_ring_ptr_;
+    sq_head_ = (unsigned*)(sq_ptr + params.sq_off.head);
+    sq_tail_ = (unsigned*)(sq_ptr + params.sq_off.tail);
+    sq_array_ = (unsigned*)(sq_ptr + params.sq_off.array);
+    sq_mask_ = *(unsigned*)(sq_ptr + params.sq_off.ring_mask);
+    sq_entries_ = *(unsigned*)(sq_ptr + params.sq_off.ring_entries);
+    sq_local_tail_ = *sq_tail_;
+
+    char* const cq_ptr = (char*)cq_ring_ptr_;
+    cq_head_ = (unsigned*)(cq_ptr + params.cq_off.head);
+    cq_tail_ = (unsigned*)(cq_ptr + params.cq_off.tail);
+    cq_mask_ = *(unsigned*)(cq_ptr + params.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe*)(cq_ptr + params.cq_off.cqes);
+
+    log::PrintLn(log::Info, "%d|io_uring: %u SQ entries, %u CQ entries, features=%08x", fd_ring_, params.sq_entries, params.cq_entries, params.features);
+    return true;
+}
+
+void IoUringController::UnmapRings() {
+    if (MAP_FAILED != (void*)buf_ring_) {
+        munmap(buf_ring_, buf_ring_size_);
+        buf_ring_ = (io_uring_buf_ring*)MAP_FAILED;
+    }
+    if (MAP_FAILED != (void*)sqes_) {
+        munmap(sqes_, sqes_size_);
+        sqes_ = (io_uring_sqe*)MAP_FAILED;
+    }
+    if ((MAP_FAILED != cq_ring_ptr_) && (cq_ring_ptr_ != sq_ring_ptr_)) {
+        munmap(cq_ring_ptr_, cq_ring_size_);
+    }
+    cq_ring_ptr_ = MAP_FAILED;
+    if (MAP_FAILED != sq_ring_ptr_) {
+        munmap(sq_ring_ptr_, sq_ring_size_);
+        sq_ring_ptr_ = MAP_FAILED;
+    }
+}
+
+bool IoUringController::IsValid() const {
+    return fd_ring_ >= 0;
+}
+
+bool IoUringController::EnableOnThisThread() {
+    if (!is_disabled_) return true;
+    ++num_syscalls_;
+    if (syscall(__NR_io_uring_register, fd_ring_, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0) {
+        log::PrintLnCurrentErrno(log::Error, "%d|Failed to enable io_uring", fd_ring_);
+        return false;
+    }
+    is_disabled_ = false;
+    return true;
+}
+
+int IoUringController::Enter(const unsigned num_to_submit, const unsigned min_completions) {
+    ++num_syscalls_;
+    const unsigned flags = (min_completions > 0) ? IORING_ENTER_GETEVENTS : 0;
+    const int e = syscall(__NR_io_uring_enter, fd_ring_, num_to_submit, min_completions, flags, NULL, 0);
+    return (e < 0) ? -errno : e;
+}
+
+io_uring_sqe* IoUringController::GetSqe() {
+    io_uring_sqe* sqe = nullptr;
+    return GetSqes(&sqe, 1) ? sqe : nullptr;
+}
+
+bool IoUringController::GetSqes(io_uring_sqe** const sqes, const unsigned num_sqes) {
+    if (num_sqes > sq_entries_) return false;
+    unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if ((sq_local_tail_ - head) > (sq_entries_ - num_sqes)) {
+        // Make room by handing what we have so far to the kernel.
+        SubmitAndWait(0);
+        head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if ((sq_local_tail_ - head) > (sq_entries_ - num_sqes)) {
+            return false;
+        }
+    }
+
+    for (unsigned i = 0; i < num_sqes; ++i) {
+        const unsigned index = sq_local_tail_ & sq_mask_;
+        sqes[i] = &sqes_[index];
+        memset(sqes[i], 0, sizeof(*sqes[i]));
+        sq_array_[index] = index;
+        ++sq_local_tail_;
+        ++num_unsubmitted_;
+    }
+    return true;
+}
+
+int IoUringController::SubmitAndWait(const unsigned min_completions) {
+    // Publish the new SQEs before telling the kernel about them.
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    const int e = Enter(num_unsubmitted_, min_completions);
+    if (e > 0) {
+        num_unsubmitted_ -= std::min(num_unsubmitted_, static_cast<unsigned>(e));
+    }
+    return e;
+}
+
+bool IoUringController::RegisterBufferRing(const uint16_t buf_group, const unsigned num_buffers, const unsigned buffer_size) {
+    buf_ring_size_ = num_buffers * sizeof(io_uring_buf);
+    buf_ring_ = (io_uring_buf_ring*)mmap(0, buf_ring_size_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (MAP_FAILED == (void*)buf_ring_) {
+        log::PrintLnCurrentErrno(log::Error, "%d|Failed to allocate provided-buffer ring", fd_ring_);
+        return false;
+    }
+
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)buf_ring_;
+    reg.ring_entries = num_buffers;
+    reg.bgid = buf_group;
+    ++num_syscalls_;
+    if (syscall(__NR_io_uring_register, fd_ring_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        log::PrintLnCurrentErrno(log::Error, "%d|Failed to register provided-buffer ring", fd_ring_);
+        munmap(buf_ring_, buf_ring_size_);
+        buf_ring_ = (io_uring_buf_ring*)MAP_FAILED;
+        return false;
+    }
+
+    buf_group_ = buf_group;
+    num_buffers_ = num_buffers;
+    buffer_size_ = buffer_size;
+    buffers_.resize(static_cast<size_t>(num_buffers) * buffer_size);
+    for (unsigned i = 0; i < num_buffers; ++i) {
+        ReturnBuffer(static_cast<uint16_t>(i));
+    }
+    return true;
+}
+
+char const* IoUringController::Buffer(const uint16_t buffer_id) const {
+    return &buffers_[static_cast<size_t>(buffer_id) * buffer_size_];
+}
+
+void IoUringController::ReturnBuffer(const uint16_t buffer_id) {
+    // ATTENTION: The ring is an array of io_uring_buf whose first entry's reserved field doubles as the tail.
+    // Index it directly rather than through io_uring_buf_ring::bufs, whose flexible-array emulation puts it at the wrong offset in C++.
+    io_uring_buf* const bufs = (io_uring_buf*)buf_ring_;
+    const uint16_t tail = buf_ring_->tail;
+    io_uring_buf& buf = bufs[tail & (num_buffers_ - 1)];
+    buf.addr = (uint64_t)Buffer(buffer_id);
+    buf.len = buffer_size_;
+    buf.bid = buffer_id;
+    __atomic_store_n(&buf_ring_->tail, static_cast<uint16_t>(tail + 1), __ATOMIC_RELEASE);
+}
+
+size_t IoUringController::NumSyscalls() const {
+    return num_syscalls_;
+}
@@ -0,0 +1,94 @@
+#pragma once
+#include <unistd.h>
+#include <stdint.h>
+#include <vector>
+#include <linux/io_uring.h>
+
+/*
+Thin wrapper around a raw io_uring instance (no liburing), playing the part EpollController plays for the epoll backend.
+GetSqe() hands out zeroed submission queue entries, SubmitAndWait(...) submits all of them with a single io_uring_enter
+and waits for completions, and ForEachCompletion(...) reaps the completion queue.
+
+Also owns one provided-buffer ring, from which the kernel picks a buffer for every IOSQE_BUFFER_SELECT recv,
+so that buffers are only tied up by data that has actually arrived.
+
+Single issuer: only the loop thread that owns the controller may call into it.
+*/
+class IoUringController {
+    int fd_ring_;
+
+    void* sq_ring_ptr_;
+    size_t sq_ring_size_;
+    void* cq_ring_ptr_;
+    size_t cq_ring_size_;
+    io_uring_sqe* sqes_;
+    size_t sqes_size_;
+
+    unsigned* sq_head_;
+    unsigned* sq_tail_;
+    unsigned* sq_array_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    unsigned sq_local_tail_;
+    unsigned num_unsubmitted_;
+
+    unsigned* cq_head_;
+    unsigned* cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe* cqes_;
+
+    io_uring_buf_ring* buf_ring_;
+    size_t buf_ring_size_;
+    std::vector<char> buffers_;
+    unsigned buffer_size_;
+    unsigned num_buffers_;
+    uint16_t buf_group_;
+
+    bool is_disabled_;
+    size_t num_syscalls_;
+
+    bool MapRings(const io_uring_params&);
+    void UnmapRings();
+    int Enter(const unsigned num_to_submit, const unsigned min_completions);
+
+public:
+    IoUringController(const unsigned num_entries);
+    ~IoUringController();
+
+    bool IsValid() const;
+
+    // Must be called by the loop thread before its first submission: it becomes the ring's only allowed submitter.
+    bool EnableOnThisThread();
+
+    // Returns a zeroed SQE, or nullptr if the submission queue is still full after submitting what is already in it.
+    io_uring_sqe* GetSqe();
+    // Fills sqes with num_sqes zeroed SQEs, e.g. for a linked chain, or returns false (handing out none) if there is 
+    // not room for all of them. Room is made before any is handed out, so that none is submitted before it has been filled in.
+    bool GetSqes(io_uring_sqe** const sqes, const unsigned num_sqes);
+
+    // Submits every SQE handed out since the last call, and waits until at least min_completions CQEs are available.
+    // Returns the number of SQEs submitted, or -errno.
+    int SubmitAndWait(const unsigned min_completions);
+
+    // CompletionHandler: Functor signature: (const io_uring_cqe&);
+    template<typename CompletionHandler>
+    size_t ForEachCompletion(CompletionHandler& completion_handler) {
+        unsigned head = *cq_head_;
+        const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        size_t n = 0;
+        for (; head != tail; ++head, ++n) {
+            completion_handler.HandleCompletion(cqes_[head & cq_mask_]);
+        }
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        return n;
+    }
+
+    // num_buffers must be a power of 2 no greater than 32768.
+    bool RegisterBufferRing(const uint16_t buf_group, const unsigned num_buffers, const unsigned buffer_size);
+    uint16_t BufferGroup() const { return buf_group_; }
+    char const* Buffer(const uint16_t buffer_id) const;
+    void ReturnBuffer(const uint16_t buffer_id);
+
+    // Number of io_uring_enter and io_uring_register calls made so far.
+    size_t NumSyscalls() const;
+};
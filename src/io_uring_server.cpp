@@ -0,0 +1,680 @@
+#include "io_uring_server.h"
+#include "logging.h"
+#include "server_loops.h"
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+const unsigned NumRingEntries = 4096;
+const uint16_t RecvBufferGroup = 0;
+const unsigned NumRecvBuffers = 64;
+
+enum IoUringOp {
+    IoUringOp_Accept = 1,
+    IoUringOp_Recv,
+    IoUringOp_Send,
+    IoUringOp_Wakeup,
+    IoUringOp_Cancel,
+    IoUringOp_Close,
+};
+
+// user_data layout: | op (8 bits) | generation (24 bits) | fd (32 bits) |
+uint64_t MakeUserData(const IoUringOp op, const uint32_t generation, const int fd) {
+    return (static_cast<uint64_t>(op) << 56) | (static_cast<uint64_t>(generation & 0xFFFFFF) << 32) | static_cast<uint32_t>(fd);
+}
+
+IoUringOp UserDataToOp(const uint64_t user_data) {
+    return static_cast<IoUringOp>(user_data >> 56);
+}
+
+uint32_t UserDataToGeneration(const uint64_t user_data) {
+    return (user_data >> 32) & 0xFFFFFF;
+}
+
+int UserDataToFd(const uint64_t user_data) {
+    return static_cast<int>(user_data & 0xFFFFFFFF);
+}
+
+IoUringServer::IoUringServer(const int fd_listening, const EpollServerConfig& config, WorkerPool* const worker_pool, TopicBus& topic_bus)
+    : ring_(NumRingEntries)
+    , fd_listening_(fd_listening)
+    , offloader_(worker_pool, command_queue_)
+    , wakeup_counter_(0)
+    , config_(config)
+    , sessions_(config_)
+    , stats_("io_uring")
+    , topic_bus_(topic_bus)
+{
+    topic_bus_.Join(command_queue_);
+}
+
+IoUringServer::~IoUringServer() {
+    CloseListeningAndSessionSockets();
+}
+
+void IoUringServer::Run() {
+    if (!ring_.IsValid() || !command_queue_.IsValid() || !ring_.EnableOnThisThread()) {
+        log::PrintLn(log::Error, "io_uring backend unavailable");
+        return;
+    }
+    if (!ring_.RegisterBufferRing(RecvBufferGroup, NumRecvBuffers, config_.read_budget)) {
+        return;
+    }
+    if (!(ArmAccept() && ArmWakeup())) {
+        return;
+    }
+
+    log::PrintLn(log::Info, "Entering io_uring loop");
+    while (1) {
+        const size_t num_syscalls_before = ring_.NumSyscalls();
+        // One io_uring_enter submits every accept/recv/send/close queued since the last iteration, and waits for completions.
+        const int e = ring_.SubmitAndWait(1);
+        if ((e < 0) && (-EINTR != e) && (-EBUSY != e) && (-EAGAIN != e)) {
+            log::PrintLnErrno(log::Error, -e, "Exit io_uring loop");
+            break;
+        }
+        ring_.ForEachCompletion(*this);
+        FlushDirtySessions();
+        stats_.OnSyscalls(ring_.NumSyscalls() - num_syscalls_before);
+    }
+    log::PrintLn(log::Info, "Exit io_uring loop");
+    stats_.Report();
+    CloseListeningAndSessionSockets();
+}
+
+IoUringServer::SessionState& IoUringServer::State(const int fd) {
+    if (static_cast<size_t>(fd) >= session_states_.size()) {
+        session_states_.resize(fd + 1, SessionState{ 0, false, false, false, msghdr(), {}, BroadcastGather{ 0, 0, 0 }, false, false, false });
+    }
+    return session_states_[fd];
+}
+
+bool IoUringServer::ArmAccept() {
+    io_uring_sqe* const sqe = ring_.GetSqe();
+    if (!sqe) {
+        log::PrintLn(log::Error, "%d|No SQE for accept", fd_listening_);
+        return false;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd_listening_;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = MakeUserData(IoUringOp_Accept, 0, fd_listening_);
+    return true;
+}
+
+bool IoUringServer::ArmRecv(const int fd) {
+    io_uring_sqe* const sqe = ring_.GetSqe();
+    if (!sqe) {
+        log::PrintLn(log::Error, "%d|No SQE for recv", fd);
+        return false;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ring_.BufferGroup();
+    sqe->user_data = MakeUserData(IoUringOp_Recv, State(fd).generation, fd);
+    State(fd).is_recv_armed = true;
+    return true;
+}
+
+bool IoUringServer::ArmWakeup() {
+    io_uring_sqe* const sqe = ring_.GetSqe();
+    if (!sqe) {
+        log::PrintLn(log::Error, "%d|No SQE for wakeup", command_queue_.WakeupFd());
+        return false;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = command_queue_.WakeupFd();
+    sqe->addr = (uint64_t)&wakeup_counter_;
+    sqe->len = sizeof(wakeup_counter_);
+    sqe->user_data = MakeUserData(IoUringOp_Wakeup, 0, command_queue_.WakeupFd());
+    return true;
+}
+
+// Sends the first iovcnt iovecs of state.send_iov. A short send is fine: the rest is gathered again by the next flush.
+// is_last_send: the session has nothing else to send, and the close is linked to this send. It then has to send everything
+// (MSG_WAITALL), as anything less breaks the link and cancels the close.
+// Without room for the close, the send goes on its own, and the next flush closes the session once it has completed.
+bool IoUringServer::SubmitSend(const int fd, SessionState& state, const size_t iovcnt, const bool is_last_send) {
+    // Both SQEs are reserved before either is filled in: reserving one may submit those already handed out.
+    io_uring_sqe* sqes[2] = { nullptr, nullptr };
+    if (!(is_last_send && ring_.GetSqes(sqes, 2))) {
+        sqes[0] = ring_.GetSqe();
+    }
+    io_uring_sqe* const sqe = sqes[0];
+    if (!sqe) {
+        // Retried on the next flush.
+        MarkDirty(fd);
+        return false;
+    }
+    state.send_msg = msghdr();
+    state.send_msg.msg_iov = &state.send_iov[0];
+    state.send_msg.msg_iovlen = iovcnt;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)&state.send_msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = MakeUserData(IoUringOp_Send, state.generation, fd);
+    state.is_send_in_flight = true;
+
+    io_uring_sqe* const close_sqe = sqes[1];
+    if (close_sqe) {
+        sqe->msg_flags |= MSG_WAITALL;
+        sqe->flags = IOSQE_IO_LINK;
+        close_sqe->opcode = IORING_OP_CLOSE;
+        close_sqe->fd = fd;
+        close_sqe->user_data = MakeUserData(IoUringOp_Close, state.generation, fd);
+        state.is_close_linked = true;
+    }
+    return true;
+}
+
+bool IoUringServer::SubmitCancel(const uint64_t user_data) {
+    io_uring_sqe* const sqe = ring_.GetSqe();
+    if (!sqe) {
+        log::PrintLn(log::Error, "%d|No SQE for cancel", UserDataToFd(user_data));
+        return false;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = user_data;
+    sqe->user_data = MakeUserData(IoUringOp_Cancel, UserDataToGeneration(user_data), UserDataToFd(user_data));
+    return true;
+}
+
+void IoUringServer::HandleCompletion(const io_uring_cqe& cqe) {
+    const IoUringOp op = UserDataToOp(cqe.user_data);
+    const int fd = UserDataToFd(cqe.user_data);
+    // A closing session still gets the completion of its in-flight send, which it waits for to close (see OnHangUp).
+    const bool is_current_generation = (IoUringOp_Accept == op) || (IoUringOp_Wakeup == op)
+        || ((UserDataToGeneration(cqe.user_data) == (State(fd).generation & 0xFFFFFF)) && ((!State(fd).is_closing) || (IoUringOp_Send == op)));
+
+    log::PrintLn(log::Debug, "%d|C|op=%d res=%d flags=%08x current=%d", fd, op, cqe.res, cqe.flags, is_current_generation);
+
+    if (!is_current_generation) {
+        // Left over from a connection that has since been closed. Its buffer still has to go back to the ring.
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            ring_.ReturnBuffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        return;
+    }
+
+    switch (op) {
+    case IoUringOp_Accept:
+        if (cqe.res >= 0) {
+            OnAccepted(cqe.res);
+        }
+        else {
+            log::PrintLnErrno(log::Error, -cqe.res, "Failed accept");
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            ArmAccept();
+        }
+        break;
+    case IoUringOp_Recv:
+        OnRecv(fd, cqe);
+        break;
+    case IoUringOp_Send:
+        OnSend(fd, cqe);
+        break;
+    case IoUringOp_Wakeup:
+        OnWakeup(cqe);
+        break;
+    case IoUringOp_Cancel:
+    case IoUringOp_Close:
+        break;
+    }
+}
+
+void IoUringServer::OnAccepted(const int fd_accepted) {
+    log::PrintLn(log::Debug, "%d|Accepted", fd_accepted);
+    // The multishot accept already drains the backlog without a syscall per connection, so each completion is its own batch.
+    stats_.OnAccepts(1, false);
+    SessionState& state = State(fd_accepted);
+    state.is_closing = false;
+    state.is_dirty = false;
+    state.is_recv_armed = false;
+    state.send_gather = BroadcastGather{ 0, 0, 0 };
+    state.is_send_in_flight = false;
+    state.is_close_linked = false;
+    state.is_drop_pending = false;
+    Session* session_ptr = nullptr;
+    sessions_.Add(fd_accepted, session_ptr);
+    session_ptr->broadcast_cursor = broadcast_logs_.Join(session_ptr->ack_maker_and_serialiser.wire_version);
+    if (offloader_.IsEnabled()) {
+        session_ptr->ack_maker_and_serialiser.EnableOffload(&offloader_, MakeSessionTag(fd_accepted, session_ptr->generation), config_.offloaded_msg_types);
+    }
+    session_ptr->ack_maker_and_serialiser.EnableTopics(&topic_index_, &topic_bus_, fd_accepted);
+    // No Ack delay: there are no session timers on this backend, so a cumulative Ack goes out with each completed recv.
+    session_ptr->ack_maker_and_serialiser.SetCumulativeAcks(config_.max_msgs_per_ack, false);
+    ArmRecv(fd_accepted);
+}
+
+void IoUringServer::OnRecv(const int fd, const io_uring_cqe& cqe) {
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        State(fd).is_recv_armed = false;
+    }
+    if ((cqe.res > 0) && (cqe.flags & IORING_CQE_F_BUFFER)) {
+        Session* session_ptr = nullptr;
+        sessions_.Add(fd, session_ptr);
+
+        const uint16_t buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        session_ptr->deserialiser.AppendStream(ring_.Buffer(buffer_id), cqe.res);
+        ring_.ReturnBuffer(buffer_id);
+
+        if (!DeserialiseFrames(fd, *session_ptr)) return;
+        MarkDirty(fd);
+        UpdateReadPause(*session_ptr);
+
+        if (!(State(fd).is_recv_armed || session_ptr->is_read_paused)) {
+            ArmRecv(fd);
+        }
+    }
+    else if ((-ENOBUFS == cqe.res) || (-ECANCELED == cqe.res)) {
+        // ENOBUFS: every provided buffer was in use. They have all been returned by now, so just re-arm.
+        // ECANCELED: cancelled by UpdateReadPause, which re-arms it on resuming, unless it already has.
+        Session* const session_ptr = sessions_.Find(fd);
+        if (session_ptr && !(State(fd).is_recv_armed || session_ptr->is_read_paused)) {
+            ArmRecv(fd);
+        }
+    }
+    else {
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            ring_.ReturnBuffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        }
+        if (0 == cqe.res) {
+            // The peer has shut down its side, after everything it sent: it still gets what it is owed, then the close (see FlushDirtySessions).
+            Session* session_ptr = nullptr;
+            sessions_.Add(fd, session_ptr);
+            session_ptr->is_peer_shut_down = true;
+            MarkDirty(fd);
+        }
+        else {
+            // An error, which we treat as a disconnection.
+            OnHangUp(fd);
+        }
+    }
+}
+
+// Returns false if the session has been disconnected.
+bool IoUringServer::DeserialiseFrames(const int fd, Session& session) {
+    // The deserialiser stops right after a Hello that changes the wire version, and takes the rest once it has been answered.
+    // Answering moves the session to another broadcast log, so it waits until no send points into the old one.
+    if (WireVersion_Unknown == session.ack_maker_and_serialiser.hello_wire_version) {
+        stats_.OnFrames(session.deserialiser.Deserialise(session.ack_maker_and_serialiser));
+    }
+    while ((WireVersion_Unknown != session.ack_maker_and_serialiser.hello_wire_version) && !State(fd).is_send_in_flight) {
+        AnswerHello(session, broadcast_logs_);
+        stats_.OnFrames(session.deserialiser.Deserialise(session.ack_maker_and_serialiser));
+    }
+    if (session.deserialiser.HasRejectedFrame()) {
+        log::PrintLn(log::Error, "%d|Got a %zu byte frame, above the maximum frame size of %zu bytes. Disconnecting", fd, session.deserialiser.RejectedFrameSize(), config_.max_frame_size);
+        stats_.OnFrameRejected();
+        OnHangUp(fd);
+        return false;
+    }
+    return true;
+}
+
+void IoUringServer::OnSend(const int fd, const io_uring_cqe& cqe) {
+    SessionState& state = State(fd);
+    state.is_send_in_flight = false;
+    if (state.is_close_linked) {
+        state.is_close_linked = false;
+        if (static_cast<size_t>(cqe.res) == state.send_gather.num_bytes) {
+            // Everything went out, and the linked close has run (or is about to).
+            ReleaseSession(fd);
+        }
+        else {
+            // The link broke, and the close was cancelled.
+            CloseSession(fd);
+        }
+        return;
+    }
+    if (state.is_closing || ((cqe.res < 0) && (-ECANCELED != cqe.res))) {
+        CloseSession(fd);
+        return;
+    }
+
+    Session* session_ptr = nullptr;
+    sessions_.Add(fd, session_ptr);
+    if (cqe.res > 0) {
+        ConsumeWithBroadcasts(session_ptr->serialiser, BroadcastLogOf(broadcast_logs_, *session_ptr), session_ptr->broadcast_cursor, state.send_gather, cqe.res);
+    }
+    if (state.is_drop_pending) {
+        state.is_drop_pending = false;
+        DropBroadcasts(*session_ptr);
+    }
+    // A Hello that came in while the send was in flight.
+    if (!DeserialiseFrames(fd, *session_ptr)) return;
+    UpdateReadPause(*session_ptr);
+    // The rest of a short send, and whatever was serialised while the send was in flight.
+    MarkDirty(fd);
+}
+
+void IoUringServer::OnWakeup(const io_uring_cqe& /*cqe*/) {
+    // The read that completed has already consumed the eventfd counter.
+    command_queue_.Drain(*this);
+    ArmWakeup();
+}
+
+void IoUringServer::HandleLoopCommand(LoopCommand& command) {
+    switch (command.type) {
+    case LoopCommand_Broadcast:
+        AppendFrameToAllSessions(std::move(command.frame));
+        break;
+    case LoopCommand_ConflatedBroadcast:
+        ConflateFrameToAllSessions(std::move(command.frame), command.conflation_key);
+        break;
+    case LoopCommand_OffloadedFrame:
+        OnOffloadedFrame(command);
+        break;
+    case LoopCommand_Publish:
+        PublishFrameToSubscribers(std::move(command.frame));
+        break;
+    }
+}
+
+// Appends the frame to the broadcast log, for every session to stage from its own cursor.
+void IoUringServer::AppendFrameToAllSessions(std::vector<char>&& frame) {
+    struct MarkSessionDirty {
+        IoUringServer& server;
+        size_t max_lag;
+        MarkSessionDirty(IoUringServer& server) : server(server), max_lag(0) {}
+
+        bool HandleFdAndSessionPtr(const int /*fd*/, Session* const session_ptr) {
+            if ((!session_ptr) || (-1 == session_ptr->fd)) return true;
+            if (!server.ApplySlowConsumerPolicy(*session_ptr)) return true;
+            max_lag = std::max(max_lag, BroadcastLogOf(server.broadcast_logs_, *session_ptr).Lag(session_ptr->broadcast_cursor));
+            server.UpdateReadPause(*session_ptr);
+            server.MarkDirty(session_ptr->fd);
+            return true;
+        }
+    };
+    broadcast_logs_.Append(std::move(frame));
+    MarkSessionDirty mark_session_dirty(*this);
+    sessions_.ForEachDo(mark_session_dirty);
+    stats_.OnBroadcast(broadcast_logs_.NumBytesHeld(), mark_session_dirty.max_lag);
+}
+
+// Queues the frame on every session's conflating queue (shared, not copied), to be staged by the next flush.
+void IoUringServer::ConflateFrameToAllSessions(std::vector<char>&& frame, const uint64_t conflation_key) {
+    struct ConflateFrame {
+        IoUringServer& server;
+        SharedFrames& frames;
+        const uint64_t conflation_key;
+        size_t num_queued;
+        size_t num_replaced;
+        ConflateFrame(IoUringServer& server, SharedFrames& frames, const uint64_t conflation_key)
+            : server(server), frames(frames), conflation_key(conflation_key), num_queued(0), num_replaced(0) {}
+
+        bool HandleFdAndSessionPtr(const int /*fd*/, Session* const session_ptr) {
+            if ((!session_ptr) || (-1 == session_ptr->fd)) return true;
+            ++num_queued;
+            if (session_ptr->conflating_queue.Push(conflation_key, frames.In(session_ptr->ack_maker_and_serialiser.wire_version))) {
+                ++num_replaced;
+            }
+            if (!server.ApplySlowConsumerPolicy(*session_ptr)) return true;
+            server.UpdateReadPause(*session_ptr);
+            server.MarkDirty(session_ptr->fd);
+            return true;
+        }
+    };
+    if (frame.empty()) return;
+    SharedFrames shared_frames(std::move(frame));
+    ConflateFrame conflate_frame(*this, shared_frames, conflation_key);
+    sessions_.ForEachDo(conflate_frame);
+    stats_.OnConflatableFrames(conflate_frame.num_queued, conflate_frame.num_replaced);
+}
+
+// Appends the frame to the sessions subscribed to its topic, to be staged by the next flush.
+// No other session is looked at. Each subscriber gets its own copy, in its wire version.
+void IoUringServer::PublishFrameToSubscribers(std::vector<char>&& frame) {
+    const std::vector<int>* const subscriber_fds = topic_index_.SubscribersOf(TopicOfV1PublishFrame(frame));
+    if (!subscriber_fds) {
+        stats_.OnPublish(0, topic_index_.NumTopics());
+        return;
+    }
+    const size_t num_subscribers = subscriber_fds->size();
+    SharedFrames shared_frames(std::move(frame));
+    // Backwards, because disconnecting a slow consumer moves the last subscriber into its place.
+    for (size_t i = subscriber_fds->size(); i-- > 0;) {
+        if (i >= subscriber_fds->size()) continue;
+        Session* const session_ptr = sessions_.Find((*subscriber_fds)[i]);
+        if ((!session_ptr) || (-1 == session_ptr->fd)) continue;
+        if (!ApplySlowConsumerPolicy(*session_ptr)) continue;
+        const std::vector<char>& session_frame = *shared_frames.In(session_ptr->ack_maker_and_serialiser.wire_version);
+        session_ptr->serialiser.AppendFrame(&session_frame[0], session_frame.size());
+        UpdateReadPause(*session_ptr);
+        MarkDirty(session_ptr->fd);
+    }
+    stats_.OnPublish(num_subscribers, topic_index_.NumTopics());
+}
+
+// The response to a frame handled by a worker. It is staged once every earlier response of its session has been.
+void IoUringServer::OnOffloadedFrame(LoopCommand& command) {
+    stats_.OnOffloadedFrame();
+    Session* const session_ptr = sessions_.FindByTag(command.session_tag);
+    if (!session_ptr) {
+        offloader_.OnStaleResponse(command);
+        return;
+    }
+    if (0 == offloader_.OnResponse(command, session_ptr->ack_maker_and_serialiser.offload_order, session_ptr->serialiser)) return;
+    UpdateReadPause(*session_ptr);
+    MarkDirty(session_ptr->fd);
+}
+
+// Stops reading from a session at its high watermark, by cancelling its multishot recv, and resumes once it is down 
+// to its low watermark. The bytes of the in-flight send are counted: they are only consumed once it completes.
+void IoUringServer::UpdateReadPause(Session& session) {
+    if (!config_.high_watermark) return;
+    SessionState& state = State(session.fd);
+    if (state.is_closing) return;
+    const size_t num_bytes_to_send = NumBytesToSend(session, BroadcastLogOf(broadcast_logs_, session));
+    if ((!session.is_read_paused) && (num_bytes_to_send >= config_.high_watermark)) {
+        log::PrintLn(log::Debug, "%d|Pausing reads: %zu bytes to send", session.fd, num_bytes_to_send);
+        session.is_read_paused = true;
+        stats_.OnReadPaused();
+        // What it had already received still completes, and is handled as usual.
+        if (state.is_recv_armed) {
+            SubmitCancel(MakeUserData(IoUringOp_Recv, state.generation, session.fd));
+        }
+    }
+    else if (session.is_read_paused && (num_bytes_to_send <= config_.low_watermark)) {
+        log::PrintLn(log::Debug, "%d|Resuming reads: %zu bytes to send", session.fd, num_bytes_to_send);
+        session.is_read_paused = false;
+        // Otherwise its cancellation has yet to complete, and re-arms it (see OnRecv).
+        if (!state.is_recv_armed) {
+            ArmRecv(session.fd);
+        }
+    }
+}
+
+// Returns false if the session has been disconnected.
+bool IoUringServer::ApplySlowConsumerPolicy(Session& session) {
+    SessionState& state = State(session.fd);
+    if (state.is_closing) return false;
+    if (!config_.slow_consumer_limit) return true;
+    // The in-flight send's bytes are still counted: they are only consumed once it completes.
+    const size_t num_bytes_to_send = NumBytesToSend(session, BroadcastLogOf(broadcast_logs_, session));
+    if (num_bytes_to_send <= config_.slow_consumer_limit) return true;
+
+    switch (config_.slow_consumer_policy) {
+    case SlowConsumer_None:
+        break;
+    case SlowConsumer_Disconnect:
+        log::PrintLn(log::Info, "%d|Disconnecting slow consumer: %zu bytes to send", session.fd, num_bytes_to_send);
+        stats_.OnSlowConsumerDisconnected();
+        OnHangUp(session.fd);
+        return false;
+    case SlowConsumer_DropBroadcasts:
+        if (!state.is_send_in_flight) {
+            DropBroadcasts(session);
+        }
+        else if (!state.is_drop_pending) {
+            // The in-flight send points into the broadcasts, which are only dropped once it has completed.
+            // A slow consumer's send is typically waiting for room in the socket buffer: cancelling it ends the wait.
+            state.is_drop_pending = true;
+            SubmitCancel(MakeUserData(IoUringOp_Send, state.generation, session.fd));
+        }
+        break;
+    }
+    return true;
+}
+
+void IoUringServer::DropBroadcasts(Session& session) {
+    const size_t num_bytes_dropped = SkipBroadcasts(session.serialiser, BroadcastLogOf(broadcast_logs_, session), session.broadcast_cursor);
+    log::PrintLn(log::Debug, "%d|Dropped %zu broadcast bytes for slow consumer", session.fd, num_bytes_dropped);
+    stats_.OnBroadcastsDropped(num_bytes_dropped);
+}
+
+void IoUringServer::OnHangUp(const int fd) {
+    SessionState& state = State(fd);
+    if (state.is_closing) return;
+    log::PrintLn(log::Debug, "%d|Peer hung up", fd);
+    state.is_closing = true;
+    if (state.is_send_in_flight) {
+        // The send points into the session's serialiser and broadcasts, so they are kept, and the fd open, until it completes (see OnSend).
+        // A linked send is cancelled all the same: the close it is linked to is then cancelled too.
+        SubmitCancel(MakeUserData(IoUringOp_Send, state.generation, fd));
+        return;
+    }
+    CloseSession(fd);
+}
+
+// Closes the fd of a session that has no send in flight, and releases the session.
+void IoUringServer::CloseSession(const int fd) {
+    SessionState& state = State(fd);
+
+    // Cancel the multishot recv and any in-flight send before closing, otherwise they keep the socket alive.
+    // The hard link makes the close wait for the cancel, whatever the cancel's outcome.
+    // Until the close completes, the fd cannot be handed out again by accept.
+    // Both SQEs are reserved before either is filled in: reserving one may submit those already handed out.
+    io_uring_sqe* sqes[2] = { nullptr, nullptr };
+    if (ring_.GetSqes(sqes, 2)) {
+        io_uring_sqe* const cancel_sqe = sqes[0];
+        io_uring_sqe* const close_sqe = sqes[1];
+        cancel_sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        cancel_sqe->fd = fd;
+        cancel_sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        cancel_sqe->flags = IOSQE_IO_HARDLINK;
+        cancel_sqe->user_data = MakeUserData(IoUringOp_Cancel, state.generation, fd);
+
+        close_sqe->opcode = IORING_OP_CLOSE;
+        close_sqe->fd = fd;
+        close_sqe->user_data = MakeUserData(IoUringOp_Close, state.generation, fd);
+    }
+    else {
+        // Shutting down makes the outstanding recv complete, which is all that cancelling would have achieved.
+        shutdown(fd, SHUT_RDWR);
+        if (close(fd) < 0) {
+            log::PrintLnCurrentErrno(log::Error, "%d|Failed to close peer", fd);
+        }
+    }
+    ReleaseSession(fd);
+}
+
+// For a session whose fd is closed, or about to be by an operation already submitted.
+void IoUringServer::ReleaseSession(const int fd) {
+    SessionState& state = State(fd);
+    ++state.generation;
+    state.is_closing = true;
+    topic_index_.UnsubscribeAll(fd);
+    Session* const session_ptr = sessions_.Find(fd);
+    if (session_ptr && session_ptr->IsValid()) {
+        broadcast_logs_.Leave(session_ptr->ack_maker_and_serialiser.wire_version, session_ptr->broadcast_cursor);
+    }
+    sessions_.Remove(fd);
+}
+
+void IoUringServer::MarkDirty(const int fd) {
+    SessionState& state = State(fd);
+    if (!state.is_dirty) {
+        state.is_dirty = true;
+        dirty_fds_.push_back(fd);
+    }
+}
+
+// Submits a send for every session that has serialised something since its last send completed,
+// and closes the sessions whose peer has shut down once they have nothing left to send.
+void IoUringServer::FlushDirtySessions() {
+    std::vector<int> dirty_fds;
+    dirty_fds.swap(dirty_fds_);
+    for (const int fd : dirty_fds) {
+        SessionState& state = State(fd);
+        state.is_dirty = false;
+        if (state.is_closing || state.is_send_in_flight) continue;
+
+        Session* session_ptr = nullptr;
+        sessions_.Add(fd, session_ptr);
+        const BroadcastLog& broadcast_log = BroadcastLogOf(broadcast_logs_, *session_ptr);
+        if (HasSentAll(*session_ptr, broadcast_log)) {
+            if (session_ptr->is_peer_shut_down) {
+                OnHangUp(fd);
+            }
+            continue;
+        }
+        // Keyed broadcasts stay conflatable until there is nothing else of the session's own to send.
+        if (session_ptr->serialiser.HasSerialisedAll()) {
+            session_ptr->conflating_queue.MoveTo(session_ptr->serialiser, config_.write_budget);
+        }
+
+        if (state.send_iov.empty()) {
+            state.send_iov.resize(IOV_MAX);
+        }
+        const size_t iovcnt = GatherWithBroadcasts(session_ptr->serialiser, broadcast_log, session_ptr->broadcast_cursor, &state.send_iov[0], state.send_iov.size(), config_.write_budget, state.send_gather);
+        if (0 == iovcnt) continue;
+        const bool is_last_send = session_ptr->is_peer_shut_down && session_ptr->conflating_queue.Empty()
+            && (state.send_gather.num_bytes == (session_ptr->serialiser.NumBytesPending() + broadcast_log.Lag(session_ptr->broadcast_cursor)));
+        SubmitSend(fd, state, iovcnt, is_last_send);
+    }
+    dirty_fds.clear();
+    if (dirty_fds_.empty()) {
+        // Hand the (empty) vector back to keep its capacity.
+        dirty_fds_.swap(dirty_fds);
+    }
+}
+
+void IoUringServer::AppendAndSerialiseFrameToAllSessions(char const* const frame_ptr, const size_t n) {
+    command_queue_.PostBroadcast(frame_ptr, n);
+}
+
+void IoUringServer::AppendAndSerialiseFrameToAllSessions(char const* const frame_ptr, const size_t n, const uint64_t conflation_key) {
+    command_queue_.PostConflatedBroadcast(frame_ptr, n, conflation_key);
+}
+
+void IoUringServer::CloseListeningAndSessionSockets() {
+    if (fd_listening_ >= 0) {
+        log::PrintLn(log::Info, "%d|Closing listening ...", fd_listening_);
+        close(fd_listening_);
+        fd_listening_ = -1;
+    }
+
+    struct CloseSocket {
+        size_t n_closed;
+        CloseSocket() : n_closed(0) {}
+
+        bool HandleFdAndSessionPtr(const int /*fd*/, Session* const session_ptr) {
+            if ((!session_ptr) || (-1 == session_ptr->fd)) return true;
+            if (close(session_ptr->fd) < 0) {
+                log::PrintLnCurrentErrno(log::Error, "%d|Failed to close accepted", session_ptr->fd);
+            }
+            else {
+                ++n_closed;
+            }
+            return true;
+        }
+    };
+    CloseSocket close_socket;
+    sessions_.ForEachDo(close_socket);
+    log::PrintLn(log::Info, "Closed %zu/%zu accepted fds.", close_socket.n_closed, sessions_.Size());
+    sessions_.Clear();
+}
+
+void RunIoUringServer(const EpollServerConfig& config) {
+    RunServerLoops<IoUringServer>(config);
+}
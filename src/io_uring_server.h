@@ -0,0 +1,109 @@
+#pragma once
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <vector>
+#include "config.h"
+#include "session.h"
+#include "io_uring_controller.h"
+#include "loop_stats.h"
+#include "loop_command_queue.h"
+#include "broadcast_log.h"
+#include "frame_offloader.h"
+#include "worker_pool.h"
+#include "topic_index.h"
+
+/*
+io_uring counterpart of EpollServer, sharing its Sessions, deserialiser and frame handlers.
+
+Instead of waiting for readiness and then reading/writing, every operation is submitted up front:
+- one multishot accept on the listening socket yields every new connection,
+- one multishot recv per session, reading into buffers the kernel picks from the controller's provided-buffer ring.
+  It is cancelled while the session is at its high watermark, and armed again once it is down to its low watermark,
+- one sendmsg per session at a time, gathering what its serialiser and the broadcast log have pending for it in place (nothing is copied):
+  the bytes are only consumed once the send completes. Once the peer has shut down its side, the last send is linked to the close.
+Each loop iteration is then a single io_uring_enter that submits the new operations and waits for completions.
+*/
+class IoUringServer {
+    // Per-fd state that only the io_uring backend needs.
+    struct SessionState {
+        // Bumped whenever the fd is closed, so that completions of operations on an earlier connection with the same fd are ignored.
+        uint32_t generation;
+        bool is_closing;
+        bool is_dirty;
+        // The multishot recv is armed: it has not yet completed without IORING_CQE_F_MORE.
+        bool is_recv_armed;
+        // The in-flight sendmsg. The kernel reads send_msg and send_iov when the send is submitted (IORING_FEAT_SUBMIT_STABLE),
+        // and the bytes they point to (in the serialiser and the broadcast log) until it completes.
+        msghdr send_msg;
+        std::vector<iovec> send_iov;
+        BroadcastGather send_gather;
+        bool is_send_in_flight;
+        // The in-flight send is the session's last, and the close is linked to it.
+        bool is_close_linked;
+        // The slow-consumer policy dropped broadcasts while a send was in flight, which is cancelled to drop them once it completes.
+        bool is_drop_pending;
+    };
+
+    IoUringController ring_;
+    int fd_listening_;
+    // Everything other threads want done by this loop, e.g. broadcasts from the console thread.
+    LoopCommandQueue command_queue_;
+    // Hands frames of the offloaded types to the worker pool, whose responses come back through command_queue_.
+    FrameOffloader offloader_;
+    uint64_t wakeup_counter_;
+    const EpollServerConfig config_;
+    Sessions sessions_;
+    std::vector<SessionState> session_states_;
+    std::vector<int> dirty_fds_;
+    LoopStats stats_;
+    // Broadcast frames, stored once per wire version and staged into each session's send through its broadcast_cursor.
+    BroadcastLogs broadcast_logs_;
+    // Which of this loop's sessions are subscribed to which topics, and the way publishes reach every loop.
+    TopicIndex topic_index_;
+    TopicBus& topic_bus_;
+
+    SessionState& State(const int fd);
+    bool ArmAccept();
+    bool ArmRecv(const int fd);
+    bool ArmWakeup();
+    bool SubmitSend(const int fd, SessionState&, const size_t iovcnt, const bool is_last_send);
+    bool SubmitCancel(const uint64_t user_data);
+    bool DeserialiseFrames(const int fd, Session&);
+    void OnAccepted(const int fd_accepted);
+    void OnRecv(const int fd, const io_uring_cqe&);
+    void OnSend(const int fd, const io_uring_cqe&);
+    void OnWakeup(const io_uring_cqe&);
+    void AppendFrameToAllSessions(std::vector<char>&& frame);
+    void ConflateFrameToAllSessions(std::vector<char>&& frame, const uint64_t conflation_key);
+    void PublishFrameToSubscribers(std::vector<char>&& frame);
+    void OnOffloadedFrame(LoopCommand&);
+    void OnHangUp(const int fd);
+    void CloseSession(const int fd);
+    void ReleaseSession(const int fd);
+    void UpdateReadPause(Session&);
+    bool ApplySlowConsumerPolicy(Session&);
+    void DropBroadcasts(Session&);
+    void MarkDirty(const int fd);
+    void FlushDirtySessions();
+    void CloseListeningAndSessionSockets();
+
+public:
+    // worker_pool: shared by all loops, or nullptr to handle every frame on the loop.
+    // topic_bus: shared by all loops, which join it here.
+    IoUringServer(const int fd_listening, const EpollServerConfig&, WorkerPool* const worker_pool, TopicBus& topic_bus);
+    ~IoUringServer();
+
+    // Thread-safe: hands the frame to the loop thread, which appends it to every session.
+    void AppendAndSerialiseFrameToAllSessions(char const* const frame_ptr, const size_t n);
+    // Thread-safe: as above, except that a session that still has an unsent frame with the same conflation_key 
+    // gets this frame in its place, instead of both.
+    void AppendAndSerialiseFrameToAllSessions(char const* const frame_ptr, const size_t n, const uint64_t conflation_key);
+    void HandleCompletion(const io_uring_cqe&);
+    void HandleLoopCommand(LoopCommand&);
+
+    void Run();
+};
+
+void RunIoUringServer(const EpollServerConfig&);
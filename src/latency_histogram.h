@@ -0,0 +1,106 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include "logging.h"
+
+/*
+Latencies (in ns), counted HDR-histogram style: buckets get wider as values grow, so that each bucket is within
+1/SubBucketHalfCount (about 3%) of the values it counts, from 0 up to MaxValue, in NumBuckets fixed counters (9 KB).
+Values of MaxValue or more are counted in the last bucket; the max is exact all the same.
+
+Lock-free: Record(...) is a few relaxed atomic adds (plus a compare-exchange while the max grows), so any number of
+threads may record into the same histogram (e.g. Global()) while another reads its percentiles. A reader may see
+a record that is under way counted in some fields and not yet in others, which percentiles can live with.
+*/
+class LatencyHistogram {
+public:
+    // Values below SubBucketCount get a bucket each. Above, each power of two is split into SubBucketHalfCount buckets.
+    static const unsigned SubBucketBits = 6;
+    static const uint64_t SubBucketCount = uint64_t(1) << SubBucketBits;
+    static const uint64_t SubBucketHalfCount = SubBucketCount / 2;
+    // 2^40 ns is over 18 minutes.
+    static const unsigned MaxValueBits = 40;
+    static const uint64_t MaxValue = uint64_t(1) << MaxValueBits;
+    static const size_t NumBuckets = SubBucketCount + (MaxValueBits - SubBucketBits) * SubBucketHalfCount;
+
+private:
+    std::atomic<uint64_t> counts_[NumBuckets];
+    std::atomic<uint64_t> total_count_;
+    std::atomic<uint64_t> max_;
+
+    LatencyHistogram(const LatencyHistogram&) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    static size_t BucketOf(const uint64_t value) {
+        if (value < SubBucketCount) return static_cast<size_t>(value);
+        if (value >= MaxValue) return NumBuckets - 1;
+        const unsigned shift = (63 - __builtin_clzll(value)) - (SubBucketBits - 1);
+        return static_cast<size_t>(SubBucketCount + (shift - 1) * SubBucketHalfCount + ((value >> shift) - SubBucketHalfCount));
+    }
+
+    // The highest value counted in bucket.
+    static uint64_t HighestValueOf(const size_t bucket) {
+        if (bucket < SubBucketCount) return bucket;
+        const unsigned shift = static_cast<unsigned>((bucket - SubBucketCount) / SubBucketHalfCount) + 1;
+        const uint64_t sub_bucket = ((bucket - SubBucketCount) % SubBucketHalfCount) + SubBucketHalfCount;
+        return ((sub_bucket + 1) << shift) - 1;
+    }
+
+public:
+    LatencyHistogram() {
+        Reset();
+    }
+
+    // Process-wide: every session's latencies, whichever thread records them.
+    static LatencyHistogram& Global() {
+        static LatencyHistogram global;
+        return global;
+    }
+
+    // Not to be called while another thread records.
+    void Reset() {
+        for (size_t i = 0; i < NumBuckets; ++i) {
+            counts_[i].store(0, std::memory_order_relaxed);
+        }
+        total_count_.store(0, std::memory_order_relaxed);
+        max_.store(0, std::memory_order_relaxed);
+    }
+
+    // Returns the number of values recorded so far, this one included.
+    uint64_t Record(const uint64_t value) {
+        counts_[BucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        uint64_t max = max_.load(std::memory_order_relaxed);
+        while ((value > max) && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {}
+        return total_count_.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+
+    uint64_t TotalCount() const { return total_count_.load(std::memory_order_relaxed); }
+    uint64_t Max() const { return max_.load(std::memory_order_relaxed); }
+
+    // The value that fraction (e.g. 0.99) of the values recorded are at or below, to within a bucket. 0 if there are none.
+    uint64_t ValueAtFraction(const double fraction) const {
+        const uint64_t total_count = TotalCount();
+        if (0 == total_count) return 0;
+        uint64_t rank = static_cast<uint64_t>(fraction * total_count + 0.5);
+        rank = (rank < 1) ? 1 : ((rank > total_count) ? total_count : rank);
+        uint64_t num_counted = 0;
+        for (size_t i = 0; i < NumBuckets; ++i) {
+            num_counted += counts_[i].load(std::memory_order_relaxed);
+            if (num_counted >= rank) {
+                const uint64_t value = HighestValueOf(i);
+                return (value < Max()) ? value : Max();
+            }
+        }
+        return Max();
+    }
+
+    // One line: the count, then p50, p99, p99.9 and max in us.
+    void Report(const log::Level level, char const* const name) const {
+        const uint64_t total_count = TotalCount();
+        if (0 == total_count) return;
+        log::PrintLn(level, "%s: %llu round trips, p50=%.1fus p99=%.1fus p99.9=%.1fus max=%.1fus"
+            , name, (unsigned long long)total_count
+            , ValueAtFraction(0.5) / 1000.0, ValueAtFraction(0.99) / 1000.0, ValueAtFraction(0.999) / 1000.0, Max() / 1000.0);
+    }
+};
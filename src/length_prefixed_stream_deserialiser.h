@@ -2,65 +2,111 @@
 #include <vector>
 #include <assert.h>
 #include "string.h"
-
-template<typename LengthFieldType = size_t>
+#include "frame_handler.h"
+
+/*
+Collects a byte stream and cuts it into length-prefixed frames. 
+HeaderPolicy (see wire_format.h) tells how long a frame is from its first bytes, and decodes each frame's header 
+into its FrameView, so that every wire format goes through the same code, and handlers never parse headers.
+
+buffer_[num_consumed_, num_populated_) holds the bytes not yet handed out as frames. Deserialise(...) hands out every
+complete frame by advancing num_consumed_, and only then moves what is left (at most one partial frame) to the front 
+of buffer_, so a read holding thousands of tiny frames costs one memmove, not one per frame.
+
+The complete frames are handed to the frame handler in one HandleFrames(...) call if it has one, 
+otherwise one HandleFrame(...) call each (see frame_handler.h).
+
+A peer picks the length of its frames, so two limits keep it from picking how much we buffer (0 disables each):
+- max_frame_size: a frame longer than this is rejected as soon as its length field arrives. Nothing more is deserialised,
+  and HasRejectedFrame() tells the owner to drop the connection.
+- streaming_threshold: a frame at least this long is handed to a handler that takes frames in pieces (HandleFrameBegin,
+  HandleFrameChunk, HandleFrameEnd) as its bytes arrive, and consumed as it goes, so buffer_ never grows past a read's
+  worth for it, however long it is. Begin waits for MinBytesToBeginStreaming bytes, so that it gets the whole of its header.
+
+A frame after which the stream changes format (HeaderPolicy::OnFrameCut(...) returns true, e.g. a Hello) ends the 
+Deserialise call, so that the owner can act on it before any frame after it is handled. Deserialise again for the rest.
+*/
+template<typename HeaderPolicy>
 class LengthPrefixedStreamDeserialiser {
+    HeaderPolicy header_policy_;
     std::vector<char> buffer_;
+    size_t num_consumed_;
     size_t num_populated_;
+    // Reused by every Deserialise call, to collect its batch of frames.
+    std::vector<FrameView> frames_;
+
+    size_t max_frame_size_;
+    size_t streaming_threshold_;
+    // Bytes of the frame being streamed that have yet to arrive (0 when no frame is being streamed).
+    size_t num_bytes_left_in_streamed_frame_;
+    // Length of the frame that was rejected for being longer than max_frame_size_ (0 if none was).
+    size_t rejected_frame_size_;
 
     char* FirstFramePtr() {
-        return buffer_.empty() ? nullptr : &buffer_[0];
+        return (num_consumed_ < num_populated_) ? &buffer_[num_consumed_] : nullptr;
     }
 
     char const* ConstFirstFramePtr() const {
-        return buffer_.empty() ? nullptr : &buffer_[0];
+        return (num_consumed_ < num_populated_) ? &buffer_[num_consumed_] : nullptr;
     }
 
-    template<typename FrameHandler>
-    void MoveTo(FrameHandler& frame_handler) {
-        TrimLeft(num_populated_, &frame_handler);
+    size_t NumUnconsumed() const {
+        return num_populated_ - num_consumed_;
     }
 
-    template<typename FrameHandler>
-    bool TrimLeft(const size_t n, FrameHandler* const frame_handler_ptr = 0) {
-        const size_t num_bytes_to_trim = std::min(n, num_populated_);
-        if (num_bytes_to_trim < 1) {
-            return false;
-        }
-
-        char * const first_frame_ptr = FirstFramePtr();
-        if (!first_frame_ptr) {
-            return false;
-        }
-
-        if (frame_handler_ptr) {
-            frame_handler_ptr->HandleFrame(first_frame_ptr, num_bytes_to_trim);
-        }
-
-        const size_t num_bytes_preserved = num_populated_ - num_bytes_to_trim;
+    // Moves the unconsumed bytes to the front of buffer_.
+    void Compact() {
+        if (0 == num_consumed_) return;
+        const size_t num_bytes_preserved = NumUnconsumed();
         if (num_bytes_preserved > 0) {
-            ::memmove(first_frame_ptr, first_frame_ptr + num_bytes_to_trim, num_bytes_preserved);
+            ::memmove(&buffer_[0], &buffer_[num_consumed_], num_bytes_preserved);
         }
-
-        num_populated_ -= num_bytes_to_trim;
-
-        return true;
+        num_consumed_ = 0;
+        num_populated_ = num_bytes_preserved;
     }
 
-
-    bool HasCompleteFrame(LengthFieldType& frame_length) const {
-        if (num_populated_ < sizeof(LengthFieldType)) return false;
-
+    // Returns false until enough of the first frame has arrived to tell its length.
+    bool ReadFrameLength(size_t& num_bytes_in_frame) const {
         char const* const first_frame_ptr = ConstFirstFramePtr();
-        assert(first_frame_ptr);
         if (!first_frame_ptr) return false;
+        return header_policy_.DecodeLength(first_frame_ptr, NumUnconsumed(), num_bytes_in_frame);
+    }
 
-        frame_length = *((LengthFieldType*)first_frame_ptr);
+    FrameView DecodeFirstFrame(const size_t num_bytes) {
+        FrameView frame = { FirstFramePtr(), num_bytes };
+        header_policy_.DecodeHeader(frame);
+        return frame;
+    }
 
-        return (num_populated_ >= frame_length);
+    // Hands the frames collected so far to frame_handler.
+    template<typename FrameHandler>
+    void HandOutFrames(FrameHandler& frame_handler) {
+        if (frames_.empty()) return;
+        if constexpr (HasHandleFrames<FrameHandler>::value) {
+            frame_handler.HandleFrames(&frames_[0], frames_.size());
+        }
+        else {
+            PerFrameHandlerAdapter<FrameHandler>(frame_handler).HandleFrames(&frames_[0], frames_.size());
+        }
+        frames_.clear();
+    }
+
+    // Hands as much of the frame being streamed as has arrived to frame_handler. Returns true if that was the end of it.
+    template<typename FrameHandler>
+    bool StreamFramePiece(FrameHandler& frame_handler) {
+        const size_t n = std::min(NumUnconsumed(), num_bytes_left_in_streamed_frame_);
+        if (n > 0) {
+            frame_handler.HandleFrameChunk(FirstFramePtr(), n);
+            num_consumed_ += n;
+            num_bytes_left_in_streamed_frame_ -= n;
+        }
+        if (num_bytes_left_in_streamed_frame_ > 0) return false;
+        frame_handler.HandleFrameEnd();
+        return true;
     }
 
     bool ResizeToFitMoreUsefulBytes(const size_t num_additional_bytes_to_populate) {
+        Compact();
         const size_t capacity = buffer_.size();
         const size_t free_space = capacity - num_populated_;
         if (free_space < num_additional_bytes_to_populate) {
@@ -71,10 +117,42 @@ class LengthPrefixedStreamDeserialiser {
         return false;
     }
 public:
+    static const size_t MinBytesToBeginStreaming = 64;
+    static_assert(MinBytesToBeginStreaming >= HeaderPolicy::MaxHeaderSize, "The first piece of a streamed frame must hold its header");
+
     LengthPrefixedStreamDeserialiser()
-        : num_populated_(0)
+        : num_consumed_(0)
+        , num_populated_(0)
+        , max_frame_size_(0)
+        , streaming_threshold_(0)
+        , num_bytes_left_in_streamed_frame_(0)
+        , rejected_frame_size_(0)
     {}
 
+    // See above. Kept across Reset().
+    void SetFrameSizeLimits(const size_t max_frame_size, const size_t streaming_threshold) {
+        max_frame_size_ = max_frame_size;
+        streaming_threshold_ = streaming_threshold ? std::max<size_t>(streaming_threshold, size_t(MinBytesToBeginStreaming)) : 0;
+    }
+
+    HeaderPolicy& GetHeaderPolicy() { return header_policy_; }
+    const HeaderPolicy& GetHeaderPolicy() const { return header_policy_; }
+
+    bool HasRejectedFrame() const { return rejected_frame_size_ > 0; }
+
+    // Bytes that have yet to arrive to complete the partial frame held (or the piece of a streamed frame), 
+    // or 0 if no frame is under way.
+    size_t NumBytesToCompleteFrame() const {
+        if (num_bytes_left_in_streamed_frame_ > 0) return num_bytes_left_in_streamed_frame_;
+        const size_t num_unconsumed = NumUnconsumed();
+        if (0 == num_unconsumed) return 0;
+        size_t num_bytes_in_frame = 0;
+        // At least one more byte is needed to tell the frame's length.
+        if (!ReadFrameLength(num_bytes_in_frame)) return 1;
+        return (num_bytes_in_frame > num_unconsumed) ? (num_bytes_in_frame - num_unconsumed) : 0;
+    }
+    size_t RejectedFrameSize() const { return rejected_frame_size_; }
+
     // StreamReader: Functor signature: (char * const stream_ptr, const size_t num_bytes_to_read, size_t& num_bytes_read);
     template<typename StreamReader>
     size_t AppendStream(StreamReader& stream_reader, const size_t max_bytes_to_read) {
@@ -101,24 +179,64 @@ public:
         AppendStream((char const* const)(&x), sizeof(x));
     }
 
-    // At the end of this, buffer_ will either have 0 useful bytes, or contain at most one partial frame.
-    // FrameHandler: Functor signature: (char const * const frame_ptr, const size_t num_bytes_in_frame);
+    // At the end of this, buffer_ will either have 0 useful bytes, or contain at most one partial frame (at its front).
+    // Returns the number of frames completed, whole or streamed.
+    // FrameHandler: Functor signature: void HandleFrames(const FrameView* const frames, const size_t num_frames);
+    //               or (char const * const frame_ptr, const size_t num_bytes_in_frame);
+    //               optionally with HandleFrameBegin/HandleFrameChunk/HandleFrameEnd (see frame_handler.h).
     template<typename FrameHandler>
     size_t Deserialise(FrameHandler& frame_handler) {
+        frames_.clear();
         size_t nFrame = 0;
-        LengthFieldType frame_length = 0;
-        while (HasCompleteFrame(frame_length)) {
+        while (!HasRejectedFrame()) {
+            if constexpr (HasHandleFramePieces<FrameHandler>::value) {
+                if (num_bytes_left_in_streamed_frame_ > 0) {
+                    if (!StreamFramePiece(frame_handler)) break;
+                    ++nFrame;
+                    continue;
+                }
+            }
+
+            size_t num_bytes_in_frame = 0;
+            if (!ReadFrameLength(num_bytes_in_frame)) break;
+            if (max_frame_size_ && (num_bytes_in_frame > max_frame_size_)) {
+                rejected_frame_size_ = num_bytes_in_frame;
+                break;
+            }
+
+            if constexpr (HasHandleFramePieces<FrameHandler>::value) {
+                if (streaming_threshold_ && (num_bytes_in_frame >= streaming_threshold_)) {
+                    if (NumUnconsumed() < MinBytesToBeginStreaming) break;
+                    // The frames before it go first, to keep frames in order.
+                    HandOutFrames(frame_handler);
+                    const size_t n = std::min(NumUnconsumed(), num_bytes_in_frame);
+                    frame_handler.HandleFrameBegin(DecodeFirstFrame(n), num_bytes_in_frame);
+                    num_consumed_ += n;
+                    num_bytes_left_in_streamed_frame_ = num_bytes_in_frame - n;
+                    if (!StreamFramePiece(frame_handler)) break;
+                    ++nFrame;
+                    continue;
+                }
+            }
+
+            if (NumUnconsumed() < num_bytes_in_frame) break;
+            frames_.push_back(DecodeFirstFrame(num_bytes_in_frame));
+            num_consumed_ += num_bytes_in_frame;
             ++nFrame;
-            // ATTENTION: Since the length field includes its own size, 
-            // even if the length value is less than the size of the length field itself,
-            // we will still consider the frame length to be the size of the length field.
-            // Hence the std::max.
-            TrimLeft(std::max(sizeof(LengthFieldType), frame_length), &frame_handler);
+            if (header_policy_.OnFrameCut(frames_.back())) break;
         }
+
+        // The frames point into buffer_, so they are handed out before it is compacted.
+        HandOutFrames(frame_handler);
+        Compact();
         return nFrame;
     }
 
     void Reset() {
+        num_consumed_ = 0;
         num_populated_ = 0;
+        num_bytes_left_in_streamed_frame_ = 0;
+        rejected_frame_size_ = 0;
+        header_policy_.Reset();
     }
 };
@@ -0,0 +1,66 @@
+#include "loop_command_queue.h"
+#include "logging.h"
+#include <errno.h>
+#include <sys/eventfd.h>
+
+LoopCommandQueue::LoopCommandQueue()
+    // Blocking, because the io_uring backend reads it with an IORING_OP_READ that should wait for a write.
+    // The epoll backend only reads it once epoll reports it readable.
+    : fd_wakeup_(eventfd(0, EFD_CLOEXEC))
+    , is_wakeup_pending_(false)
+{
+    if (fd_wakeup_ < 0) {
+        log::PrintLnCurrentErrno(log::Error, "Failed to create wakeup eventfd");
+    }
+}
+
+LoopCommandQueue::~LoopCommandQueue() {
+    while (LoopCommand* const command = queue_.Pop()) {
+        delete command;
+    }
+    if (fd_wakeup_ >= 0) {
+        close(fd_wakeup_);
+    }
+}
+
+void LoopCommandQueue::Post(LoopCommand* const command) {
+    queue_.Push(command);
+    if (!is_wakeup_pending_.exchange(true, std::memory_order_seq_cst)) {
+        const uint64_t one = 1;
+        if (write(fd_wakeup_, &one, sizeof(one)) < 0) {
+            log::PrintLnCurrentErrno(log::Error, "%d|Failed to wake loop", fd_wakeup_);
+        }
+    }
+}
+
+void LoopCommandQueue::PostBroadcast(char const* const frame_ptr, const size_t n) {
+    if (!(frame_ptr && n)) return;
+    LoopCommand* const command = new LoopCommand();
+    command->type = LoopCommand_Broadcast;
+    command->frame.assign(frame_ptr, frame_ptr + n);
+    Post(command);
+}
+
+void LoopCommandQueue::PostConflatedBroadcast(char const* const frame_ptr, const size_t n, const uint64_t conflation_key) {
+    if (!(frame_ptr && n)) return;
+    LoopCommand* const command = new LoopCommand();
+    command->type = LoopCommand_ConflatedBroadcast;
+    command->conflation_key = conflation_key;
+    command->frame.assign(frame_ptr, frame_ptr + n);
+    Post(command);
+}
+
+void LoopCommandQueue::PostPublish(char const* const frame_ptr, const size_t n) {
+    if (!(frame_ptr && n)) return;
+    LoopCommand* const command = new LoopCommand();
+    command->type = LoopCommand_Publish;
+    command->frame.assign(frame_ptr, frame_ptr + n);
+    Post(command);
+}
+
+void LoopCommandQueue::ReadWakeup() {
+    uint64_t counter = 0;
+    if ((read(fd_wakeup_, &counter, sizeof(counter)) < 0) && (EAGAIN != errno)) {
+        log::PrintLnCurrentErrno(log::Error, "%d|Failed to read wakeup counter", fd_wakeup_);
+    }
+}
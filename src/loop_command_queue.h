@@ -0,0 +1,102 @@
+#pragma once
+#include <unistd.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+#include "mpsc_queue.h"
+
+enum LoopCommandType {
+    // Append frame to every session of the loop.
+    LoopCommand_Broadcast,
+    // Queue frame for every session of the loop, replacing any unsent frame with the same conflation_key.
+    LoopCommand_ConflatedBroadcast,
+    // A frame of session_tag's, handled off the loop by a WorkerPool, back with its response in frame (see frame_offloader.h).
+    LoopCommand_OffloadedFrame,
+    // Append frame (a Publish, in v1) to every session of the loop that is subscribed to its topic (see topic_index.h).
+    LoopCommand_Publish,
+};
+
+class LoopCommandQueue;
+
+struct LoopCommand {
+    std::atomic<LoopCommand*> mpsc_next;
+    LoopCommandType type;
+    uint64_t conflation_key;
+    std::vector<char> frame;
+
+    // LoopCommand_OffloadedFrame: a worker calls work(...) on the command, which replaces frame with its response,
+    // then posts it to reply_queue. seq is the response's place in the session's order. 
+    // wire_version and ack_seq are what work needs to know of the session besides the frame.
+    void (*work)(LoopCommand&);
+    LoopCommandQueue* reply_queue;
+    uint64_t session_tag;
+    uint64_t seq;
+    uint64_t ack_seq;
+    uint8_t wire_version;
+
+    LoopCommand() 
+        : mpsc_next(nullptr)
+        , type(LoopCommand_Broadcast)
+        , conflation_key(0)
+        , work(nullptr)
+        , reply_queue(nullptr)
+        , session_tag(0)
+        , seq(0)
+        , ack_seq(0)
+        , wire_version(0)
+    {}
+};
+
+/*
+The way threads other than a loop's own (the console loop, admin or worker threads) get anything done by that loop:
+they Post(...) a command, and the loop thread carries it out, so that all socket I/O and session state stay with the loop thread.
+
+Commands go through a lock-free MpscQueue. An eventfd, which the loop watches alongside its sockets, wakes the loop up,
+and is only written when the loop is not already due to wake up, so a burst of commands costs one write and one read.
+
+Loop thread: once WakeupFd() is readable, call ReadWakeup() (unless the counter was already read, e.g. by io_uring),
+then Drain(...).
+*/
+class LoopCommandQueue {
+    MpscQueue<LoopCommand> queue_;
+    int fd_wakeup_;
+    std::atomic<bool> is_wakeup_pending_;
+
+    LoopCommandQueue(const LoopCommandQueue&) = delete;
+    LoopCommandQueue& operator=(const LoopCommandQueue&) = delete;
+
+public:
+    LoopCommandQueue();
+    ~LoopCommandQueue();
+
+    bool IsValid() const { return fd_wakeup_ >= 0; }
+    int WakeupFd() const { return fd_wakeup_; }
+
+    // Thread-safe. Takes ownership of command.
+    void Post(LoopCommand* const command);
+    // Thread-safe.
+    void PostBroadcast(char const* const frame_ptr, const size_t n);
+    // Thread-safe.
+    void PostConflatedBroadcast(char const* const frame_ptr, const size_t n, const uint64_t conflation_key);
+    // Thread-safe.
+    void PostPublish(char const* const frame_ptr, const size_t n);
+
+    // Loop thread only.
+    void ReadWakeup();
+
+    // Loop thread only. Hands every posted command to command_handler, then deletes it.
+    // LoopCommandHandler: Functor signature: void HandleLoopCommand(LoopCommand&);
+    template<typename LoopCommandHandler>
+    size_t Drain(LoopCommandHandler& command_handler) {
+        // Cleared before popping, so that a command posted from here on writes the eventfd again, even if this Drain misses it.
+        is_wakeup_pending_.store(false, std::memory_order_seq_cst);
+
+        size_t n = 0;
+        while (LoopCommand* const command = queue_.Pop()) {
+            command_handler.HandleLoopCommand(*command);
+            delete command;
+            ++n;
+        }
+        return n;
+    }
+};
@@ -0,0 +1,192 @@
+#pragma once
+#include <stddef.h>
+#include <time.h>
+#include "logging.h"
+#include "latency_histogram.h"
+
+/*
+Per-loop counters for comparing I/O backends under the same load: how many syscalls each loop makes per frame received,
+how fast connections are being accepted (reported at most once a second while any are arriving), 
+how far behind the broadcasts the slowest session is, and what was done about sessions that could not keep up.
+Only touched by the loop thread that owns it.
+*/
+struct LoopStats {
+    char const* const backend_name;
+    size_t num_syscalls;
+    size_t num_frames;
+    size_t num_frames_at_next_report;
+
+    // Accepts are reported in windows: a window starts with the first accept after the previous one was reported,
+    // and is reported by the first accept at least a second later (or by Report()), as a rate over its first to last accept.
+    size_t num_accepts;
+    size_t num_accept_batches;
+    size_t num_accept_batches_at_limit;
+    size_t num_accepts_in_window;
+    double window_start_time;
+    double window_last_accept_time;
+
+    // As of the latest broadcast: the bytes held by the broadcast log, and the most any session had yet to send.
+    size_t num_broadcasts;
+    size_t num_broadcast_bytes_held;
+    size_t max_broadcast_lag;
+
+    // Backpressure: times a session's reads were paused at its high watermark, slow consumers disconnected,
+    // and the broadcasts (and their bytes) dropped for slow consumers.
+    size_t num_read_pauses;
+    size_t num_slow_consumers_disconnected;
+    size_t num_slow_consumers_dropped;
+    size_t num_broadcast_bytes_dropped;
+    // Keyed broadcasts: queued per session, and replaced by a newer one for the same key before being sent.
+    size_t num_conflatable_frames;
+    size_t num_conflated_frames;
+    // Sessions disconnected for sending a frame above the maximum frame size.
+    size_t num_frames_rejected;
+    size_t num_frames_offloaded;
+    // Publishes, the subscribers they were appended to, and the topics with subscribers as of the latest publish.
+    size_t num_publishes;
+    size_t num_publish_deliveries;
+    size_t num_topics;
+
+    static const size_t NumFramesBetweenReports = 1 << 20;
+
+    LoopStats(char const* const backend_name)
+        : backend_name(backend_name)
+        , num_syscalls(0)
+        , num_frames(0)
+        , num_frames_at_next_report(NumFramesBetweenReports)
+        , num_accepts(0)
+        , num_accept_batches(0)
+        , num_accept_batches_at_limit(0)
+        , num_accepts_in_window(0)
+        , window_start_time(0)
+        , window_last_accept_time(0)
+        , num_broadcasts(0)
+        , num_broadcast_bytes_held(0)
+        , max_broadcast_lag(0)
+        , num_read_pauses(0)
+        , num_slow_consumers_disconnected(0)
+        , num_slow_consumers_dropped(0)
+        , num_broadcast_bytes_dropped(0)
+        , num_conflatable_frames(0)
+        , num_conflated_frames(0)
+        , num_frames_rejected(0)
+        , num_frames_offloaded(0)
+        , num_publishes(0)
+        , num_publish_deliveries(0)
+        , num_topics(0)
+    {}
+
+    static double NowInSeconds() {
+        timespec now = { 0 };
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec + now.tv_nsec * 1e-9;
+    }
+
+    void OnSyscalls(const size_t n) {
+        num_syscalls += n;
+    }
+
+    void OnFrames(const size_t n) {
+        num_frames += n;
+        if (num_frames >= num_frames_at_next_report) {
+            num_frames_at_next_report = num_frames + NumFramesBetweenReports;
+            Report();
+        }
+    }
+
+    // is_at_limit: the batch stopped at max_accepts_per_tick rather than because the backlog was empty.
+    void OnAccepts(const size_t n, const bool is_at_limit) {
+        if (0 == n) return;
+        const double now = NowInSeconds();
+        if ((num_accepts_in_window > 0) && ((now - window_start_time) >= 1.0)) {
+            ReportAccepts();
+        }
+        if (0 == num_accepts_in_window) {
+            window_start_time = now;
+        }
+        window_last_accept_time = now;
+        num_accepts_in_window += n;
+        num_accepts += n;
+        ++num_accept_batches;
+        if (is_at_limit) {
+            ++num_accept_batches_at_limit;
+        }
+    }
+
+    void OnBroadcast(const size_t num_bytes_held, const size_t max_lag) {
+        ++num_broadcasts;
+        num_broadcast_bytes_held = num_bytes_held;
+        max_broadcast_lag = max_lag;
+    }
+
+    void OnReadPaused() {
+        ++num_read_pauses;
+    }
+
+    void OnFrameRejected() {
+        ++num_frames_rejected;
+    }
+
+    void OnOffloadedFrame() {
+        ++num_frames_offloaded;
+    }
+
+    void OnPublish(const size_t num_subscribers, const size_t num_topics_now) {
+        ++num_publishes;
+        num_publish_deliveries += num_subscribers;
+        num_topics = num_topics_now;
+    }
+
+    void OnSlowConsumerDisconnected() {
+        ++num_slow_consumers_disconnected;
+    }
+
+    void OnBroadcastsDropped(const size_t num_bytes) {
+        ++num_slow_consumers_dropped;
+        num_broadcast_bytes_dropped += num_bytes;
+    }
+
+    void OnConflatableFrames(const size_t num_queued, const size_t num_replaced) {
+        num_conflatable_frames += num_queued;
+        num_conflated_frames += num_replaced;
+    }
+
+    void ReportAccepts() {
+        if (0 == num_accepts_in_window) return;
+        const double elapsed = window_last_accept_time - window_start_time;
+        log::PrintLn(log::Info, "%s loop: accepted %zu connections in %.3fs (%.0f/s); %zu in total over %zu batches, %zu of which hit the per-tick limit"
+            , backend_name, num_accepts_in_window, elapsed, (elapsed > 0) ? (num_accepts_in_window / elapsed) : 0.0
+            , num_accepts, num_accept_batches, num_accept_batches_at_limit);
+        num_accepts_in_window = 0;
+    }
+
+    void Report() {
+        ReportAccepts();
+        log::PrintLn(log::Info, "%s loop: %zu frames, %zu syscalls, %.3f syscalls/frame"
+            , backend_name, num_frames, num_syscalls, num_frames ? (double(num_syscalls) / num_frames) : 0.0);
+        if (num_broadcasts) {
+            log::PrintLn(log::Info, "%s loop: %zu broadcasts, %zu bytes held in the broadcast log, slowest session %zu bytes behind"
+                , backend_name, num_broadcasts, num_broadcast_bytes_held, max_broadcast_lag);
+        }
+        if (num_conflatable_frames) {
+            log::PrintLn(log::Info, "%s loop: %zu keyed broadcast frames queued to sessions, %zu of them replaced by a newer one before being sent"
+                , backend_name, num_conflatable_frames, num_conflated_frames);
+        }
+        if (num_publishes) {
+            log::PrintLn(log::Info, "%s loop: %zu publishes appended to %zu subscribers (%.1f per publish), %zu topics with subscribers"
+                , backend_name, num_publishes, num_publish_deliveries, double(num_publish_deliveries) / num_publishes, num_topics);
+        }
+        if (num_frames_offloaded) {
+            log::PrintLn(log::Info, "%s loop: %zu frames handled by worker threads", backend_name, num_frames_offloaded);
+        }
+        if (num_frames_rejected) {
+            log::PrintLn(log::Info, "%s loop: %zu sessions disconnected for sending a frame above the maximum frame size"
+                , backend_name, num_frames_rejected);
+        }
+        LatencyHistogram::Global().Report(log::Info, "All sessions");
+        if (num_read_pauses || num_slow_consumers_disconnected || num_slow_consumers_dropped) {
+            log::PrintLn(log::Info, "%s loop: reads paused %zu times; slow consumers: %zu disconnected, %zu had broadcasts dropped (%zu bytes)"
+                , backend_name, num_read_pauses, num_slow_consumers_disconnected, num_slow_consumers_dropped, num_broadcast_bytes_dropped);
+        }
+    }
+};
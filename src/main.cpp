@@ -1,16 +1,28 @@
 ﻿#include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include "epoll_server.h"
+#include "io_uring_server.h"
 #include "tcp_client.h"
+#include "bench.h"
 #include "config.h"
 #include "logging.h"
 
 bool ReadFromCommandLineThenRun(int argc, char* argv[]) {
-    if (argc > 1) {
+    const int num_positional_args = NumPositionalArgs(argc, argv);
+    if (num_positional_args > 1) {
         // Ignore broken pipe signal (e.g. from writing to closed client socket which hung up)
         signal(SIGPIPE, SIG_IGN);
 
-        if (argc > 2) {
+        char const* const mode = NthPositionalArg(argc, argv, 1);
+        if ((num_positional_args > 3) && (0 == strcmp(mode, "bench"))) {
+            BenchConfig config;
+            if (!config.ReadFromCommandLine(argc, argv)) {
+                return false;
+            }
+            RunBench(config);
+        }
+        else if (num_positional_args > 2) {
             ClientConfig config;
             if (!config.ReadFromCommandLine(argc, argv)) {
                 return false;
@@ -22,7 +34,12 @@ bool ReadFromCommandLineThenRun(int argc, char* argv[]) {
             if (!config.ReadFromCommandLine(argc, argv)) {
                 return false;
             }
-            RunEpollServer(config);
+            if (ServerBackend_IoUring == config.backend) {
+                RunIoUringServer(config);
+            }
+            else {
+                RunEpollServer(config);
+            }
         }
 
         return true;
@@ -33,7 +50,7 @@ bool ReadFromCommandLineThenRun(int argc, char* argv[]) {
 
 int main(int argc, char* argv[]) {
     if (!ReadFromCommandLineThenRun(argc, argv)) {
-        log::PrintLn(log::Info, "Usage: ncc <listening_port|remote_host:remote_port>");
+        log::PrintLn(log::Info, "Usage: ncc <listening_port [--threads=N] [--backend=epoll|io_uring]|remote_host remote_port|bench remote_host remote_port [--connections=M] [--rate=MSGS_PER_S] [--size=BYTES|MIN-MAX] [--threads=N] [--duration-s=S]>");
         return -1;
     }
     
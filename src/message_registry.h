@@ -0,0 +1,127 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <array>
+#include <algorithm>
+#include <type_traits>
+#include "frame_handler.h"
+
+/*
+The message types of a protocol as a compile-time list, from which MessageRegistry generates:
+- a dense table of typed handler calls, indexed by type code, so that dispatching a frame costs a bounds check
+  and one indirect call, however many types there are and however they are mixed,
+- the least body size of each type, checked before the body is read, so that a truncated frame is rejected
+  rather than reinterpreted,
+- the name of each type.
+
+A message type T has static const char msg_type (its type code) and static constexpr char const* name, and its body is:
+- nothing, if T is empty,
+- T itself, copied out of the frame, if T is a fixed-size struct,
+- variable-length, if T declares static const size_t min_num_body_bytes. If T also has
+  static bool Decode(char const* const body_ptr, const size_t num_body_bytes, T& msg);
+  the body is decoded with it, and a body it fails to decode is invalid. Otherwise the handler reads FrameView::body itself.
+
+MessageHandler: Functor signature: void OnMessage(const T&, const FrameView&); for every T,
+                and void OnInvalidFrame(const FrameView&); for frames of unknown types or with too short a body.
+*/
+template<typename T, typename = void>
+struct IsVariableLengthMsg : std::false_type {};
+
+template<typename T>
+struct IsVariableLengthMsg<T, std::void_t<decltype(T::min_num_body_bytes)>> : std::true_type {};
+
+template<typename T, typename = void>
+struct HasDecode : std::false_type {};
+
+template<typename T>
+struct HasDecode<T, std::void_t<decltype(T::Decode(std::declval<char const*>(), size_t(0), std::declval<T&>()))>> : std::true_type {};
+
+template<typename T>
+constexpr size_t MinNumBodyBytes() {
+    if constexpr (IsVariableLengthMsg<T>::value) {
+        return T::min_num_body_bytes;
+    }
+    else if constexpr (std::is_empty<T>::value) {
+        return 0;
+    }
+    else {
+        return sizeof(T);
+    }
+}
+
+template<typename ... Msgs>
+struct MessageRegistry {
+    static constexpr size_t NumTypes = std::max({ size_t(uint8_t(Msgs::msg_type)) ... }) + 1;
+
+private:
+    static constexpr bool AreTypeCodesDistinct() {
+        std::array<bool, NumTypes> is_taken{};
+        bool are_distinct = true;
+        ((are_distinct = are_distinct && !is_taken[uint8_t(Msgs::msg_type)], is_taken[uint8_t(Msgs::msg_type)] = true), ...);
+        return are_distinct;
+    }
+    static_assert(AreTypeCodesDistinct(), "Two message types share a type code");
+
+    static constexpr std::array<char const*, NumTypes> MakeNames() {
+        std::array<char const*, NumTypes> names{};
+        ((names[uint8_t(Msgs::msg_type)] = Msgs::name), ...);
+        return names;
+    }
+
+    template<typename MessageHandler>
+    struct DispatchTable {
+        typedef void (*Entry)(MessageHandler&, const FrameView&);
+
+        template<typename T>
+        static void Call(MessageHandler& message_handler, const FrameView& frame) {
+            if (frame.num_body_bytes < MinNumBodyBytes<T>()) {
+                message_handler.OnInvalidFrame(frame);
+                return;
+            }
+            T msg;
+            if constexpr (HasDecode<T>::value) {
+                if (!T::Decode(frame.body, frame.num_body_bytes, msg)) {
+                    message_handler.OnInvalidFrame(frame);
+                    return;
+                }
+            }
+            else if constexpr ((!IsVariableLengthMsg<T>::value) && (!std::is_empty<T>::value)) {
+                // Frames are packed back to back, so the body need not be aligned.
+                memcpy(static_cast<void*>(&msg), frame.body, sizeof(msg));
+            }
+            message_handler.OnMessage(static_cast<const T&>(msg), frame);
+        }
+
+        static void CallInvalid(MessageHandler& message_handler, const FrameView& frame) {
+            message_handler.OnInvalidFrame(frame);
+        }
+
+        static constexpr std::array<Entry, NumTypes> MakeEntries() {
+            std::array<Entry, NumTypes> entries{};
+            for (size_t i = 0; i < NumTypes; ++i) {
+                entries[i] = &CallInvalid;
+            }
+            ((entries[uint8_t(Msgs::msg_type)] = &Call<Msgs>), ...);
+            return entries;
+        }
+
+        static constexpr std::array<Entry, NumTypes> entries = MakeEntries();
+    };
+
+    static constexpr std::array<char const*, NumTypes> names = MakeNames();
+
+public:
+    static char const* Name(const uint8_t type) {
+        return ((type < NumTypes) && names[type]) ? names[type] : "Unknown";
+    }
+
+    template<typename MessageHandler>
+    static void Dispatch(MessageHandler& message_handler, const FrameView& frame) {
+        if (frame.type >= NumTypes) {
+            message_handler.OnInvalidFrame(frame);
+            return;
+        }
+        DispatchTable<MessageHandler>::entries[frame.type](message_handler, frame);
+    }
+};
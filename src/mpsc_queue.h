@@ -0,0 +1,66 @@
+#pragma once
+#include <atomic>
+
+/*
+Intrusive, unbounded multi-producer single-consumer queue (after Dmitry Vyukov's), so that any thread can hand work
+to an event loop without taking a lock.
+
+Push(...) may be called from any thread: it is a single atomic exchange, plus a store linking the previous node.
+Pop() may only be called from the consumer thread. It returns nullptr when the queue is empty, and also when a producer
+is midway through Push(...), in which case that node is returned by a later Pop() (so the producer must notify
+the consumer only after Push(...) has returned).
+
+T: must be default constructible, and have a member std::atomic<T*> mpsc_next. The queue never owns the nodes.
+*/
+template<typename T>
+class MpscQueue {
+    // Producers append at head_, the consumer removes from tail_.
+    // stub_ keeps the list non-empty, so that producers never have to touch tail_.
+    std::atomic<T*> head_;
+    T* tail_;
+    T stub_;
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+public:
+    MpscQueue()
+        : head_(&stub_)
+        , tail_(&stub_)
+    {
+        stub_.mpsc_next.store(nullptr, std::memory_order_relaxed);
+    }
+
+    void Push(T* const node) {
+        node->mpsc_next.store(nullptr, std::memory_order_relaxed);
+        T* const prev = head_.exchange(node, std::memory_order_acq_rel);
+        // Until this store, the consumer cannot see node (or anything pushed after it).
+        prev->mpsc_next.store(node, std::memory_order_seq_cst);
+    }
+
+    T* Pop() {
+        T* tail = tail_;
+        T* next = tail->mpsc_next.load(std::memory_order_acquire);
+        if (&stub_ == tail) {
+            if (!next) return nullptr;
+            tail_ = next;
+            tail = next;
+            next = next->mpsc_next.load(std::memory_order_acquire);
+        }
+        if (next) {
+            tail_ = next;
+            return tail;
+        }
+
+        // tail is the last linked node. Unless a producer is midway through Push(...), re-insert the stub behind it
+        // so that tail can be handed out without leaving the list empty.
+        if (tail != head_.load(std::memory_order_acquire)) return nullptr;
+        Push(&stub_);
+        next = tail->mpsc_next.load(std::memory_order_acquire);
+        if (next) {
+            tail_ = next;
+            return tail;
+        }
+        return nullptr;
+    }
+};
@@ -0,0 +1,74 @@
+#pragma once
+#include <stddef.h>
+
+/*
+Intrusive FIFO of items that still have work to do and are waiting for their next turn of service.
+T must have the following members, which are owned by the RunQueue while the item is queued:
+    T* run_queue_prev;
+    T* run_queue_next;
+    bool is_in_run_queue;
+Pushing, popping and removing an arbitrary item are all O(1) and never allocate.
+*/
+template<typename T>
+class RunQueue {
+    T* head_;
+    T* tail_;
+    size_t size_;
+
+public:
+    RunQueue()
+        : head_(nullptr)
+        , tail_(nullptr)
+        , size_(0)
+    {}
+
+    bool Empty() const {
+        return 0 == size_;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    // No-op if item is already queued, so that it keeps its place in the queue.
+    void PushBack(T* const item) {
+        if ((!item) || item->is_in_run_queue) return;
+        item->run_queue_prev = tail_;
+        item->run_queue_next = nullptr;
+        if (tail_) {
+            tail_->run_queue_next = item;
+        }
+        else {
+            head_ = item;
+        }
+        tail_ = item;
+        item->is_in_run_queue = true;
+        ++size_;
+    }
+
+    T* PopFront() {
+        T* const item = head_;
+        Remove(item);
+        return item;
+    }
+
+    void Remove(T* const item) {
+        if ((!item) || (!item->is_in_run_queue)) return;
+        if (item->run_queue_prev) {
+            item->run_queue_prev->run_queue_next = item->run_queue_next;
+        }
+        else {
+            head_ = item->run_queue_next;
+        }
+        if (item->run_queue_next) {
+            item->run_queue_next->run_queue_prev = item->run_queue_prev;
+        }
+        else {
+            tail_ = item->run_queue_prev;
+        }
+        item->run_queue_prev = nullptr;
+        item->run_queue_next = nullptr;
+        item->is_in_run_queue = false;
+        --size_;
+    }
+};
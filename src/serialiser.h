@@ -5,64 +5,205 @@
 #include <mutex>
 #include <condition_variable>
 #include <string.h>
+#include <memory>
+#include <limits.h>
+#include <sys/uio.h>
 
 /*
-Collects bytes into a single vector and serialises them out into a stream_writer, possibly over many batches.
-"Append" methods collects bytes to be serialised.
-Serialise(...) can be called repeatedly to sequentially serialise the collected bytes out into a stream_writer.
+A fixed-size block of bytes that frames are copied into for serialisation.
+The bytes are left uninitialised: nothing is ever zero-filled.
+next: only used by the SerialiserChunkPool free list.
 */
-class Serialiser {
-    std::vector<char> buffer_;
-    size_t num_serialised_;
-    size_t num_populated_;
+struct SerialiserChunk {
+    static const size_t Capacity = 4096;
+
+    SerialiserChunk* next;
+    char bytes[Capacity];
+};
+
+/*
+Free list of SerialiserChunks, one per thread, shared by all the serialisers used on that thread.
+A serialiser hands its chunks back as soon as they have been serialised, so idle sessions hold no chunks at all,
+and a burst on one session reuses the chunks another session has just finished with.
+At most MaxNumSpareChunks are kept; the rest are freed.
+*/
+class SerialiserChunkPool {
+    SerialiserChunk* spare_chunks_;
+    size_t num_spare_chunks_;
+
+    SerialiserChunkPool()
+        : spare_chunks_(nullptr)
+        , num_spare_chunks_(0)
+    {}
 
-    char const * UnserialisedStartPtr() const {
-        if (num_serialised_ < buffer_.size()) {
-            return &buffer_[num_serialised_];
+public:
+    static const size_t MaxNumSpareChunks = 1024;
+
+    ~SerialiserChunkPool() {
+        while (spare_chunks_) {
+            SerialiserChunk* const chunk = spare_chunks_;
+            spare_chunks_ = chunk->next;
+            delete chunk;
+        }
+    }
+
+    static SerialiserChunkPool& ForThisThread() {
+        thread_local SerialiserChunkPool pool;
+        return pool;
+    }
+
+    SerialiserChunk* Get() {
+        SerialiserChunk* chunk = spare_chunks_;
+        if (chunk) {
+            spare_chunks_ = chunk->next;
+            --num_spare_chunks_;
+        }
+        else {
+            chunk = new SerialiserChunk;
         }
-        return nullptr;
+        chunk->next = nullptr;
+        return chunk;
     }
 
-    bool ResetIfHasSerialisedAll() {
-        if (HasSerialisedAll()) {
-            Reset();
-            return true;
+    void Put(SerialiserChunk* const chunk) {
+        if (num_spare_chunks_ >= MaxNumSpareChunks) {
+            delete chunk;
+            return;
         }
-        return false;
+        chunk->next = spare_chunks_;
+        spare_chunks_ = chunk;
+        ++num_spare_chunks_;
     }
+};
+
+/*
+A run of bytes queued for serialisation: ptr[begin, end) is what is still to be serialised.
+Either a SerialiserChunk that frames were copied into (chunk is set, and end is where the next copy goes),
+or a frame appended by reference (chunk is nullptr), kept alive by owner until it has been serialised.
+*/
+struct SerialiserSegment {
+    char const* ptr;
+    size_t begin;
+    size_t end;
+    SerialiserChunk* chunk;
+    std::shared_ptr<const void> owner;
+};
+
+/*
+Queues bytes as a sequence of segments and serialises them out into a stream_writer, possibly over many batches.
+"Append" methods collects bytes to be serialised.
+Serialise(...) can be called repeatedly to sequentially serialise the collected bytes out into a stream_writer, 
+one contiguous segment per WriteStream call. SerialiseV(...) does the same with a single WriteStreamV call 
+that gathers up to IOV_MAX segments, e.g. one writev for everything a session has pending.
 
-    size_t NumBytesLeftToSerialise() const {
-        if (num_serialised_ < num_populated_) {
-            return num_populated_ - num_serialised_;
+AppendFrame(...) copies small frames into chunks: appending never moves bytes already collected, it fills the last 
+chunk and chains new ones as needed. AppendFrameRef(...) queues a (large) frame by reference instead, 
+so that it is never copied, e.g. one broadcast frame shared by every session.
+
+A chunk goes back to the SerialiserChunkPool as soon as it has been serialised, so the memory held by a slow session 
+is bounded by what it has in flight (rounded up to whole chunks), however long it has been lagging.
+A segment only partly serialised keeps its cursor (begin) until the next call.
+*/
+class Serialiser {
+    // Segments before head_ have been serialised. Compacted once the serialised ones outnumber the rest.
+    std::vector<SerialiserSegment> segments_;
+    size_t head_;
+    size_t num_chunks_;
+    size_t num_bytes_pending_;
+
+    Serialiser(const Serialiser&) = delete;
+    Serialiser& operator=(const Serialiser&) = delete;
+
+    void PopHead() {
+        SerialiserSegment& segment = segments_[head_];
+        if (segment.chunk) {
+            SerialiserChunkPool::ForThisThread().Put(segment.chunk);
+            segment.chunk = nullptr;
+            --num_chunks_;
+        }
+        segment.owner.reset();
+        ++head_;
+
+        if (head_ == segments_.size()) {
+            segments_.clear();
+            head_ = 0;
+        }
+        else if (head_ > (segments_.size() - head_)) {
+            segments_.erase(segments_.begin(), segments_.begin() + head_);
+            head_ = 0;
         }
-        return 0;
     }
 
 public:
-    Serialiser() {
+    // Frames at least this long are worth an iovec of their own; shorter ones are cheaper to copy.
+    static const size_t MinBytesToAppendByRef = 512;
+
+    // Marks n bytes from the head as serialised, e.g. after writing out what GatherPending(...) gathered.
+    void Consume(size_t n) {
+        num_bytes_pending_ -= n;
+        while (n > 0) {
+            SerialiserSegment& segment = segments_[head_];
+            const size_t num_bytes_in_segment = segment.end - segment.begin;
+            if (n < num_bytes_in_segment) {
+                segment.begin += n;
+                return;
+            }
+            n -= num_bytes_in_segment;
+            PopHead();
+        }
+        // A segment drained exactly by the last write.
+        if ((head_ < segments_.size()) && (segments_[head_].begin == segments_[head_].end)) {
+            PopHead();
+        }
+    }
+
+    Serialiser()
+        : head_(0)
+        , num_chunks_(0)
+        , num_bytes_pending_(0)
+    {}
+
+    ~Serialiser() {
         Reset();
     }
 
     bool HasSerialisedAll() const {
-        assert(num_serialised_ <= num_populated_);
-        return num_serialised_ == num_populated_;
+        return 0 == num_bytes_pending_;
     }
 
     void Reset() {
-        num_serialised_ = 0;
-        num_populated_ = 0;
+        while (head_ < segments_.size()) {
+            PopHead();
+        }
+        num_bytes_pending_ = 0;
+    }
+
+    // Occupancy: bytes collected but not yet serialised, and the chunk memory holding the copied ones.
+    size_t NumBytesPending() const {
+        return num_bytes_pending_;
+    }
+
+    size_t NumBytesHeld() const {
+        return num_chunks_ * SerialiserChunk::Capacity;
     }
 
     void AppendFrame(char const* const frame_ptr, const size_t n) {
         if (!(frame_ptr && n)) return;
 
-        const size_t N = buffer_.size();
-        const size_t new_num_populated = num_populated_ + n;
-        if (N < new_num_populated) {
-            buffer_.resize(new_num_populated);
+        size_t num_appended = 0;
+        while (num_appended < n) {
+            if ((head_ == segments_.size()) || (!segments_.back().chunk) || (SerialiserChunk::Capacity == segments_.back().end)) {
+                SerialiserChunk* const chunk = SerialiserChunkPool::ForThisThread().Get();
+                segments_.push_back(SerialiserSegment{ chunk->bytes, 0, 0, chunk, nullptr });
+                ++num_chunks_;
+            }
+            SerialiserSegment& tail = segments_.back();
+            const size_t num_to_copy = (std::min)(n - num_appended, SerialiserChunk::Capacity - tail.end);
+            memcpy(&tail.chunk->bytes[tail.end], frame_ptr + num_appended, num_to_copy);
+            tail.end += num_to_copy;
+            num_appended += num_to_copy;
         }
-        memcpy(&buffer_[num_populated_], frame_ptr, n);
-        num_populated_ += n;
+        num_bytes_pending_ += n;
     }
 
     template<typename Frame>
@@ -70,24 +211,77 @@ public:
         AppendFrame((char const* const)(&frame), sizeof(frame));
     }
 
+    // Queues a copy of bytes ahead of everything pending, e.g. the rest of a frame that is being sent from elsewhere
+    // and has to be finished before anything else goes out.
+    void PrependBytes(char const* const ptr, const size_t n) {
+        if (!(ptr && n)) return;
+        const std::shared_ptr<std::vector<char>> copy = std::make_shared<std::vector<char>>(ptr, ptr + n);
+        segments_.insert(segments_.begin() + head_, SerialiserSegment{ &(*copy)[0], 0, n, nullptr, copy });
+        num_bytes_pending_ += n;
+    }
+
+    // Queues frame_ptr[0, n) without copying it (unless it is shorter than MinBytesToAppendByRef). 
+    // owner must keep those bytes alive and unchanged; the serialiser holds on to it until they have been serialised.
+    void AppendFrameRef(char const* const frame_ptr, const size_t n, const std::shared_ptr<const void>& owner) {
+        if (!(frame_ptr && n)) return;
+        if (n < MinBytesToAppendByRef) {
+            AppendFrame(frame_ptr, n);
+            return;
+        }
+        segments_.push_back(SerialiserSegment{ frame_ptr, 0, n, nullptr, owner });
+        num_bytes_pending_ += n;
+    }
+
+    // Fills iov with up to max_iov segments, covering at most max_bytes from the head. Returns the number of iovecs filled.
+    size_t GatherPending(iovec* const iov, const size_t max_iov, const size_t max_bytes, size_t& num_bytes_gathered) const {
+        size_t n = 0;
+        num_bytes_gathered = 0;
+        for (size_t i = head_; (i < segments_.size()) && (n < max_iov) && (num_bytes_gathered < max_bytes); ++i) {
+            const SerialiserSegment& segment = segments_[i];
+            const size_t num_bytes = (std::min)(segment.end - segment.begin, max_bytes - num_bytes_gathered);
+            if (0 == num_bytes) continue;
+            iov[n].iov_base = const_cast<char*>(segment.ptr + segment.begin);
+            iov[n].iov_len = num_bytes;
+            num_bytes_gathered += num_bytes;
+            ++n;
+        }
+        return n;
+    }
+
+    // Hands the stream_writer one segment at a time, until max_bytes_to_serialise have been serialised, 
+    // or the stream_writer takes less than it was offered (e.g. the socket would block).
+    // StreamWriter: Functor signature: (const char * const stream_ptr, const size_t num_bytes_to_serialise, size_t& num_bytes_serialised);
     template<typename StreamWriter>
     size_t Serialise(StreamWriter& stream_writer, const size_t max_bytes_to_serialise) {
         size_t num_bytes_serialised = 0;
-        const size_t num_bytes_to_serialise = (std::min)(max_bytes_to_serialise, NumBytesLeftToSerialise());
-        
-        if (num_bytes_to_serialise > 0) {
-            char const * const stream_ptr = UnserialisedStartPtr();
-            if (stream_ptr) {
-                stream_writer.WriteStream(stream_ptr, num_bytes_to_serialise, num_bytes_serialised);
-                if (num_bytes_serialised > 0) {
-                    num_serialised_ += num_bytes_serialised;
-                    ResetIfHasSerialisedAll();
-                }
-            }
+        while ((head_ < segments_.size()) && (num_bytes_serialised < max_bytes_to_serialise)) {
+            const SerialiserSegment& segment = segments_[head_];
+            const size_t num_bytes_to_serialise = (std::min)(max_bytes_to_serialise - num_bytes_serialised, segment.end - segment.begin);
+            size_t num_bytes_serialised_this_time = 0;
+            stream_writer.WriteStream(segment.ptr + segment.begin, num_bytes_to_serialise, num_bytes_serialised_this_time);
+
+            Consume(num_bytes_serialised_this_time);
+            num_bytes_serialised += num_bytes_serialised_this_time;
+            if (num_bytes_serialised_this_time < num_bytes_to_serialise) break;
         }
         
         return num_bytes_serialised;
     }
+
+    // Serialises up to max_bytes_to_serialise with a single gathering write.
+    // StreamWriter: Functor signature: WriteStreamV(const iovec* const iov, const int iovcnt, size_t& num_bytes_serialised);
+    template<typename StreamWriter>
+    size_t SerialiseV(StreamWriter& stream_writer, const size_t max_bytes_to_serialise) {
+        iovec iov[IOV_MAX];
+        size_t num_bytes_gathered = 0;
+        const size_t iovcnt = GatherPending(iov, IOV_MAX, max_bytes_to_serialise, num_bytes_gathered);
+        if (0 == iovcnt) return 0;
+
+        size_t num_bytes_serialised = 0;
+        stream_writer.WriteStreamV(iov, static_cast<int>(iovcnt), num_bytes_serialised);
+        Consume(num_bytes_serialised);
+        return num_bytes_serialised;
+    }
 };
 
 struct BooleanConditionVariable {
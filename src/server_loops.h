@@ -0,0 +1,117 @@
+#pragma once
+#include <vector>
+#include <memory>
+#include <thread>
+#include <string_view>
+#include <functional>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "config.h"
+#include "logging.h"
+#include "socket_utils.h"
+#include "console_input_loop.h"
+#include "worker_pool.h"
+#include "topic_index.h"
+#include "wire_format.h"
+
+// With is_keyed (--conflate-console-input), each line is a keyed broadcast, keyed by its first word.
+// With is_published (--publish-console-input), each line is instead published to the topic named by its first word,
+// and only goes to that topic's subscribers.
+template<typename Server>
+struct AppendConsoleInputToServerSerialiser {
+    std::vector<std::unique_ptr<Server>>& servers;
+    TopicBus& topic_bus;
+    const bool is_keyed;
+    const bool is_published;
+    AppendConsoleInputToServerSerialiser(std::vector<std::unique_ptr<Server>>& servers, TopicBus& topic_bus, const bool is_keyed, const bool is_published) 
+        : servers(servers) 
+        , topic_bus(topic_bus)
+        , is_keyed(is_keyed)
+        , is_published(is_published)
+    {}
+
+    bool HandleFrame(char const* const frame_ptr, const size_t n) {
+        if (is_published) {
+            const std::string_view line(frame_ptr + sizeof(Header), n - sizeof(Header));
+            const size_t topic_end = line.find(' ');
+            const std::string_view topic = line.substr(0, topic_end);
+            if (topic.empty()) return true;
+            const std::string_view payload = (std::string_view::npos == topic_end) ? std::string_view() : line.substr(topic_end + 1);
+            const std::vector<char> v1_frame = MakePublishFrame(WireVersion_1, topic, payload);
+            topic_bus.Publish(&v1_frame[0], v1_frame.size());
+            return true;
+        }
+        if (is_keyed) {
+            const std::string_view line(frame_ptr + sizeof(Header), n - sizeof(Header));
+            const uint64_t conflation_key = std::hash<std::string_view>()(line.substr(0, line.find(' ')));
+            for (auto& server_ptr : servers) {
+                server_ptr->AppendAndSerialiseFrameToAllSessions(frame_ptr, n, conflation_key);
+            }
+            return true;
+        }
+        for (auto& server_ptr : servers) {
+            server_ptr->AppendAndSerialiseFrameToAllSessions(frame_ptr, n);
+        }
+        return true;
+    }
+};
+
+/*
+Runs config.num_loop_threads independent server loops (reactors) plus the console input loop that broadcasts to all of them.
+With config.num_worker_threads, a WorkerPool is shared by all the loops, and so is a TopicBus, through which publishes reach them.
+Server: constructible from (const int fd_listening, const EpollServerConfig&, WorkerPool* const, TopicBus&), and has Run() and 
+AppendAndSerialiseFrameToAllSessions(char const* const frame_ptr, const size_t n), 
+and its overload taking a uint64_t conflation_key.
+*/
+template<typename Server>
+void RunServerLoops(const EpollServerConfig& config) {
+    log::PrintLn(log::Info, "Running server, listening on port %u with %zu loop thread(s)", config.listening_port, config.num_loop_threads);
+
+    // Each loop gets its own listening socket bound to the same port. 
+    // With SO_REUSEPORT, the kernel distributes incoming connections amongst them.
+    const bool should_reuse_port = config.num_loop_threads > 1;
+    // Declared before the servers, which post to it until they are gone.
+    TopicBus topic_bus;
+    std::vector<std::unique_ptr<Server>> servers;
+    // Declared after the servers, so that the workers have stopped posting to them before they go.
+    const std::unique_ptr<WorkerPool> worker_pool(config.num_worker_threads ? new WorkerPool(config.num_worker_threads) : nullptr);
+    for (size_t i = 0; i < config.num_loop_threads; ++i) {
+        int fd_listening = -1;
+        if (!CreateAndListenOnNonBlockingSocket(config.listening_port, config.listening_backlog, fd_listening, should_reuse_port)) {
+            log::PrintLn(log::Error, "Failed to listen on port %u for loop %zu of %zu", config.listening_port, i, config.num_loop_threads);
+            return;
+        }
+        servers.push_back(std::make_unique<Server>(fd_listening, config, worker_pool.get(), topic_bus));
+    }
+
+    AppendConsoleInputToServerSerialiser<Server> append_console_input_to_server_serialiser(servers, topic_bus, config.is_console_input_keyed, config.is_console_input_published);
+    // Written once the loops have exited, to stop the console loop, which must not outlive the servers it appends to.
+    const int fd_console_stop = eventfd(0, EFD_CLOEXEC);
+    if (fd_console_stop < 0) {
+        log::PrintLnCurrentErrno(log::Error, "Failed to create console stop eventfd. Console input is disabled");
+    }
+    std::thread gui_thread;
+    if (fd_console_stop >= 0) {
+        gui_thread = std::thread(RunConsoleInputLoop<AppendConsoleInputToServerSerialiser<Server>>, std::ref(append_console_input_to_server_serialiser), fd_console_stop);
+    }
+
+    std::vector<std::thread> loop_threads;
+    for (size_t i = 1; i < servers.size(); ++i) {
+        loop_threads.emplace_back(&Server::Run, servers[i].get());
+    }
+    // The first loop runs on the calling thread.
+    servers[0]->Run();
+
+    for (auto& loop_thread : loop_threads) {
+        loop_thread.join();
+    }
+
+    if (fd_console_stop >= 0) {
+        const uint64_t one = 1;
+        if (write(fd_console_stop, &one, sizeof(one)) < 0) {
+            log::PrintLnCurrentErrno(log::Error, "Failed to stop the console loop");
+        }
+        gui_thread.join();
+        close(fd_console_stop);
+    }
+}
@@ -1,31 +1,90 @@
 #include "session.h"
 #include "logging.h"
 
-Session::Session(const int fd, const size_t read_threshold, const size_t write_threshold)
+template<typename Policy>
+BasicSession<Policy>::BasicSession(const int fd, const size_t read_threshold, const size_t write_threshold)
     : fd(fd)
+    , generation(0)
     , socket_reader(fd, &io_benchmark)
     , read_threshold(read_threshold)
     , socket_writer(fd, &io_benchmark)
     , write_threshold(write_threshold)
+    , broadcast_cursor(0)
     , ack_maker_and_serialiser(serialiser, io_benchmark)
+    , run_queue_prev(nullptr)
+    , run_queue_next(nullptr)
+    , is_in_run_queue(false)
+    , liveness_timer(SessionTimer_Liveness, this)
+    , write_deadline_timer(SessionTimer_WriteDeadline, this)
+    , ack_delay_timer(SessionTimer_AckDelay, this)
+    , last_read_tick(0)
 {
+    ResetScheduling();
     log::PrintLn(log::Debug, "NEW Session:%p", (void*)this);
 }
 
-Session::~Session() {
+template<typename Policy>
+BasicSession<Policy>::~BasicSession() {
     log::PrintLn(log::Debug, "DEL Session:%p", (void*)this);
 }
 
-void Session::Reset() {
+template<typename Policy>
+void BasicSession<Policy>::Reset() {
     fd = -1;
+    ++generation;
 
     serialiser.Reset();
     socket_writer.Reset();
+    broadcast_cursor = 0;
+    conflating_queue.Reset();
 
     deserialiser.Reset();
     socket_reader.Reset();
+    ack_maker_and_serialiser.Reset();
+
+    ResetScheduling();
+}
+
+template<typename Policy>
+void BasicSession<Policy>::ResetScheduling() {
+    // A freshly connected socket has nothing to read yet, but can be written to.
+    is_readable = false;
+    is_writable = true;
+    is_read_paused = false;
+    is_peer_shut_down = false;
+    was_last_read_full = false;
+    receive_low_watermark = 1;
+    read_deficit = 0;
+    write_deficit = 0;
 }
 
-bool Session::IsValid() const {
+template<typename Policy>
+bool BasicSession<Policy>::IsValid() const {
     return -1 != fd;
 }
+
+void AnswerHello(Session& session, BroadcastLogs& broadcast_logs) {
+    AckMakerAndSerialiser<Serialiser, IOBenchmark>& ack_maker = session.ack_maker_and_serialiser;
+    const WireVersion agreed = ack_maker.hello_wire_version;
+    const WireVersion current = ack_maker.wire_version;
+    ack_maker.hello_wire_version = WireVersion_Unknown;
+    if (WireVersion_1 != current) {
+        log::PrintLn(log::Info, "%d|Ignoring Hello: already speaking wire v%u", session.fd, unsigned(current));
+        return;
+    }
+
+    if (agreed != current) {
+        TakeBroadcasts(session.serialiser, broadcast_logs.Of(current), session.broadcast_cursor);
+        broadcast_logs.Leave(current, session.broadcast_cursor);
+        session.conflating_queue.MoveTo(session.serialiser, SIZE_MAX);
+    }
+    AppendMsg(session.serialiser, WireVersion_1, Hello(agreed));
+    if (agreed != current) {
+        ack_maker.SetWireVersion(agreed);
+        session.broadcast_cursor = broadcast_logs.Join(agreed);
+    }
+}
+
+// The only two kinds of session there are.
+template struct BasicSession<SingleOwnerSessionPolicy>;
+template struct BasicSession<SynchronisedSessionPolicy>;
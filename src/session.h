@@ -1,6 +1,7 @@
 #pragma once
-#include <map>
-#include <mutex>
+#include <vector>
+#include <memory>
+#include <stdint.h>
 #include "config.h"
 #include "length_prefixed_stream_deserialiser.h"
 #include "serialiser.h"
@@ -11,81 +12,202 @@
 #include "ack_maker_and_serialiser.h"
 #include "io_benchmark.h"
 #include "socket_utils.h"
+#include "timer_wheel.h"
+#include "conflating_queue.h"
+#include "wire_format.h"
+#include "broadcast_log.h"
+
+// What a Session's TimerNode is for (TimerNode::kind).
+enum SessionTimer {
+    SessionTimer_Liveness,
+    SessionTimer_WriteDeadline,
+    SessionTimer_AckDelay,
+};
+
+/*
+What a session is made of depends on how many threads touch it:
+SingleOwnerSessionPolicy: for sessions serviced entirely by one server loop thread. Nothing is locked.
+SynchronisedSessionPolicy: for the client, whose reader, writer and console threads share one session.
+*/
+struct SingleOwnerSessionPolicy {
+    typedef IOBenchmark IOBenchmarkType;
+    typedef Serialiser SerialiserType;
+};
+
+struct SynchronisedSessionPolicy {
+    typedef ThreadSafeIOBenchmark IOBenchmarkType;
+    typedef WaitableSerialiser SerialiserType;
+};
+
+template<typename Policy>
+struct BasicSession {
+    typedef typename Policy::IOBenchmarkType IOBenchmarkType;
+    typedef typename Policy::SerialiserType SerialiserType;
 
-struct Session {
     int fd;
+    // Bumped every time the session is Reset, i.e. every time its connection is closed.
+    uint32_t generation;
 
-    ThreadSafeIOBenchmark io_benchmark;
+    IOBenchmarkType io_benchmark;
 
-    LengthPrefixedStreamDeserialiser<size_t> deserialiser;
-    SocketReader<ThreadSafeIOBenchmark> socket_reader;
+    // Decodes in whichever wire version the peer's Hello agreed on (v1 until then).
+    LengthPrefixedStreamDeserialiser<NegotiatedHeaderPolicy> deserialiser;
+    SocketReader<IOBenchmarkType> socket_reader;
     const size_t read_threshold;
 
-    WaitableSerialiser serialiser;
-    SocketWriter<ThreadSafeIOBenchmark> socket_writer;
+    SerialiserType serialiser;
+    SocketWriter<IOBenchmarkType> socket_writer;
     const size_t write_threshold;
+    // Position in the owning loop's BroadcastLog (of the version the session sends in) of the next broadcast byte to send.
+    uint64_t broadcast_cursor;
+    // Keyed broadcasts, moved into the serialiser once it has sent everything else.
+    ConflatingQueue conflating_queue;
+
+    // Also holds the wire version the session sends in (ack_maker_and_serialiser.wire_version).
+    AckMakerAndSerialiser<SerialiserType, IOBenchmarkType> ack_maker_and_serialiser;
 
-    AckMakerAndSerialiser ack_maker_and_serialiser;
+    // Deficit-round-robin scheduling state, only touched by the epoll loop that owns the session.
+    // is_readable/is_writable: the socket may be read/written without blocking, as last reported by epoll or by our own I/O attempts.
+    // read_deficit/write_deficit: the bytes the session may still read/write in its current turn.
+    bool is_readable;
+    bool is_writable;
+    size_t read_deficit;
+    size_t write_deficit;
+    BasicSession* run_queue_prev;
+    BasicSession* run_queue_next;
+    bool is_in_run_queue;
+    // Reading is paused while the peer has too much waiting to be sent to it (see EpollServerConfig::high_watermark).
+    bool is_read_paused;
+    // The peer has shut down its side (EPOLLRDHUP): the session is read until a read returns 0 rather than until a short read,
+    // as no further readiness may be reported for whatever it sent before that.
+    bool is_peer_shut_down;
+    // Read sizing (see EpollServer::ReadSize): whether the last read got all it asked for, 
+    // and the SO_RCVLOWAT currently set on the socket.
+    bool was_last_read_full;
+    size_t receive_low_watermark;
 
-    Session(const int fd = -1, const size_t read_threshold = 1024, const size_t write_threshold = 1024);
-    ~Session();
+    // Timers on the owning loop's TimerWheel.
+    // ATTENTION: The loop must cancel them before the session is Reset for reuse.
+    // last_read_tick: wheel tick at which the peer last sent us anything.
+    TimerNode liveness_timer;
+    TimerNode write_deadline_timer;
+    TimerNode ack_delay_timer;
+    uint64_t last_read_tick;
+
+    BasicSession(const int fd = -1, const size_t read_threshold = 1024, const size_t write_threshold = 1024);
+    ~BasicSession();
 
     void Reset();
+    void ResetScheduling();
     bool IsValid() const;
 };
 
+// Server sessions, each owned by one loop thread.
+typedef BasicSession<SingleOwnerSessionPolicy> Session;
+// Client session, shared by the client's threads.
+typedef BasicSession<SynchronisedSessionPolicy> ClientSession;
+
+/*
+The sessions of one server loop: a slab of Session objects indexed directly by fd.
+A Session is created the first time its fd is used, and is then Reset and reused for every later connection that gets
+the same fd, keeping its warm buffers. So finding the session of an fd is a single load.
+
+Each reuse bumps Session::generation, and the tag MakeSessionTag(fd, generation) (stored e.g. in epoll_event.data.u64)
+names one particular connection, so that events or completions for an earlier connection on the same fd can be recognised.
+
+Single owner: only the loop thread may call into it (other threads go through the loop's LoopCommandQueue), so nothing is locked.
+*/
+inline uint64_t MakeSessionTag(const int fd, const uint32_t generation) {
+    return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
+}
+
+inline int SessionTagToFd(const uint64_t tag) {
+    return static_cast<int>(tag & 0xffffffff);
+}
+
 class Sessions {
-    std::map<int, std::unique_ptr<Session>> sessions_;
+    std::vector<std::unique_ptr<Session>> fd_to_session_;
+    size_t num_sessions_;
+    size_t num_connected_;
     const EpollServerConfig& config_;
-    mutable std::mutex mutex_;
 public:
-    Sessions(const EpollServerConfig& config) : config_(config) {}
+    Sessions(const EpollServerConfig& config) 
+        : num_sessions_(0)
+        , num_connected_(0)
+        , config_(config) 
+    {
+        fd_to_session_.reserve(config_.listening_backlog);
+    }
     
     bool Add(const int fd) {
         Session* session_ptr = nullptr;
         return Add(fd, session_ptr);
     }
 
+    // Returns true if a new Session object had to be created for fd.
     bool Add(const int fd, Session*& session_ptr) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        auto it = sessions_.find(fd);
-        const bool should_add_new = (sessions_.end() == it);
+        session_ptr = nullptr;
+        if (fd < 0) return false;
+        
+        if (static_cast<size_t>(fd) >= fd_to_session_.size()) {
+            fd_to_session_.resize(fd + 1);
+        }
+        std::unique_ptr<Session>& slot = fd_to_session_[fd];
+        const bool should_add_new = !slot;
         if (should_add_new) {
-            it = sessions_.insert(std::make_pair(fd, std::make_unique<Session>(fd, config_.read_threshold, config_.write_threshold))).first;
+            slot = std::make_unique<Session>(fd, config_.read_threshold, config_.write_threshold);
+            slot->deserialiser.SetFrameSizeLimits(config_.max_frame_size, config_.stream_frame_threshold);
+            ++num_sessions_;
+            ++num_connected_;
         }
         
-        session_ptr = it->second.get();
+        session_ptr = slot.get();
         if (!session_ptr->IsValid()) {
             session_ptr->fd = fd;
+            ++num_connected_;
         }
 
         return should_add_new;
     }
 
+    // The session object of fd, whether or not it is currently connected, or nullptr if fd has never been used.
+    Session* Find(const int fd) const {
+        if ((fd < 0) || (static_cast<size_t>(fd) >= fd_to_session_.size())) return nullptr;
+        return fd_to_session_[fd].get();
+    }
+
+    // The connected session named by tag, or nullptr if that connection has since been closed.
+    Session* FindByTag(const uint64_t tag) const {
+        Session* const session_ptr = Find(SessionTagToFd(tag));
+        if ((!session_ptr) || (!session_ptr->IsValid()) || (MakeSessionTag(session_ptr->fd, session_ptr->generation) != tag)) return nullptr;
+        return session_ptr;
+    }
+
     void Clear() {
-        std::lock_guard<std::mutex> lock(mutex_);
-        sessions_.clear();
+        fd_to_session_.clear();
+        num_sessions_ = 0;
+        num_connected_ = 0;
     }
 
+    // Session objects created so far, connected or not.
     size_t Size() const {
-        std::lock_guard<std::mutex> lock(mutex_);
-        return sessions_.size();
+        return num_sessions_;
+    }
+
+    size_t NumConnected() const {
+        return num_connected_;
     }
 
     void Remove(const int fd) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        auto it = sessions_.find(fd);
-        if (sessions_.end() != it) {
-            Session * session_ptr = it->second.get();
-            if (session_ptr) {
-                // ATTENTION: We reuse session objects by Reset-ing them instead of sessions_.erase(fd);
-                session_ptr->Reset();
-            }
+        Session* const session_ptr = Find(fd);
+        if (session_ptr && session_ptr->IsValid()) {
+            // ATTENTION: We reuse session objects by Reset-ing them instead of freeing them.
+            --num_connected_;
+            session_ptr->Reset();
         }
     }
     
     Session& Get(const int fd) {
-        std::lock_guard<std::mutex> lock(mutex_);
         Session* session_ptr = nullptr;
         Add(fd, session_ptr);
         return *session_ptr;
@@ -93,19 +215,51 @@ public:
 
     template<typename FdAndSessionPtrHandler>
     void ForEachDo(FdAndSessionPtrHandler& fd_and_session_ptr_handler) {
-        std::lock_guard<std::mutex> lock(mutex_);
-        for (const auto& [fd, session_ptr] : sessions_) {
-            fd_and_session_ptr_handler.HandleFdAndSessionPtr(fd, session_ptr.get());
+        for (size_t fd = 0; fd < fd_to_session_.size(); ++fd) {
+            Session* const session_ptr = fd_to_session_[fd].get();
+            if (session_ptr) {
+                fd_and_session_ptr_handler.HandleFdAndSessionPtr(static_cast<int>(fd), session_ptr);
+            }
         }
     }
 };
 
+// The log a session's broadcast_cursor is in: that of the version it sends in.
+inline BroadcastLog& BroadcastLogOf(BroadcastLogs& broadcast_logs, const Session& session) {
+    return broadcast_logs.Of(session.ack_maker_and_serialiser.wire_version);
+}
+
+// Neither the session's own frames nor any broadcast (keyed or not) is waiting to be sent.
+inline bool HasSentAll(const Session& session, const BroadcastLog& broadcast_log) {
+    return session.serialiser.HasSerialisedAll() && (session.broadcast_cursor == broadcast_log.End()) && session.conflating_queue.Empty();
+}
+
+// The session's own frames plus the broadcasts (keyed or not) it has yet to send.
+inline size_t NumBytesToSend(const Session& session, const BroadcastLog& broadcast_log) {
+    return session.serialiser.NumBytesPending() + broadcast_log.Lag(session.broadcast_cursor) + session.conflating_queue.NumBytes();
+}
+
+/*
+For a server loop, once the session's deserialiser has handed out a Hello (ack_maker_and_serialiser.hello_wire_version 
+is set): answers it and moves the session to the version it agrees on (see wire_format.h).
+- whatever the session had queued in the old version (broadcasts, keyed or not) is copied into its serialiser first, 
+  so that it goes out ahead of the answer,
+- the answer is a Hello in v1, as the peer's Hello was,
+- from then on the session's Acks, HeartBeats and broadcasts (from the log of the new version) are in the new version.
+A Hello from a session that has already moved on is ignored. 
+The deserialiser switches on its own, right after the Hello, and stops there: the caller deserialises whatever followed it.
+*/
+void AnswerHello(Session&, BroadcastLogs&);
+
 template<typename Deserialiser, typename StreamReader, typename FrameHandler>
-SocketIOStatus GetDataThenDeserialise(Deserialiser& deserialiser, StreamReader& stream_reader, const size_t read_threshold, FrameHandler& frame_handler) {
+SocketIOStatus GetDataThenDeserialise(Deserialiser& deserialiser, StreamReader& stream_reader, const size_t read_threshold, FrameHandler& frame_handler, size_t* const num_frames_ptr = 0) {
     deserialiser.AppendStream(stream_reader, read_threshold);
 
     const SocketIOStatus e = SummariseSocketIOStatus(read_threshold, stream_reader.last_status, stream_reader.last_errno);
 
-    deserialiser.Deserialise(frame_handler);
+    const size_t num_frames = deserialiser.Deserialise(frame_handler);
+    if (num_frames_ptr) {
+        *num_frames_ptr = num_frames;
+    }
     return e;
 }
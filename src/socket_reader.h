@@ -7,12 +7,14 @@ struct SocketReader {
     const int fd;
     int last_status;
     int last_errno;
+    size_t num_calls;
     Benchmark* const benchmark_ptr;
 
     SocketReader(const int fd, Benchmark* const benchmark_ptr = nullptr)
         : fd(fd)
         , last_status(0)
         , last_errno(0)
+        , num_calls(0)
         , benchmark_ptr(benchmark_ptr)
     {}
 
@@ -32,6 +34,7 @@ struct SocketReader {
             benchmark_ptr->SetLastPreInTime();
         }
 
+        ++num_calls;
         last_status = ::read(fd, p, num_bytes_to_read);
 
         if (benchmark_ptr) {
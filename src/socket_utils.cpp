@@ -5,13 +5,14 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
 #include <stdio.h>
 
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
-bool BindOrConnect(char const * const hostname, const unsigned short port, const bool should_bind_instead_of_connect, int& fd) {
+bool BindOrConnect(char const * const hostname, const unsigned short port, const bool should_bind_instead_of_connect, int& fd, const bool should_reuse_port) {
     fd = -1;
     char port_as_string[16] = { 0 };
     snprintf(port_as_string, sizeof(port_as_string), "%u", port);
@@ -40,6 +41,14 @@ bool BindOrConnect(char const * const hostname, const unsigned short port, const
             continue;
 
         if (should_bind_instead_of_connect) {
+            if (should_reuse_port) {
+                const int option_value = 1;
+                if (SetSocketOption(interface_fd, SO_REUSEPORT, option_value, SOL_SOCKET) < 0) {
+                    log::PrintLnCurrentErrno(log::Error, "%d|Failed to set SO_REUSEPORT", interface_fd);
+                    close(interface_fd);
+                    continue;
+                }
+            }
             const int e_bind = bind(interface_fd, interface->ai_addr, interface->ai_addrlen);
             if (0 == e_bind) {
                 fd = interface_fd;
@@ -68,9 +77,9 @@ int SetNoBlocking(const int fd) {
     return e;
 }
 
-int CreateNonBlockingListeningFd(const unsigned short listening_port) {
+int CreateNonBlockingListeningFd(const unsigned short listening_port, const bool should_reuse_port) {
     int fd_listening = -1;
-    if (!BindOrConnect(nullptr, listening_port, true, fd_listening)) {
+    if (!BindOrConnect(nullptr, listening_port, true, fd_listening, should_reuse_port)) {
         log::PrintLnCurrentErrno(log::Error, "Failed bind to port %d", listening_port);
         close(fd_listening);
     }
@@ -85,8 +94,8 @@ int CreateNonBlockingListeningFd(const unsigned short listening_port) {
     return fd_listening;
 }
 
-bool CreateAndListenOnNonBlockingSocket(const unsigned short listening_port, const int listening_backlog, int& fd_listening) {
-    fd_listening = CreateNonBlockingListeningFd(listening_port);
+bool CreateAndListenOnNonBlockingSocket(const unsigned short listening_port, const int listening_backlog, int& fd_listening, const bool should_reuse_port) {
+    fd_listening = CreateNonBlockingListeningFd(listening_port, should_reuse_port);
     if (fd_listening < 0) {
         log::PrintLnCurrentErrno(log::Error, "Failed to create listening port on %d", listening_port);
         return false;
@@ -173,6 +182,16 @@ int DisableNaglesAlgorithm(const int fd) {
     const int option_value = 1;
     return SetSocketOption(fd, TCP_NODELAY, option_value);
 }
+
+int NumBytesReadable(const int fd) {
+    int num_bytes = 0;
+    if (ioctl(fd, FIONREAD, &num_bytes) < 0) return -1;
+    return num_bytes;
+}
+
+int SetReceiveLowWatermark(const int fd, const int num_bytes) {
+    return SetSocketOption(fd, SO_RCVLOWAT, num_bytes, SOL_SOCKET);
+}
     
 SocketIOStatus SummariseSocketIOStatus(const int num_desired_io_bytes_passed_to_socket_api, const int socket_api_call_return_value, const int socket_api_call_errno) {
     if (socket_api_call_return_value < 0) {
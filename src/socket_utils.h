@@ -3,10 +3,12 @@
 #include <netinet/in.h>
 #include <netinet/ip.h>
 
-bool BindOrConnect(char const* const hostname, const unsigned short port, const bool should_bind_instead_of_connect, int& fd);
+// should_reuse_port: set SO_REUSEPORT before binding, so that several sockets can listen on the same port 
+// and have the kernel load-balance incoming connections across them.
+bool BindOrConnect(char const* const hostname, const unsigned short port, const bool should_bind_instead_of_connect, int& fd, const bool should_reuse_port = false);
 int SetNoBlocking(const int fd);
-int CreateNonBlockingListeningFd(const unsigned short listening_port);
-bool CreateAndListenOnNonBlockingSocket(const unsigned short listening_port, const int listening_backlog, int& fd_listening);
+int CreateNonBlockingListeningFd(const unsigned short listening_port, const bool should_reuse_port = false);
+bool CreateAndListenOnNonBlockingSocket(const unsigned short listening_port, const int listening_backlog, int& fd_listening, const bool should_reuse_port = false);
 
 // Returns number of characters correctly written, EXCLUDING null-terminator
 // events_string will contain the null-terminator if return value > 0.
@@ -14,6 +16,10 @@ int EpollEventToString(const uint32_t event, char* const events_string, const si
 void EpollEventsToString(const uint32_t events, char* const events_string, const size_t n);
 
 int DisableNaglesAlgorithm(const int fd);
+// Bytes waiting in the socket's receive queue (FIONREAD), or -1 on error.
+int NumBytesReadable(const int fd);
+// SO_RCVLOWAT: the socket is not reported readable until it holds at least num_bytes (or has hung up).
+int SetReceiveLowWatermark(const int fd, const int num_bytes);
 
 template<typename T>
 int SetSocketOption(const int fd, const int option, const T option_value, const int level = IPPROTO_TCP) {
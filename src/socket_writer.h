@@ -1,18 +1,21 @@
 #pragma once
 #include <unistd.h>
 #include <time.h>
+#include <sys/uio.h>
 
 template<typename Benchmark>
 struct SocketWriter {
     const int fd;
     int last_status;
     int last_errno;
+    size_t num_calls;
     Benchmark* const benchmark_ptr;
 
     SocketWriter(const int fd, Benchmark* const benchmark_ptr = nullptr)
         : fd(fd)
         , last_status(0)
         , last_errno(0)
+        , num_calls(0)
         , benchmark_ptr(benchmark_ptr)
     {}
 
@@ -29,6 +32,7 @@ struct SocketWriter {
             benchmark_ptr->SetLastPreOutTime();
         }
 
+        ++num_calls;
         last_status = write(fd, stream_ptr, num_bytes_to_serialise);
 
         if (benchmark_ptr) {
@@ -42,4 +46,25 @@ struct SocketWriter {
         }
         return false;
     }
+
+    // Gathering version of WriteStream: one writev for iovcnt buffers.
+    bool WriteStreamV(const iovec* const iov, const int iovcnt, size_t& num_bytes_serialised) {
+        if (benchmark_ptr) {
+            benchmark_ptr->SetLastPreOutTime();
+        }
+
+        ++num_calls;
+        last_status = writev(fd, iov, iovcnt);
+
+        if (benchmark_ptr) {
+            benchmark_ptr->SetLastPostOutTime();
+        }
+
+        last_errno = errno;
+        if (last_status > 0) {
+            num_bytes_serialised = last_status;
+            return true;
+        }
+        return false;
+    }
 };
@@ -10,6 +10,7 @@
 
 #include <iostream>
 #include <string>
+#include <string_view>
 #include "application_messages.h"
 #include <vector>
 #include <thread>
@@ -20,7 +21,7 @@ void CloseSocketAndNotifyShouldQuit(int& fd) {
     fd = -1;
 }
 
-bool RunReadLoop(Session& session) {
+bool RunReadLoop(ClientSession& session) {
     while (PeerHungUp != GetDataThenDeserialise
         ( session.deserialiser
         , session.socket_reader
@@ -29,12 +30,13 @@ bool RunReadLoop(Session& session) {
     {}
 
     log::PrintLn(log::Info, "Server hung up, closing socket and exiting read loop.");
+    session.io_benchmark.ReportRoundTrips(log::Info, "Round trips");
     CloseSocketAndNotifyShouldQuit(session.fd);
 
     return true;
 }
 
-bool RunWriteLoop(Session& session) {
+bool RunWriteLoop(ClientSession& session) {
     while (1) {
         session.serialiser.WaitSerialise(session.socket_writer, session.write_threshold);
         const SocketIOStatus e = SummariseSocketIOStatus(session.write_threshold, session.socket_writer.last_status, session.socket_writer.last_errno);
@@ -47,15 +49,78 @@ bool RunWriteLoop(Session& session) {
     return true;
 }
 
+// A console line that starts with "/sub ", "/unsub " or "/pub " as the message it stands for, in version:
+// "/sub TOPIC", "/unsub TOPIC" or "/pub TOPIC PAYLOAD". Empty for any other line.
+std::vector<char> ConsoleLineToTopicFrame(const std::string_view line, const WireVersion version) {
+    const size_t command_end = line.find(' ');
+    if ((std::string_view::npos == command_end) || ('/' != line[0])) return std::vector<char>();
+    const std::string_view command = line.substr(0, command_end);
+    const std::string_view rest = line.substr(command_end + 1);
+    if (rest.empty() || (' ' == rest[0])) return std::vector<char>();
+    if ("/sub" == command) return MakeTopicFrame(version, Subscribe::msg_type, rest);
+    if ("/unsub" == command) return MakeTopicFrame(version, Unsubscribe::msg_type, rest);
+    if ("/pub" == command) {
+        const size_t topic_end = rest.find(' ');
+        const std::string_view payload = (std::string_view::npos == topic_end) ? std::string_view() : rest.substr(topic_end + 1);
+        return MakePublishFrame(version, rest.substr(0, topic_end), payload);
+    }
+    return std::vector<char>();
+}
+
+// Console frames come in v1, and are re-encoded if another version has been agreed on.
+// Lines that stand for a topic message (see ConsoleLineToTopicFrame(...)) are sent as that message,
+// and "/stats" logs the round trip percentiles so far instead of being sent.
+// Each one's send time is recorded (before the reader can possibly see its Ack), for its round trip to be logged.
 struct TrySerialiseAsap {
     WaitableSerialiser& serialiser;
-    TrySerialiseAsap(WaitableSerialiser& serialiser) : serialiser(serialiser) {}
+    ThreadSafeIOBenchmark& io_benchmark;
+    const WireVersion wire_version;
+    TrySerialiseAsap(WaitableSerialiser& serialiser, ThreadSafeIOBenchmark& io_benchmark, const WireVersion wire_version) : serialiser(serialiser), io_benchmark(io_benchmark), wire_version(wire_version) {}
     bool HandleFrame(char const* const frame_ptr, const size_t n) {
-        serialiser.AppendFrame(frame_ptr, n);
+        const std::string_view line(frame_ptr + sizeof(Header), n - sizeof(Header));
+        if ("/stats" == line) {
+            io_benchmark.ReportRoundTrips(log::Info, "Round trips");
+            return true;
+        }
+        const std::vector<char> topic_frame = ConsoleLineToTopicFrame(line, wire_version);
+        io_benchmark.SetMsgSentTime();
+        if (!topic_frame.empty()) {
+            serialiser.AppendFrame(&topic_frame[0], topic_frame.size());
+        }
+        else if (WireVersion_1 == wire_version) {
+            serialiser.AppendFrame(frame_ptr, n);
+        }
+        else {
+            const std::vector<char> frame = ReencodeV1Frame(frame_ptr, n, wire_version);
+            serialiser.AppendFrame(&frame[0], frame.size());
+        }
         return true;
     }
 };
 
+// Offers the newest wire version with a Hello (see wire_format.h), and waits for the server's answer, 
+// before any other thread gets to send. Acks due in the meantime (e.g. of HeartBeats) are held until the answer is in.
+// Returns false if the server hung up.
+bool NegotiateWireVersion(ClientSession& session) {
+    AckMakerAndSerialiser<WaitableSerialiser, ThreadSafeIOBenchmark>& ack_maker = session.ack_maker_and_serialiser;
+    ack_maker.SetWireVersion(WireVersion_Unknown);
+    AppendMsg(session.serialiser, WireVersion_1, Hello(WireVersion_Newest));
+    while (!session.serialiser.HasSerialisedAll()) {
+        session.serialiser.Serialise(session.socket_writer, session.write_threshold);
+        if (PeerHungUp == SummariseSocketIOStatus(session.write_threshold, session.socket_writer.last_status, session.socket_writer.last_errno)) return false;
+    }
+
+    while (WireVersion_Unknown == ack_maker.hello_wire_version) {
+        if (PeerHungUp == GetDataThenDeserialise(session.deserialiser, session.socket_reader, session.read_threshold, ack_maker)) return false;
+    }
+    log::PrintLn(log::Info, "Speaking wire v%u", unsigned(ack_maker.hello_wire_version));
+    ack_maker.SetWireVersion(ack_maker.hello_wire_version);
+    ack_maker.hello_wire_version = WireVersion_Unknown;
+    // Whatever came after the answer, now that the deserialiser has switched to the agreed version.
+    session.deserialiser.Deserialise(ack_maker);
+    return true;
+}
+
 int RunTCPClient(const ClientConfig& config) {
     log::PrintLn(log::Info, "Running client connecting to %s:%u", config.hostname, config.remote_port);
     int fd = -1;
@@ -67,11 +132,17 @@ int RunTCPClient(const ClientConfig& config) {
     
     DisableNaglesAlgorithm(fd);
 
-    Session session(fd, config.read_threshold, config.write_threshold);
+    ClientSession session(fd, config.read_threshold, config.write_threshold);
     
-    TrySerialiseAsap try_serialise_asap(session.serialiser);
+    if (!NegotiateWireVersion(session)) {
+        log::PrintLn(log::Info, "Server hung up before answering Hello");
+        close(fd);
+        return -1;
+    }
+
+    TrySerialiseAsap try_serialise_asap(session.serialiser, session.io_benchmark, session.ack_maker_and_serialiser.wire_version);
 
-    std::thread gui_thread(RunConsoleInputLoop<TrySerialiseAsap>, std::ref(try_serialise_asap));
+    std::thread gui_thread(RunConsoleInputLoop<TrySerialiseAsap>, std::ref(try_serialise_asap), -1);
     std::thread reader_thread(RunReadLoop, std::ref(session));
     std::thread writer_thread(RunWriteLoop, std::ref(session));
     
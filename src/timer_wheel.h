@@ -0,0 +1,151 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+An intrusive timer, embedded in whatever it times (e.g. a Session).
+kind and context tell the TimerHandler what the timer is for when it expires.
+*/
+struct TimerNode {
+    TimerNode* prev;
+    TimerNode* next;
+    uint64_t expiry_tick;
+    bool is_armed;
+    int kind;
+    void* context;
+
+    TimerNode(const int kind = 0, void* const context = nullptr)
+        : prev(nullptr)
+        , next(nullptr)
+        , expiry_tick(0)
+        , is_armed(false)
+        , kind(kind)
+        , context(context)
+    {}
+};
+
+/*
+Hierarchical timing wheel: NumLevels wheels of NumSlots slots each, where a slot of level L spans NumSlots^L ticks.
+A timer goes into the coarsest level whose span its delay still fits in, and moves down a level each time the wheel
+below has gone full circle, until it expires from level 0.
+
+Schedule(...) and Cancel(...) are O(1), and Advance(...) costs O(1) per tick plus O(1) per timer expired or cascaded,
+however many timers are armed, so that each of 100k sessions can keep its own timers.
+
+Time is counted in ticks, whose length is up to the owner, who calls Advance(...) with the current tick
+(typically from a periodic timerfd). Delays longer than the wheel's range are clamped to it.
+Single owner: only the loop thread that owns the wheel may call into it.
+*/
+class TimerWheel {
+public:
+    static const unsigned NumBitsPerLevel = 6;
+    static const unsigned NumSlots = 1 << NumBitsPerLevel;
+    static const unsigned NumLevels = 4;
+    static const uint64_t MaxDelayInTicks = (uint64_t(1) << (NumBitsPerLevel * NumLevels)) - 1;
+
+private:
+    // Each slot is a circular list with a sentinel head.
+    TimerNode slots_[NumLevels][NumSlots];
+    uint64_t current_tick_;
+    size_t num_armed_;
+
+    static void Unlink(TimerNode& node) {
+        node.prev->next = node.next;
+        node.next->prev = node.prev;
+        node.prev = node.next = nullptr;
+    }
+
+    void Link(TimerNode& node) {
+        const uint64_t delay = (node.expiry_tick > current_tick_) ? (node.expiry_tick - current_tick_) : 0;
+        unsigned level = 0;
+        while ((level + 1 < NumLevels) && (delay >= (uint64_t(1) << (NumBitsPerLevel * (level + 1))))) {
+            ++level;
+        }
+        TimerNode& head = slots_[level][(node.expiry_tick >> (NumBitsPerLevel * level)) & (NumSlots - 1)];
+        node.prev = head.prev;
+        node.next = &head;
+        head.prev->next = &node;
+        head.prev = &node;
+    }
+
+    // Moves every timer in the slot of level that the wheel has just reached down to the finer levels.
+    void Cascade(const unsigned level) {
+        TimerNode& head = slots_[level][(current_tick_ >> (NumBitsPerLevel * level)) & (NumSlots - 1)];
+        while (head.next != &head) {
+            TimerNode& node = *head.next;
+            Unlink(node);
+            Link(node);
+        }
+    }
+
+public:
+    TimerWheel()
+        : current_tick_(0)
+        , num_armed_(0)
+    {
+        for (unsigned level = 0; level < NumLevels; ++level) {
+            for (unsigned slot = 0; slot < NumSlots; ++slot) {
+                slots_[level][slot].prev = slots_[level][slot].next = &slots_[level][slot];
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    uint64_t CurrentTick() const { return current_tick_; }
+    size_t NumArmed() const { return num_armed_; }
+    bool Empty() const { return 0 == num_armed_; }
+
+    // (Re)arms node to expire delay_in_ticks from now. A delay of 0 expires on the next tick.
+    void Schedule(TimerNode& node, uint64_t delay_in_ticks) {
+        Cancel(node);
+        if (delay_in_ticks < 1) delay_in_ticks = 1;
+        if (delay_in_ticks > MaxDelayInTicks) delay_in_ticks = MaxDelayInTicks;
+        node.expiry_tick = current_tick_ + delay_in_ticks;
+        node.is_armed = true;
+        Link(node);
+        ++num_armed_;
+    }
+
+    void Cancel(TimerNode& node) {
+        if (!node.is_armed) return;
+        Unlink(node);
+        node.is_armed = false;
+        --num_armed_;
+    }
+
+    // Moves the wheel forward to now_tick, handing every timer that expires on the way to timer_handler.
+    // The handler may Schedule(...) or Cancel(...) any timer, including the expiring one.
+    // TimerHandler: Functor signature: void HandleTimer(TimerNode&);
+    template<typename TimerHandler>
+    size_t Advance(const uint64_t now_tick, TimerHandler& timer_handler) {
+        size_t num_expired = 0;
+        while (current_tick_ < now_tick) {
+            if (Empty()) {
+                // Nothing to expire on the way, so skip straight there.
+                current_tick_ = now_tick;
+                break;
+            }
+
+            ++current_tick_;
+            // Each time a level has gone full circle, the next slot of the level above is due to be spread over it.
+            for (unsigned level = 1; level < NumLevels; ++level) {
+                const uint64_t mask_below = (uint64_t(1) << (NumBitsPerLevel * level)) - 1;
+                if (0 != (current_tick_ & mask_below)) break;
+                Cascade(level);
+            }
+
+            TimerNode& head = slots_[0][current_tick_ & (NumSlots - 1)];
+            while (head.next != &head) {
+                TimerNode& node = *head.next;
+                Unlink(node);
+                node.is_armed = false;
+                --num_armed_;
+                ++num_expired;
+                timer_handler.HandleTimer(node);
+            }
+        }
+        return num_expired;
+    }
+};
@@ -0,0 +1,165 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include "application_messages.h"
+#include "wire_format.h"
+#include "loop_command_queue.h"
+
+/*
+Which sessions of a loop are subscribed to which topics, so that a publish touches the subscribers of its topic
+and no other session, however many the loop has.
+
+A topic gets a dense id when it gets its first subscriber (ids of topics left without subscribers are reused),
+and its subscribers are a contiguous array of fds: a publish costs one hash lookup of its topic, then a walk of
+that array. The topics of each fd are kept too (indexed by fd, like Sessions), so that a session that goes is taken
+out of its own topics without looking at any other. Unsubscribing finds the fd in its topic's array and moves
+the last subscriber into its place, so the order of subscribers is not kept.
+
+Single owner: only the loop thread may call into it.
+*/
+class TopicIndex {
+    struct Topic {
+        std::string name;
+        std::vector<int> subscriber_fds;
+    };
+
+    std::unordered_map<std::string, uint32_t> topic_ids_;
+    std::vector<Topic> topics_;
+    std::vector<uint32_t> free_topic_ids_;
+    std::vector<std::vector<uint32_t>> topic_ids_of_fd_;
+    size_t num_subscriptions_;
+
+    TopicIndex(const TopicIndex&) = delete;
+    TopicIndex& operator=(const TopicIndex&) = delete;
+
+    // Takes fd out of the subscribers of topic_id, and frees topic_id if that was its last subscriber.
+    // The topics of fd are left to the caller.
+    void RemoveSubscriber(const int fd, const uint32_t topic_id) {
+        Topic& topic = topics_[topic_id];
+        const auto it = std::find(topic.subscriber_fds.begin(), topic.subscriber_fds.end(), fd);
+        if (it != topic.subscriber_fds.end()) {
+            *it = topic.subscriber_fds.back();
+            topic.subscriber_fds.pop_back();
+            --num_subscriptions_;
+        }
+        if (topic.subscriber_fds.empty()) {
+            topic_ids_.erase(topic.name);
+            topic.name.clear();
+            free_topic_ids_.push_back(topic_id);
+        }
+    }
+
+public:
+    TopicIndex()
+        : num_subscriptions_(0)
+    {}
+
+    size_t NumTopics() const { return topic_ids_.size(); }
+    size_t NumSubscriptions() const { return num_subscriptions_; }
+
+    // Returns false if fd was already subscribed to topic.
+    bool Subscribe(const int fd, const std::string_view topic) {
+        if (fd < 0) return false;
+        std::string name(topic);
+        uint32_t topic_id = 0;
+        const auto found = topic_ids_.find(name);
+        if (found != topic_ids_.end()) {
+            topic_id = found->second;
+        }
+        else {
+            if (free_topic_ids_.empty()) {
+                topic_id = static_cast<uint32_t>(topics_.size());
+                topics_.push_back(Topic());
+            }
+            else {
+                topic_id = free_topic_ids_.back();
+                free_topic_ids_.pop_back();
+            }
+            topics_[topic_id].name = name;
+            topic_ids_.emplace(std::move(name), topic_id);
+        }
+
+        if (static_cast<size_t>(fd) >= topic_ids_of_fd_.size()) {
+            topic_ids_of_fd_.resize(fd + 1);
+        }
+        std::vector<uint32_t>& topic_ids = topic_ids_of_fd_[fd];
+        if (std::find(topic_ids.begin(), topic_ids.end(), topic_id) != topic_ids.end()) return false;
+        topic_ids.push_back(topic_id);
+        topics_[topic_id].subscriber_fds.push_back(fd);
+        ++num_subscriptions_;
+        return true;
+    }
+
+    // Returns false if fd was not subscribed to topic.
+    bool Unsubscribe(const int fd, const std::string_view topic) {
+        if ((fd < 0) || (static_cast<size_t>(fd) >= topic_ids_of_fd_.size())) return false;
+        const auto found = topic_ids_.find(std::string(topic));
+        if (found == topic_ids_.end()) return false;
+        const uint32_t topic_id = found->second;
+        std::vector<uint32_t>& topic_ids = topic_ids_of_fd_[fd];
+        const auto it = std::find(topic_ids.begin(), topic_ids.end(), topic_id);
+        if (it == topic_ids.end()) return false;
+        *it = topic_ids.back();
+        topic_ids.pop_back();
+        RemoveSubscriber(fd, topic_id);
+        return true;
+    }
+
+    // For a session that goes. Returns the number of topics it was subscribed to.
+    size_t UnsubscribeAll(const int fd) {
+        if ((fd < 0) || (static_cast<size_t>(fd) >= topic_ids_of_fd_.size())) return 0;
+        std::vector<uint32_t>& topic_ids = topic_ids_of_fd_[fd];
+        const size_t num_topics = topic_ids.size();
+        for (const uint32_t topic_id : topic_ids) {
+            RemoveSubscriber(fd, topic_id);
+        }
+        topic_ids.clear();
+        return num_topics;
+    }
+
+    // nullptr if topic has no subscribers. 
+    // ATTENTION: Unsubscribing any fd of it moves the last one into its place, so walk it backwards if that may happen.
+    const std::vector<int>* SubscribersOf(const std::string_view topic) const {
+        const auto found = topic_ids_.find(std::string(topic));
+        if (found == topic_ids_.end()) return nullptr;
+        return &topics_[found->second].subscriber_fds;
+    }
+};
+
+// The topic of a Publish frame in v1 (as LoopCommand_Publish carries it). Empty if it is not one.
+inline std::string_view TopicOfV1PublishFrame(const std::vector<char>& frame) {
+    if (frame.size() < sizeof(Header)) return std::string_view();
+    FrameView frame_view = { &frame[0], frame.size() };
+    WireV1HeaderPolicy().DecodeHeader(frame_view);
+    Publish publish;
+    if ((MsgType_Publish != frame_view.type) || (frame_view.num_body_bytes < Publish::min_num_body_bytes) 
+        || (!Publish::Decode(frame_view.body, frame_view.num_body_bytes, publish))) return std::string_view();
+    return publish.topic;
+}
+
+/*
+How a publish gets to every loop, as subscribers of a topic may be on any of them: each loop Join(...)s with its 
+LoopCommandQueue before any loop runs, and Publish(...) posts the frame to every loop, which passes it on to 
+the subscribers in its own TopicIndex. A publish costs one post per loop plus one append per subscriber.
+
+Publish(...) is thread-safe once every loop has joined.
+*/
+class TopicBus {
+    std::vector<LoopCommandQueue*> loops_;
+public:
+    void Join(LoopCommandQueue& command_queue) {
+        loops_.push_back(&command_queue);
+    }
+
+    // v1_frame: a Publish frame in v1.
+    void Publish(char const* const v1_frame_ptr, const size_t n) {
+        for (LoopCommandQueue* const command_queue : loops_) {
+            command_queue->PostPublish(v1_frame_ptr, n);
+        }
+    }
+};
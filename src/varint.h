@@ -0,0 +1,27 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// LEB128 varints: 7 bits a byte, least significant first, with the top bit set on every byte but the last.
+static const size_t MaxVarintSize = 10;
+
+inline size_t WriteVarint(uint64_t value, char* const p) {
+    size_t n = 0;
+    while (value >= 0x80) {
+        p[n++] = static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    p[n++] = static_cast<char>(value);
+    return n;
+}
+
+// Returns the number of bytes the varint at p takes, or 0 if it does not end within the n bytes there.
+inline size_t ReadVarint(char const* const p, const size_t n, uint64_t& value) {
+    value = 0;
+    for (size_t i = 0; (i < n) && (i < MaxVarintSize); ++i) {
+        const uint8_t byte = static_cast<uint8_t>(p[i]);
+        value |= static_cast<uint64_t>(byte & 0x7f) << (7 * i);
+        if (0 == (byte & 0x80)) return i + 1;
+    }
+    return 0;
+}
@@ -0,0 +1,242 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+#include "varint.h"
+#include "application_messages.h"
+#include "frame_handler.h"
+
+/*
+Two wire formats, which differ only in how a frame's header is laid out:
+
+wire v1: [length: size_t, host order, counting the whole frame][type: 1 byte][body]            9 header bytes
+wire v2: [length: varint, counting what follows it][type: 1 byte][flags: 1 byte][body]      3 header bytes below 128
+
+A connection starts in v1, so that v1 peers never see anything else. A client that speaks v2 sends a Hello (in v1) as
+its first frame, and sends nothing else until it hears back:
+- a v2 server answers with a Hello carrying the version to use (the lower of the two ends' newest), after which each
+  direction continues in that version. Each end switches its decoding right after the Hello it receives
+  (NegotiatedHeaderPolicy) and its encoding right after the Hello it sends (or, for the client, receives).
+- a v1 server Acks the Hello like any other message, which tells the client to stay in v1.
+*/
+enum WireVersion {
+    // Not agreed yet, only while a client waits for the answer to its Hello.
+    WireVersion_Unknown = 0,
+    WireVersion_1 = 1,
+    WireVersion_2 = 2,
+    WireVersion_Newest = WireVersion_2,
+};
+
+// The type given to frames too short to have one, which no registered message has.
+static const uint8_t MsgType_None = 0xff;
+
+/*
+Header-decoding policies for LengthPrefixedStreamDeserialiser:
+    // Returns false until enough of the frame has arrived to tell its length (which includes the header).
+    bool DecodeLength(char const* const p, const size_t n, size_t& num_bytes_in_frame) const;
+    // Fills in frame.body, num_body_bytes, type and flags, from frame.ptr and frame.n.
+    void DecodeHeader(FrameView& frame) const;
+    // Called on every frame cut, in order. Returns true if the frames after it are in another format.
+    bool OnFrameCut(const FrameView& frame);
+    // For a new connection.
+    void Reset();
+    // The most a header can take, i.e. what a frame's first piece must hold to be decoded.
+    static const size_t MaxHeaderSize;
+*/
+struct WireV1HeaderPolicy {
+    static const size_t MaxHeaderSize = sizeof(Header);
+
+    bool DecodeLength(char const* const p, const size_t n, size_t& num_bytes_in_frame) const {
+        if (n < sizeof(Header::length)) return false;
+        size_t length = 0;
+        memcpy(&length, p, sizeof(length));
+        // ATTENTION: Since the length field includes its own size,
+        // even if the length value is less than the size of the length field itself,
+        // we will still consider the frame length to be the size of the length field.
+        // Hence the std::max.
+        num_bytes_in_frame = std::max(sizeof(length), length);
+        return true;
+    }
+
+    void DecodeHeader(FrameView& frame) const {
+        if (frame.n < sizeof(Header)) {
+            frame.body = frame.ptr + frame.n;
+            frame.num_body_bytes = 0;
+            frame.type = MsgType_None;
+            frame.flags = 0;
+            return;
+        }
+        frame.body = frame.ptr + sizeof(Header);
+        frame.num_body_bytes = frame.n - sizeof(Header);
+        frame.type = static_cast<uint8_t>(frame.ptr[sizeof(Header::length)]);
+        frame.flags = 0;
+    }
+
+    bool OnFrameCut(const FrameView&) { return false; }
+    void Reset() {}
+};
+
+struct WireV2HeaderPolicy {
+    static const size_t MaxHeaderSize = MaxVarintSize + 2;
+
+    bool DecodeLength(char const* const p, const size_t n, size_t& num_bytes_in_frame) const {
+        uint64_t length = 0;
+        const size_t num_length_bytes = ReadVarint(p, n, length);
+        if (0 == num_length_bytes) {
+            if (n < MaxVarintSize) return false;
+            // Not a varint at all: as good as endless, which the deserialiser's max_frame_size rejects.
+            num_bytes_in_frame = SIZE_MAX;
+            return true;
+        }
+        num_bytes_in_frame = (length > (SIZE_MAX - num_length_bytes)) ? SIZE_MAX : (num_length_bytes + length);
+        return true;
+    }
+
+    void DecodeHeader(FrameView& frame) const {
+        uint64_t length = 0;
+        const size_t num_length_bytes = ReadVarint(frame.ptr, frame.n, length);
+        if ((0 == num_length_bytes) || (frame.n < num_length_bytes + 2)) {
+            frame.body = frame.ptr + frame.n;
+            frame.num_body_bytes = 0;
+            frame.type = MsgType_None;
+            frame.flags = 0;
+            return;
+        }
+        frame.type = static_cast<uint8_t>(frame.ptr[num_length_bytes]);
+        frame.flags = static_cast<uint8_t>(frame.ptr[num_length_bytes + 1]);
+        frame.body = frame.ptr + num_length_bytes + 2;
+        frame.num_body_bytes = frame.n - num_length_bytes - 2;
+    }
+
+    bool OnFrameCut(const FrameView&) { return false; }
+    void Reset() {}
+};
+
+// Starts in v1, and moves to the version a Hello agrees on, right after that Hello (see above).
+// Both formats go through the same deserialiser code: only these calls branch on the version.
+class NegotiatedHeaderPolicy {
+    WireVersion version_;
+    WireV1HeaderPolicy v1_;
+    WireV2HeaderPolicy v2_;
+public:
+    static const size_t MaxHeaderSize = WireV2HeaderPolicy::MaxHeaderSize;
+
+    NegotiatedHeaderPolicy() : version_(WireVersion_1) {}
+
+    WireVersion Version() const { return version_; }
+    void Reset() { version_ = WireVersion_1; }
+
+    bool DecodeLength(char const* const p, const size_t n, size_t& num_bytes_in_frame) const {
+        return (WireVersion_2 == version_) ? v2_.DecodeLength(p, n, num_bytes_in_frame) : v1_.DecodeLength(p, n, num_bytes_in_frame);
+    }
+
+    void DecodeHeader(FrameView& frame) const {
+        if (WireVersion_2 == version_) {
+            v2_.DecodeHeader(frame);
+        }
+        else {
+            v1_.DecodeHeader(frame);
+        }
+    }
+
+    bool OnFrameCut(const FrameView& frame) {
+        if ((WireVersion_1 != version_) || (MsgType_Hello != frame.type) || (frame.num_body_bytes < sizeof(Hello))) return false;
+        const uint8_t offered = static_cast<uint8_t>(frame.body[0]);
+        const WireVersion agreed = (offered >= WireVersion_Newest) ? WireVersion_Newest : WireVersion_1;
+        if (agreed == version_) return false;
+        version_ = agreed;
+        return true;
+    }
+};
+
+// The header of a frame of type, with num_body_bytes of body, in version, written to p (which has room for
+// WireV2HeaderPolicy::MaxHeaderSize bytes). Returns its size. v1 has no flags.
+inline size_t EncodeHeader(const WireVersion version, const uint8_t type, const size_t num_body_bytes, char* const p, const uint8_t flags = 0) {
+    if (WireVersion_2 == version) {
+        const size_t n = WriteVarint(num_body_bytes + 2, p);
+        p[n] = static_cast<char>(type);
+        p[n + 1] = static_cast<char>(flags);
+        return n + 2;
+    }
+    const Header header = { sizeof(Header) + num_body_bytes, static_cast<char>(type) };
+    memcpy(p, &header, sizeof(header));
+    return sizeof(header);
+}
+
+// Writes a whole frame of type with the given body to p. Returns its size.
+inline size_t EncodeFrame(const WireVersion version, const uint8_t type, char const* const body_ptr, const size_t num_body_bytes, char* const p, const uint8_t flags = 0) {
+    const size_t num_header_bytes = EncodeHeader(version, type, num_body_bytes, p, flags);
+    if (num_body_bytes > 0) {
+        memcpy(p + num_header_bytes, body_ptr, num_body_bytes);
+    }
+    return num_header_bytes + num_body_bytes;
+}
+
+// The most EncodeMsg(...) can write for a T.
+template<typename T>
+constexpr size_t MaxEncodedMsgSize() {
+    return WireV2HeaderPolicy::MaxHeaderSize + (std::is_empty<T>::value ? 1 : sizeof(T));
+}
+
+// Writes msg as a frame in version to p. Returns its size.
+// In v1 the bytes are those of FixedSizeMsg<T>, as v1 peers have always had them. In v2 an empty body takes no bytes.
+template<typename T>
+size_t EncodeMsg(const WireVersion version, const T& msg, char* const p) {
+    if (WireVersion_2 != version) {
+        const FixedSizeMsg<T> fixed_size_msg(msg);
+        memcpy(p, &fixed_size_msg, sizeof(fixed_size_msg));
+        return sizeof(fixed_size_msg);
+    }
+    return EncodeFrame(version, T::msg_type, (char const*)(&msg), std::is_empty<T>::value ? 0 : sizeof(T), p);
+}
+
+// A CompactAck is only ever sent in v2.
+inline size_t EncodeMsg(const WireVersion version, const CompactAck& msg, char* const p, const uint8_t flags = 0) {
+    char body[MaxVarintSize];
+    return EncodeFrame(version, CompactAck::msg_type, body, WriteVarint(msg.seq, body), p, flags);
+}
+
+// SerialiserType: Serialiser or WaitableSerialiser.
+template<typename SerialiserType, typename T>
+void AppendMsg(SerialiserType& serialiser, const WireVersion version, const T& msg) {
+    char frame[MaxEncodedMsgSize<T>()];
+    serialiser.AppendFrame(frame, EncodeMsg(version, msg, frame));
+}
+
+// A Subscribe or Unsubscribe (type) of topic, as a frame in version.
+inline std::vector<char> MakeTopicFrame(const WireVersion version, const uint8_t type, const std::string_view topic) {
+    std::vector<char> frame(WireV2HeaderPolicy::MaxHeaderSize + topic.size());
+    frame.resize(EncodeFrame(version, type, topic.data(), topic.size(), &frame[0]));
+    return frame;
+}
+
+// A Publish of payload to topic, as a frame in version: the header, then the topic's length, the topic and the payload,
+// each appended to a frame sized from the encoded header.
+inline std::vector<char> MakePublishFrame(const WireVersion version, const std::string_view topic, const std::string_view payload) {
+    char topic_length[MaxVarintSize];
+    const size_t num_topic_length_bytes = WriteVarint(topic.size(), topic_length);
+    const size_t num_body_bytes = num_topic_length_bytes + topic.size() + payload.size();
+    char header[WireV2HeaderPolicy::MaxHeaderSize];
+    const size_t num_header_bytes = EncodeHeader(version, Publish::msg_type, num_body_bytes, header);
+
+    std::vector<char> frame;
+    frame.reserve(num_header_bytes + num_body_bytes);
+    frame.insert(frame.end(), header, header + num_header_bytes);
+    frame.insert(frame.end(), topic_length, topic_length + num_topic_length_bytes);
+    frame.insert(frame.end(), topic.begin(), topic.end());
+    frame.insert(frame.end(), payload.begin(), payload.end());
+    return frame;
+}
+
+// The same frame in version, given a frame in v1 (e.g. made by the console input loop).
+inline std::vector<char> ReencodeV1Frame(char const* const frame_ptr, const size_t n, const WireVersion version) {
+    if (WireVersion_2 != version) return std::vector<char>(frame_ptr, frame_ptr + n);
+    FrameView frame = { frame_ptr, n };
+    WireV1HeaderPolicy().DecodeHeader(frame);
+    std::vector<char> reencoded(WireV2HeaderPolicy::MaxHeaderSize + frame.num_body_bytes);
+    reencoded.resize(EncodeFrame(version, frame.type, frame.body, frame.num_body_bytes, &reencoded[0]));
+    return reencoded;
+}
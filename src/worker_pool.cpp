@@ -0,0 +1,92 @@
+#include "worker_pool.h"
+#include "logging.h"
+
+WorkerPool::WorkerPool(const size_t num_threads)
+    : next_worker_(0)
+    , num_jobs_(0)
+    , is_stopping_(false)
+{
+    for (size_t i = 0; i < num_threads; ++i) {
+        workers_.push_back(std::make_unique<Worker>());
+    }
+    // Only once every worker exists, as any of them may be stolen from.
+    for (size_t i = 0; i < num_threads; ++i) {
+        threads_.emplace_back(&WorkerPool::Run, this, i);
+    }
+    log::PrintLn(log::Info, "Running %zu worker thread(s)", num_threads);
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex_);
+        is_stopping_ = true;
+    }
+    has_jobs_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+    for (auto& worker : workers_) {
+        for (LoopCommand* const job : worker->jobs) {
+            delete job;
+        }
+    }
+}
+
+void WorkerPool::Submit(LoopCommand* const job) {
+    Worker& worker = *workers_[next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size()];
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        worker.jobs.push_back(job);
+    }
+    num_jobs_.fetch_add(1, std::memory_order_seq_cst);
+    // Taking idle_mutex_ orders this against a worker that has just found nothing and is about to wait.
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex_);
+    }
+    has_jobs_.notify_one();
+}
+
+// Own jobs first (oldest first), then the newest job of any other worker. Returns nullptr if there are none.
+LoopCommand* WorkerPool::TakeJob(const size_t worker_index) {
+    for (size_t i = 0; i < workers_.size(); ++i) {
+        const bool is_own = (0 == i);
+        Worker& worker = *workers_[(worker_index + i) % workers_.size()];
+        std::unique_lock<std::mutex> lock(worker.mutex, std::defer_lock);
+        if (is_own) {
+            lock.lock();
+        }
+        // A worker busy with its own deque is skipped rather than waited for.
+        else if (!lock.try_lock()) {
+            continue;
+        }
+        if (worker.jobs.empty()) continue;
+
+        LoopCommand* job = nullptr;
+        if (is_own) {
+            job = worker.jobs.front();
+            worker.jobs.pop_front();
+        }
+        else {
+            job = worker.jobs.back();
+            worker.jobs.pop_back();
+        }
+        num_jobs_.fetch_sub(1, std::memory_order_seq_cst);
+        return job;
+    }
+    return nullptr;
+}
+
+void WorkerPool::Run(const size_t worker_index) {
+    while (1) {
+        LoopCommand* const job = TakeJob(worker_index);
+        if (job) {
+            job->work(*job);
+            job->reply_queue->Post(job);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(idle_mutex_);
+        has_jobs_.wait(lock, [this]() { return is_stopping_ || (num_jobs_.load(std::memory_order_seq_cst) > 0); });
+        if (is_stopping_) return;
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+#include <stddef.h>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+#include "loop_command_queue.h"
+
+/*
+Threads that run CPU-heavy frame handlers off the server loops (see frame_offloader.h), so that one expensive frame does not
+stall every other session of its loop.
+
+A job is a LoopCommand of type LoopCommand_OffloadedFrame: a worker calls its work(...), then posts it to its reply_queue,
+which is how the result gets back to the loop that owns the session (lock-free, see LoopCommandQueue).
+
+Each worker has its own deque of jobs, which Submit(...) fills round robin. A worker takes jobs from the front of its own,
+and once that is empty steals from the back of the others', so that a few slow jobs do not hold up the jobs queued
+behind them while other workers are idle. Workers with nothing to do sleep until a job is submitted.
+Jobs of one session may complete in any order: putting them back in order is up to the loop.
+*/
+class WorkerPool {
+    struct Worker {
+        std::mutex mutex;
+        std::deque<LoopCommand*> jobs;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+    std::atomic<size_t> next_worker_;
+    // Jobs submitted and not taken yet, across all workers.
+    std::atomic<size_t> num_jobs_;
+    std::mutex idle_mutex_;
+    std::condition_variable has_jobs_;
+    bool is_stopping_;
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    LoopCommand* TakeJob(const size_t worker_index);
+    void Run(const size_t worker_index);
+
+public:
+    WorkerPool(const size_t num_threads);
+    // Waits for the jobs already taken. Jobs not taken yet are deleted unrun.
+    ~WorkerPool();
+
+    size_t NumThreads() const { return threads_.size(); }
+
+    // Thread-safe. Takes ownership of job until it is posted back.
+    void Submit(LoopCommand* const job);
+};